@@ -0,0 +1,1136 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+/*
+  Command-line front end to the tuning-difference analysis, for
+  comparing audio files without a Vamp host. Each file is decoded,
+  mixed to mono and resampled to the rate of the first on a thread of
+  its own, and the results fed to the plugin as the channels of a
+  single input, which the plugin then analyses in parallel.
+*/
+
+#include "src/TuningDifference.h"
+#include "src/SPSCQueue.h"
+#include "src/AnalysisQueue.h"
+
+#include <src/dsp/Resampler.h>
+
+#include <cq/CQKernel.h>
+#include <cq/TaskScheduler.h>
+
+#include <sndfile.h>
+
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <future>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <set>
+#include <map>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <limits>
+
+#include <getopt.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#endif
+
+using namespace std;
+
+// Blocks of input decoded ahead of the analysis, per file
+static const int queuedBlocks = 32;
+
+/**
+ * Decodes one audio file on a thread of its own into mono blocks at
+ * the analysis rate, to be taken one at a time with read().
+ */
+class Decoder
+{
+public:
+    Decoder(string filename, int blockSize) :
+        m_filename(filename),
+        m_blockSize(blockSize),
+        m_sndfile(0),
+        m_rate(0),
+        m_queue(queuedBlocks),
+        m_finished(false),
+        m_cancelled(false)
+    {
+        memset(&m_info, 0, sizeof(SF_INFO));
+        m_sndfile = sf_open(filename.c_str(), SFM_READ, &m_info);
+        if (!m_sndfile) {
+            throw runtime_error("Failed to open audio file \"" + filename +
+                                "\": " + sf_strerror(0));
+        }
+    }
+
+    ~Decoder() {
+        if (m_thread.joinable()) {
+            {
+                lock_guard<mutex> lock(m_mutex);
+                m_cancelled = true;
+            }
+            m_condition.notify_all();
+            m_thread.join();
+        }
+        sf_close(m_sndfile);
+    }
+
+    string getFilename() const { return m_filename; }
+    int getFileSampleRate() const { return m_info.samplerate; }
+    double getFileDuration() const {
+        return double(m_info.frames) / m_info.samplerate;
+    }
+    int64_t getFrames(int rate) const {
+        return (int64_t(m_info.frames) * rate) / m_info.samplerate;
+    }
+
+    /**
+     * Start decoding, resampling to the given rate if it differs
+     * from the file's own, from startFrame at that rate up to
+     * endFrame or the end of the file.
+     */
+    void start(int rate, int64_t startFrame, int64_t endFrame) {
+        m_rate = rate;
+        if (m_info.samplerate != rate) {
+            m_resampler.reset(new Resampler(m_info.samplerate, rate));
+        }
+        m_thread = thread([this, startFrame, endFrame]() {
+                run(startFrame, endFrame);
+            });
+    }
+
+    /**
+     * Fill the given block, padding it with zeros past the end of
+     * the file. Return false if the file had already ended. Throw
+     * std::runtime_error if it could not be decoded.
+     */
+    bool read(vector<float> &block) {
+        unique_lock<mutex> lock(m_mutex);
+        m_condition.wait(lock, [&]() {
+                return !m_queue.isEmpty() || m_finished;
+            });
+        if (!m_queue.pop(block)) {
+            if (m_error != "") {
+                throw runtime_error(m_error);
+            }
+            return false;
+        }
+        lock.unlock();
+        m_condition.notify_all();
+        return true;
+    }
+
+private:
+    string m_filename;
+    int m_blockSize;
+    SNDFILE *m_sndfile;
+    SF_INFO m_info;
+    int m_rate;
+    unique_ptr<Resampler> m_resampler;
+    SPSCQueue<vector<float>> m_queue;
+    mutex m_mutex;
+    condition_variable m_condition;
+    bool m_finished;
+    bool m_cancelled;
+    string m_error;
+    thread m_thread;
+
+    void run(int64_t startFrame, int64_t endFrame) {
+        try {
+            decode(startFrame, endFrame);
+        } catch (const std::exception &e) {
+            lock_guard<mutex> lock(m_mutex);
+            m_error = e.what();
+        }
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_finished = true;
+        }
+        m_condition.notify_all();
+    }
+
+    void decode(int64_t startFrame, int64_t endFrame) {
+
+        int channels = m_info.channels;
+
+        // Without resampling we can seek straight to the start.
+        // Otherwise the resampler is fed from the start of the file,
+        // and its output before the start frame dropped, so that
+        // what follows is the same as when decoding the whole file
+
+        int64_t skip = startFrame;
+        if (skip > 0 && !m_resampler) {
+            if (sf_seek(m_sndfile, skip, SEEK_SET) < 0) return;
+            skip = 0;
+        }
+        vector<float> interleaved(size_t(m_blockSize) * channels);
+        vector<double> mixed(m_blockSize);
+
+        // The resampler delays its output by its latency, which is
+        // dropped from the start. At the end of the file it is fed
+        // with silence until it has produced the output due for all
+        // of the file
+
+        int latency = m_resampler ? m_resampler->getLatency() : 0;
+        int64_t inputFrames = 0;
+        int64_t outputFrames = 0;
+        bool ended = false;
+
+        vector<float> pending;
+        vector<float> block;
+        int64_t written = 0;
+
+        while (written < endFrame - startFrame) {
+
+            int n = 0;
+            if (!ended) {
+                n = int(sf_readf_float(m_sndfile, interleaved.data(),
+                                       m_blockSize));
+                if (n < m_blockSize) {
+                    if (sf_error(m_sndfile) != SF_ERR_NO_ERROR) {
+                        throw runtime_error
+                            ("Failed to decode audio file \"" + m_filename +
+                             "\": " + sf_strerror(m_sndfile));
+                    }
+                    ended = true;
+                }
+                for (int i = 0; i < n; ++i) {
+                    double sum = 0.0;
+                    for (int c = 0; c < channels; ++c) {
+                        sum += interleaved[size_t(i) * channels + c];
+                    }
+                    mixed[i] = sum / channels;
+                }
+                inputFrames += n;
+            }
+
+            if (!m_resampler) {
+                if (n == 0) break;
+                pending.insert(pending.end(), mixed.begin(), mixed.begin() + n);
+            } else {
+                int64_t due = (inputFrames * m_rate) / m_info.samplerate;
+                if (n == 0) {
+                    if (outputFrames >= due) break;
+                    n = m_blockSize;
+                    fill(mixed.begin(), mixed.end(), 0.0);
+                }
+                vector<double> out = m_resampler->process(mixed.data(), n);
+                for (auto v: out) {
+                    if (latency > 0) {
+                        --latency;
+                    } else if (outputFrames < due || !ended) {
+                        pending.push_back(float(v));
+                        ++outputFrames;
+                    }
+                }
+            }
+
+            size_t consumed = 0;
+            if (skip > 0) {
+                consumed = size_t(min(skip, int64_t(pending.size())));
+                skip -= int64_t(consumed);
+            }
+            while (pending.size() - consumed >= size_t(m_blockSize)) {
+                block.assign(pending.begin() + consumed,
+                             pending.begin() + consumed + m_blockSize);
+                consumed += m_blockSize;
+                if (!push(block)) return;
+                written += m_blockSize;
+            }
+            pending.erase(pending.begin(), pending.begin() + consumed);
+        }
+
+        if (!pending.empty() && written < endFrame - startFrame) {
+            pending.resize(m_blockSize, 0.f);
+            push(pending);
+        }
+    }
+
+    bool push(vector<float> &block) {
+        unique_lock<mutex> lock(m_mutex);
+        m_condition.wait(lock, [&]() {
+                return !m_queue.isFull() || m_cancelled;
+            });
+        if (m_cancelled) return false;
+        m_queue.push(block);
+        lock.unlock();
+        m_condition.notify_all();
+        return true;
+    }
+};
+
+struct Options {
+    Options() :
+        maxDuration(-1.f), deadline(-1.f), stable(-1.f), windows(0),
+        windowDuration(10.f), gate(0.f), maxRange(-1.f), references(1),
+        coarse(false), priority(0), segmentStart(-1.0), segmentEnd(-1.0),
+        merge(false), checkpointInterval(60.f) { }
+    float maxDuration;
+    float deadline;
+    float stable;
+    int windows;
+    float windowDuration;
+    float gate;
+    float maxRange;
+    int references;
+    bool coarse;
+    int priority;
+    double segmentStart;
+    double segmentEnd; // or negative for the end of the files
+    string saveState;
+    bool merge;
+    string checkpoint;
+    float checkpointInterval;
+    string resume;
+};
+
+struct Result {
+    string reference;
+    string other;
+    float cents;
+    float hz;
+    int stages;
+    int probes;
+};
+
+/**
+ * Return the plugin parameters that determine the layout of the
+ * analysis state, which must be the same when analysing and when
+ * finishing from saved states.
+ */
+static map<string, float>
+getParameters(const Options &options)
+{
+    map<string, float> parameters;
+    if (options.maxRange >= 0.f) {
+        parameters["maxrange"] = options.maxRange;
+    }
+    parameters["references"] = float(options.references);
+    if (options.coarse) {
+        parameters["finetuning"] = 0.f;
+    }
+    return parameters;
+}
+
+/**
+ * Open the given files, the first options.references of them being
+ * references, and queue them for analysis. Throw std::runtime_error
+ * or std::invalid_argument if they cannot be opened.
+ */
+static AnalysisQueue::Job
+submit(AnalysisQueue &queue, const vector<string> &filenames,
+       const Options &options)
+{
+    if (options.references < 1 ||
+        int(filenames.size()) <= options.references) {
+        throw invalid_argument("Need more files than references");
+    }
+    
+    const int blockSize = AnalysisQueue::blockSize;
+    auto decoders = make_shared<vector<unique_ptr<Decoder>>>();
+    for (const auto &f: filenames) {
+        decoders->push_back(unique_ptr<Decoder>(new Decoder(f, blockSize)));
+    }
+    int channels = int(decoders->size());
+    int rate = (*decoders)[0]->getFileSampleRate();
+
+    AnalysisQueue::Request request;
+    request.sampleRate = float(rate);
+    request.channels = channels;
+    request.parameters = getParameters(options);
+    if (options.maxDuration >= 0.f) {
+        request.parameters["maxduration"] = options.maxDuration;
+    }
+    if (options.deadline >= 0.f) {
+        request.parameters["deadline"] = options.deadline;
+    }
+    if (options.stable >= 0.f) {
+        request.parameters["stable"] = options.stable;
+    }
+
+    // Windows are spread over the shortest file, so that every
+    // window has audio in every file
+    
+    if (options.windows > 0) {
+        double shortest = 0.0;
+        for (const auto &d: *decoders) {
+            double duration = d->getFileDuration();
+            if (shortest == 0.0 || duration < shortest) shortest = duration;
+        }
+        request.parameters["samplewindow"] = options.windowDuration;
+        request.parameters["samplespacing"] =
+            float(shortest / options.windows);
+    }
+    if (options.gate < 0.f) {
+        request.parameters["silencegate"] = options.gate;
+    }
+
+    // Segments are given in seconds, and rounded to frames at the
+    // analysis rate the same way at either side of a boundary, so
+    // that the segments of a partition meet exactly. A segment
+    // without an end runs to the end of the longest file, where the
+    // analysis of the whole would end
+    
+    if (options.segmentStart >= 0.0) {
+        request.segmentStart = llround(options.segmentStart * rate);
+        if (options.segmentEnd >= 0.0) {
+            request.segmentEnd = llround(options.segmentEnd * rate);
+        } else {
+            for (const auto &d: *decoders) {
+                request.segmentEnd = max(request.segmentEnd,
+                                         d->getFrames(rate));
+            }
+        }
+        if (request.segmentEnd <= request.segmentStart) {
+            throw invalid_argument("Segment is empty or past the end "
+                                   "of the files");
+        }
+    }
+
+    // A resumed analysis is given the end of the input as well,
+    // which it cannot otherwise tell from the padding of the last
+    // block, so that it counts its input exactly as the original
+    // would have
+    
+    if (options.resume != "") {
+        auto checkpoint = make_shared<TuningState>();
+        checkpoint->load(options.resume);
+        request.resume = checkpoint;
+        if (options.segmentStart < 0.0) {
+            request.segmentStart = 0;
+            request.segmentEnd = 0;
+            for (const auto &d: *decoders) {
+                request.segmentEnd = max(request.segmentEnd,
+                                         d->getFrames(rate));
+            }
+        }
+    }
+
+    // Checkpoints are written to a temporary file and renamed over
+    // the last, so that there is always a complete one to resume from
+    
+    if (options.checkpoint != "") {
+        string path = options.checkpoint;
+        request.checkpointInterval =
+            max(int64_t(1), int64_t(options.checkpointInterval * rate));
+        request.checkpoint = [path](const TuningState &state) {
+            string temporary = path + ".tmp";
+            state.save(temporary);
+            if (rename(temporary.c_str(), path.c_str()) != 0) {
+                remove(temporary.c_str());
+                throw runtime_error("Failed to write checkpoint to " + path);
+            }
+        };
+    }
+
+    // The plugin ignores input past the maximum duration, so there
+    // is no need to decode it
+
+    int64_t maxFrames = INT64_MAX;
+    if (options.maxDuration > 0.f) {
+        maxFrames = (int64_t(options.maxDuration * float(rate)) / blockSize
+                     + 1) * blockSize;
+    }
+
+    // The files are not decoded until the job starts, so that jobs
+    // waiting in the queue hold no threads, and then only from where
+    // the analysis needs them. Files that have ended are padded with
+    // silence while the others continue. Silence adds nothing to a
+    // channel's chroma profile, which is normalised, so the results
+    // are the same as for the files alone
+
+    request.seek = [decoders, rate, maxFrames]
+        (int64_t startFrame, int64_t endFrame) {
+        for (auto &d: *decoders) {
+            d->start(rate, startFrame, min(endFrame, maxFrames));
+        }
+    };
+
+    vector<bool> ended(channels, false);
+
+    request.source = [decoders, ended]
+        (vector<vector<float>> &blocks) mutable -> int {
+        bool any = false;
+        for (int c = 0; c < int(blocks.size()); ++c) {
+            if (!ended[c]) {
+                if ((*decoders)[c]->read(blocks[c])) {
+                    any = true;
+                    continue;
+                }
+                ended[c] = true;
+            }
+            blocks[c].assign(blockSize, 0.f);
+        }
+        return any ? blockSize : 0;
+    };
+
+    return queue.submit(request, options.priority);
+}
+
+/**
+ * Return the results of a job submitted with submit(), ordered by
+ * reference and then by other file.
+ */
+static vector<Result>
+getResults(const vector<string> &filenames, const Options &options,
+           const AnalysisQueue::Result &result)
+{
+    vector<Result> results;
+    int others = int(filenames.size()) - options.references;
+    for (int i = 0; i < int(result.cents.size()) &&
+             i < int(result.frequencies.size()); ++i) {
+        Result r;
+        r.reference = filenames[i / others];
+        r.other = filenames[options.references + i % others];
+        r.cents = result.cents[i];
+        r.hz = result.frequencies[i];
+        r.stages = (i < int(result.stages.size()) ?
+                    int(result.stages[i]) : 0);
+        r.probes = (i < int(result.probes.size()) ?
+                    int(result.probes[i]) : 0);
+        results.push_back(r);
+    }
+    return results;
+}
+
+/**
+ * Merge the states saved with --save-state for consecutive segments
+ * of the same files, in order, and return the results calculated
+ * from them. Throw std::runtime_error if a state cannot be loaded, or
+ * std::invalid_argument if the states do not match one another or
+ * the options.
+ */
+static AnalysisQueue::Result
+mergeStates(const vector<string> &stateFiles, const Options &options)
+{
+    TuningState state;
+    for (int i = 0; i < int(stateFiles.size()); ++i) {
+        TuningState segment;
+        segment.load(stateFiles[i]);
+        if (i == 0) state = segment;
+        else state.merge(segment);
+    }
+
+    const int blockSize = AnalysisQueue::blockSize;
+    TuningDifference plugin(float(state.getSampleRate()));
+    for (const auto &p: getParameters(options)) {
+        plugin.setParameter(p.first, p.second);
+    }
+    if (!plugin.initialise(state.getChannelCount(), blockSize, blockSize)) {
+        throw invalid_argument("States have too few channels for the "
+                               "number of references");
+    }
+
+    Vamp::Plugin::OutputList outputs = plugin.getOutputDescriptors();
+    Vamp::Plugin::FeatureSet fs = plugin.getFeaturesForState(state);
+    
+    AnalysisQueue::Result result;
+    for (int i = 0; i < int(outputs.size()); ++i) {
+        if (fs[i].empty()) continue;
+        const vector<float> &values = fs[i][0].values;
+        if (outputs[i].identifier == "cents") result.cents = values;
+        if (outputs[i].identifier == "tuningfreq") result.frequencies = values;
+        if (outputs[i].identifier == "stages") result.stages = values;
+        if (outputs[i].identifier == "probes") result.probes = values;
+        if (outputs[i].identifier == "gated") result.gatedFrames = values;
+    }
+    if (result.cents.empty()) {
+        throw runtime_error("States contain no analysed input");
+    }
+    result.state = state;
+    return result;
+}
+
+#ifndef _WIN32
+
+// Daemon mode. Each client connection is served on a thread of its
+// own, one job per line: the file paths and any options, as
+// "--name=value" or "--coarse", separated by tabs. Each job is
+// answered with a line of JSON. Kernels are kept from one job to the
+// next, and the task pool is created once, so a job costs only its
+// analysis. Jobs from all connections share one queue, in which a
+// job with a higher "--priority" overtakes those already running,
+// and a job is cancelled if its client disconnects before it ends.
+
+// Connections served at once. Any beyond these are answered with an
+// error and closed straight away
+static const int maxConnections = 32;
+
+static AnalysisQueue *serverQueue = 0;
+
+// The connections being served, so that they can be hung up on when
+// the daemon stops, and their threads waited for before the queue
+// they submit to is destroyed
+static mutex connectionMutex;
+static condition_variable connectionsEnded;
+static set<int> connections;
+
+static void
+endConnection(int fd)
+{
+    lock_guard<mutex> lock(connectionMutex);
+    connections.erase(fd);
+    close(fd);
+    connectionsEnded.notify_all();
+}
+
+static void
+writeAll(int fd, const string &s)
+{
+    size_t written = 0;
+    while (written < s.size()) {
+        ssize_t n = write(fd, s.data() + written, s.size() - written);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            throw runtime_error("Failed to write to client");
+        }
+        written += size_t(n);
+    }
+}
+
+static string
+jsonString(const string &s)
+{
+    string out = "\"";
+    for (unsigned char c: s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += char(c);
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += char(c);
+        }
+    }
+    return out + "\"";
+}
+
+static string
+jsonNumber(float value)
+{
+    // JSON has no NaN or infinity, which a silent or wholly gated
+    // input can give. Otherwise write enough digits to read the same
+    // float back
+    
+    if (!std::isfinite(value)) {
+        return "null";
+    }
+    ostringstream out;
+    out.precision(std::numeric_limits<float>::max_digits10);
+    out << value;
+    return out.str();
+}
+
+static string
+serveJob(int fd, const string &line)
+{
+    Options options;
+    vector<string> filenames;
+
+    try {
+
+        size_t pos = 0;
+        while (pos <= line.size()) {
+            size_t end = line.find('\t', pos);
+            if (end == string::npos) end = line.size();
+            string field = line.substr(pos, end - pos);
+            pos = end + 1;
+            if (field == "") continue;
+            if (field.compare(0, 2, "--") != 0) {
+                filenames.push_back(field);
+                continue;
+            }
+            size_t eq = field.find('=');
+            string name = field.substr(2, eq == string::npos ?
+                                       string::npos : eq - 2);
+            string value = (eq == string::npos ? "" : field.substr(eq + 1));
+            if (name == "maxduration") {
+                options.maxDuration = float(atof(value.c_str()));
+            } else if (name == "deadline") {
+                options.deadline = float(atof(value.c_str()));
+            } else if (name == "stable") {
+                options.stable = float(atof(value.c_str()));
+            } else if (name == "windows") {
+                options.windows = atoi(value.c_str());
+            } else if (name == "windowduration") {
+                options.windowDuration = float(atof(value.c_str()));
+            } else if (name == "gate") {
+                options.gate = float(atof(value.c_str()));
+            } else if (name == "maxrange") {
+                options.maxRange = float(atof(value.c_str()));
+            } else if (name == "references") {
+                options.references = atoi(value.c_str());
+            } else if (name == "coarse") {
+                options.coarse = true;
+            } else if (name == "priority") {
+                options.priority = atoi(value.c_str());
+            } else {
+                throw invalid_argument("Unknown option \"" + name + "\"");
+            }
+        }
+
+        AnalysisQueue::Job job = submit(*serverQueue, filenames, options);
+
+        bool cancelled = false;
+        while (job.result.wait_for(chrono::milliseconds(200)) !=
+               future_status::ready) {
+            char c;
+            if (!cancelled && recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+                serverQueue->cancel(job.id);
+                cancelled = true;
+            }
+        }
+
+        vector<Result> results =
+            getResults(filenames, options, job.result.get());
+
+        ostringstream out;
+        out << "{\"results\":[";
+        for (int i = 0; i < int(results.size()); ++i) {
+            if (i > 0) out << ",";
+            out << "{\"reference\":" << jsonString(results[i].reference)
+                << ",\"file\":" << jsonString(results[i].other)
+                << ",\"cents\":" << jsonNumber(results[i].cents)
+                << ",\"frequency\":" << jsonNumber(results[i].hz)
+                << ",\"stages\":" << results[i].stages
+                << ",\"probes\":" << results[i].probes << "}";
+        }
+        out << "]}";
+        return out.str();
+
+    } catch (const std::exception &e) {
+        return "{\"error\":" + jsonString(e.what()) + "}";
+    }
+}
+
+static void
+serveClient(int fd)
+{
+    string pending;
+    char buf[4096];
+
+    while (true) {
+        size_t nl;
+        while ((nl = pending.find('\n')) != string::npos) {
+            string line = pending.substr(0, nl);
+            pending.erase(0, nl + 1);
+            if (!line.empty() && line[line.size()-1] == '\r') {
+                line.erase(line.size()-1);
+            }
+            if (line.empty()) continue;
+            try {
+                writeAll(fd, serveJob(fd, line) + "\n");
+            } catch (const runtime_error &) {
+                endConnection(fd);
+                return;
+            }
+        }
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        pending.append(buf, size_t(n));
+    }
+
+    endConnection(fd);
+}
+
+// A signal to stop is passed to the main loop through this pipe, as
+// very little may safely be done in the handler itself
+
+static int stopPipe[2] = { -1, -1 };
+
+static void
+stopServing(int)
+{
+    char c = 0;
+    if (write(stopPipe[1], &c, 1) < 0) {
+        // nothing more we can do here
+    }
+}
+
+static int
+serve(string path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        cerr << "ERROR: Socket path \"" << path << "\" is too long" << endl;
+        return 1;
+    }
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        cerr << "ERROR: Failed to create socket: " << strerror(errno) << endl;
+        return 1;
+    }
+
+    // A socket left behind by a daemon that has gone away is
+    // replaced, but not one that is still being served
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        cerr << "ERROR: A daemon is already serving \"" << path << "\""
+             << endl;
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    unlink(path.c_str());
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(077); // this user only
+    int rv = ::bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if (rv != 0 || listen(fd, 16) != 0) {
+        cerr << "ERROR: Failed to listen on \"" << path << "\": "
+             << strerror(errno) << endl;
+        close(fd);
+        return 1;
+    }
+
+    if (pipe(stopPipe) != 0) {
+        cerr << "ERROR: Failed to create pipe: " << strerror(errno) << endl;
+        close(fd);
+        unlink(path.c_str());
+        return 1;
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, stopServing);
+    signal(SIGTERM, stopServing);
+
+    CQKernel::setRetainShared(true);
+
+    // Enough jobs at once to keep the task pool busy while each is
+    // between blocks
+    serverQueue = new AnalysisQueue
+        (TaskScheduler::getGlobal()->getThreadCount());
+
+    cerr << "Serving on \"" << path << "\"" << endl;
+
+    bool stopped = false;
+    
+    while (true) {
+        struct pollfd fds[2] = {
+            { fd, POLLIN, 0 }, { stopPipe[0], POLLIN, 0 }
+        };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            cerr << "ERROR: Failed to poll socket: " << strerror(errno)
+                 << endl;
+            break;
+        }
+        if (fds[1].revents) {
+            stopped = true;
+            break;
+        }
+        int client = accept(fd, 0, 0);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            cerr << "ERROR: Failed to accept connection: "
+                 << strerror(errno) << endl;
+            break;
+        }
+        bool full = false;
+        {
+            lock_guard<mutex> lock(connectionMutex);
+            if (int(connections.size()) >= maxConnections) {
+                full = true;
+            } else {
+                connections.insert(client);
+            }
+        }
+        if (full) {
+            try {
+                writeAll(client, "{\"error\":\"Too many connections\"}\n");
+            } catch (const runtime_error &) { }
+            close(client);
+            continue;
+        }
+        thread(serveClient, client).detach();
+    }
+
+    close(fd);
+    unlink(path.c_str());
+
+    // Hang up on every client, which cancels any job it is waiting
+    // for, and let their threads finish before destroying the queue
+
+    {
+        unique_lock<mutex> lock(connectionMutex);
+        for (int client: connections) {
+            shutdown(client, SHUT_RDWR);
+        }
+        connectionsEnded.wait(lock, []() { return connections.empty(); });
+    }
+    
+    delete serverQueue;
+    serverQueue = 0;
+
+    close(stopPipe[0]);
+    close(stopPipe[1]);
+    
+    return stopped ? 0 : 1;
+}
+
+#endif
+
+static void
+usage(const char *name)
+{
+    cerr << endl;
+    cerr << "Usage: " << name << " [options] reference.wav other.wav [other.wav ...]" << endl;
+#ifndef _WIN32
+    cerr << "       " << name << " --serve <socket>" << endl;
+#endif
+    cerr << "       " << name << " [options] --merge state [state ...]" << endl;
+    cerr << endl;
+    cerr << "Options:" << endl;
+    cerr << "  -d<X>, --maxduration <X>  Analyse at most X seconds of each file (default = 0, all)" << endl;
+    cerr << "  -t<X>, --deadline <X>     Return results within about X seconds of starting" << endl;
+    cerr << "                            the analysis, analysing less if need be (default = 0," << endl;
+    cerr << "                            no deadline)" << endl;
+    cerr << "  -S<X>, --stable <X>       Stop reading once the estimate has stayed the same" << endl;
+    cerr << "                            for X seconds of audio (default = 0, read it all)" << endl;
+    cerr << "  -w<X>, --windows <X>      Analyse only X windows spread evenly across the" << endl;
+    cerr << "                            files (default = 0, analyse all of the audio)" << endl;
+    cerr << "  -W<X>, --windowduration <X>" << endl;
+    cerr << "                            Duration of each window in seconds (default = 10)" << endl;
+    cerr << "  -g<X>, --gate <X>         Skip stretches of each file quieter than X dB, such" << endl;
+    cerr << "                            as -70 (default = 0, skip nothing)" << endl;
+    cerr << "  -r<X>, --maxrange <X>     Maximum range in semitones (default = 5)" << endl;
+    cerr << "  -n<X>, --references <X>   Take the first X files as references (default = 1)" << endl;
+    cerr << "  -c, --coarse              Skip fine tuning" << endl;
+    cerr << "  --segment <A>:<B>         Analyse only the audio from A to B seconds, or from A" << endl;
+    cerr << "                            to the end if B is omitted, reading a little either" << endl;
+    cerr << "                            side to warm the analysis up and down" << endl;
+    cerr << "  --save-state <F>          Save the analysis state, or the merged states, to" << endl;
+    cerr << "                            file F for a later --merge" << endl;
+    cerr << "  --checkpoint <F>          Save a checkpoint of the analysis to file F every" << endl;
+    cerr << "                            minute of audio, to resume from if interrupted" << endl;
+    cerr << "  --checkpoint-interval <X> Save checkpoints every X seconds of audio instead" << endl;
+    cerr << "  --resume <F>              Resume the analysis from checkpoint file F, given the" << endl;
+    cerr << "                            same files and options" << endl;
+    cerr << "  --merge                   Take the arguments to be states saved from segments" << endl;
+    cerr << "                            of the same files, and print the results for all of" << endl;
+    cerr << "                            them together instead of analysing audio" << endl;
+#ifndef _WIN32
+    cerr << "  -s<X>, --serve <X>        Run as a daemon listening on Unix socket X" << endl;
+#endif
+    cerr << "  -h, --help                Print this help" << endl;
+    cerr << endl;
+    cerr << "Estimate the tuning of each of the other files, relative to each reference" << endl;
+    cerr << "file, assuming they contain the same music. For each reference and other" << endl;
+    cerr << "file, a line is printed with the two file names, the tuning difference in" << endl;
+    cerr << "cents, and the tuning frequency of the other file if the reference is tuned" << endl;
+    cerr << "to A=440Hz, separated by tabs. The files may differ in length, sample rate" << endl;
+    cerr << "and channel count; they are mixed to mono and analysed at the sample rate of" << endl;
+    cerr << "the first." << endl;
+    cerr << endl;
+    cerr << "With a deadline, --stable or --windows, each line has a fifth field saying" << endl;
+    cerr << "which stages of the analysis were completed: 1 if all of the input was" << endl;
+    cerr << "analysed, plus 2 if fine tuning was completed." << endl;
+    cerr << endl;
+    cerr << "A long recording can be analysed in parts, for example in parallel:" << endl;
+    cerr << "  " << name << " --segment 0:600 --save-state 1.tds ref.wav other.wav" << endl;
+    cerr << "  " << name << " --segment 600: --save-state 2.tds ref.wav other.wav" << endl;
+    cerr << "  " << name << " --merge 1.tds 2.tds" << endl;
+    cerr << "gives the results for the whole recording, to within rounding. The segments" << endl;
+    cerr << "must be given in order and meet exactly, and the --maxrange, --references and" << endl;
+    cerr << "--coarse options must be the same throughout. Merged results name the files" << endl;
+    cerr << "by number, from 1, in the order they were given when saving." << endl;
+#ifndef _WIN32
+    cerr << endl;
+    cerr << "As a daemon, each line received is a job: the file paths, and any options as" << endl;
+    cerr << "--name=value or --coarse, separated by tabs. It is answered with a line of" << endl;
+    cerr << "JSON, either {\"results\":[{\"reference\":..., \"file\":..., \"cents\":...," << endl;
+    cerr << "\"frequency\":..., \"stages\":..., \"probes\":...}, ...]} or {\"error\":...}," << endl;
+    cerr << "where probes is the number of fine-tuning offsets evaluated. Jobs on separate" << endl;
+    cerr << "connections run concurrently. A job given --priority=N with N above 0 (the" << endl;
+    cerr << "default) overtakes those of lower priority, and a job is cancelled if its" << endl;
+    cerr << "client disconnects." << endl;
+#endif
+    cerr << endl;
+    cerr << "Set the environment variables CQ_THREADS and TUNING_DIFFERENCE_CACHE as for" << endl;
+    cerr << "the plugin." << endl;
+    cerr << endl;
+}
+
+/**
+ * Parse a segment given as "A:B" or "A:" seconds. Return false if it
+ * is malformed.
+ */
+static bool
+parseSegment(const string &arg, Options &options)
+{
+    size_t colon = arg.find(':');
+    if (colon == string::npos || colon == 0) return false;
+    char *end = 0;
+    string start = arg.substr(0, colon), finish = arg.substr(colon + 1);
+    options.segmentStart = strtod(start.c_str(), &end);
+    if (*end || options.segmentStart < 0.0) return false;
+    if (finish == "") {
+        options.segmentEnd = -1.0;
+        return true;
+    }
+    options.segmentEnd = strtod(finish.c_str(), &end);
+    return !*end && options.segmentEnd > options.segmentStart;
+}
+
+// Long options without a short equivalent
+enum {
+    segmentOption = 256,
+    saveStateOption,
+    mergeOption,
+    checkpointOption,
+    checkpointIntervalOption,
+    resumeOption
+};
+
+int main(int argc, char **argv)
+{
+    Options options;
+    string socket;
+    bool help = false;
+
+    while (1) {
+        int optionIndex = 0;
+
+        static struct option longOpts[] = {
+            { "help", 0, 0, 'h', },
+            { "maxduration", 1, 0, 'd', },
+            { "deadline", 1, 0, 't', },
+            { "stable", 1, 0, 'S', },
+            { "windows", 1, 0, 'w', },
+            { "windowduration", 1, 0, 'W', },
+            { "gate", 1, 0, 'g', },
+            { "maxrange", 1, 0, 'r', },
+            { "references", 1, 0, 'n', },
+            { "coarse", 0, 0, 'c', },
+            { "serve", 1, 0, 's', },
+            { "segment", 1, 0, segmentOption, },
+            { "save-state", 1, 0, saveStateOption, },
+            { "merge", 0, 0, mergeOption, },
+            { "checkpoint", 1, 0, checkpointOption, },
+            { "checkpoint-interval", 1, 0, checkpointIntervalOption, },
+            { "resume", 1, 0, resumeOption, },
+            { 0, 0, 0, 0 },
+        };
+
+        int c = getopt_long(argc, argv, "hd:t:S:w:W:g:r:n:cs:", longOpts, &optionIndex);
+        if (c == -1) break;
+
+        switch (c) {
+        case 'h': help = true; break;
+        case 'd': options.maxDuration = float(atof(optarg)); break;
+        case 't': options.deadline = float(atof(optarg)); break;
+        case 'S': options.stable = float(atof(optarg)); break;
+        case 'w': options.windows = atoi(optarg); break;
+        case 'W': options.windowDuration = float(atof(optarg)); break;
+        case 'g': options.gate = float(atof(optarg)); break;
+        case 'r': options.maxRange = float(atof(optarg)); break;
+        case 'n': options.references = atoi(optarg); break;
+        case 'c': options.coarse = true; break;
+        case 's': socket = optarg; break;
+        case segmentOption:
+            if (!parseSegment(optarg, options)) {
+                cerr << "ERROR: Invalid segment \"" << optarg << "\"" << endl;
+                help = true;
+            }
+            break;
+        case saveStateOption: options.saveState = optarg; break;
+        case mergeOption: options.merge = true; break;
+        case checkpointOption: options.checkpoint = optarg; break;
+        case checkpointIntervalOption:
+            options.checkpointInterval = float(atof(optarg));
+            if (!(options.checkpointInterval > 0.f)) help = true;
+            break;
+        case resumeOption: options.resume = optarg; break;
+        default: help = true; break;
+        }
+    }
+
+    if (!help && socket != "") {
+        if (optind != argc) {
+            usage(argv[0]);
+            return 2;
+        }
+#ifdef _WIN32
+        cerr << "ERROR: Daemon mode is not available on this platform" << endl;
+        return 1;
+#else
+        return serve(socket);
+#endif
+    }
+
+    if (help || options.references < 1 ||
+        (options.merge ? argc == optind :
+         argc - optind <= options.references) ||
+        (options.merge && (options.segmentStart >= 0.0 ||
+                           options.checkpoint != "" ||
+                           options.resume != ""))) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    try {
+        vector<string> filenames(argv + optind, argv + argc);
+        AnalysisQueue::Result result;
+        if (options.merge) {
+            result = mergeStates(filenames, options);
+            filenames.clear();
+            for (int c = 0; c < result.state.getChannelCount(); ++c) {
+                filenames.push_back(to_string(c + 1));
+            }
+        } else {
+            AnalysisQueue queue;
+            AnalysisQueue::Job job = submit(queue, filenames, options);
+            result = job.result.get();
+        }
+        if (options.saveState != "") {
+            result.state.save(options.saveState);
+        }
+        vector<Result> results = getResults(filenames, options, result);
+        for (const auto &r: results) {
+            cout << r.reference << "\t" << r.other << "\t"
+                 << r.cents << "\t" << r.hz;
+            if (options.deadline > 0.f || options.stable > 0.f ||
+                options.windows > 0) {
+                cout << "\t" << r.stages;
+            }
+            cout << endl;
+        }
+    } catch (const std::exception &e) {
+        cerr << "ERROR: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -36,17 +36,13 @@
 
 #include <vector>
 #include <complex>
+#include <memory>
 
 class FFT;
 
 class CQKernel
 {
 public:
-    CQKernel(CQParameters params);
-    ~CQKernel();
-
-    bool isValid() const { return m_valid; }
-    
     struct Properties {
         double sampleRate;
         double maxFrequency;
@@ -61,13 +57,54 @@ public:
         double Q;
     };
 
+    CQKernel(CQParameters params);
+
+    /**
+     * Construct a kernel for the given parameters, but with the frame
+     * layout (FFT size and hop, atoms per frame, atom spacing and
+     * centres) taken from the given properties rather than calculated
+     * from the parameters. This allows kernels for slightly different
+     * frequency ranges to be applied to the same FFT frames. The
+     * kernel will be invalid if its atoms do not fit in the layout.
+     */
+    CQKernel(CQParameters params, Properties layout);
+    
+    ~CQKernel();
+
+    bool isValid() const { return m_valid; }
+
     Properties getProperties() const { return m_p; }
 
+    /**
+     * Return the properties that a kernel constructed with the given
+     * parameters would have, without generating the kernel.
+     */
+    static Properties calculateProperties(CQParameters params);
+
+    /**
+     * Return a kernel for the given parameters (and layout, as for
+     * the constructor above), shared with any other caller asking
+     * for the same ones while it is still in use, so that it is
+     * generated only once. A kernel is not modified once generated,
+     * so a shared one may be used from several threads at once.
+     */
+    static std::shared_ptr<const CQKernel> getShared(CQParameters params);
+    static std::shared_ptr<const CQKernel> getShared(CQParameters params,
+                                                     Properties layout);
+
+    /**
+     * Keep every kernel returned by getShared() after it has gone
+     * out of use, until this is called again with retain false. For
+     * long-running processes that construct the same transforms
+     * repeatedly. Off by default.
+     */
+    static void setRetainShared(bool retain);
+
     std::vector<std::complex<double> > processForward
-        (const std::vector<std::complex<double> > &);
+        (const std::vector<std::complex<double> > &) const;
 
     std::vector<std::complex<double> > processInverse
-        (const std::vector<std::complex<double> > &);
+        (const std::vector<std::complex<double> > &) const;
 
 private:
     const CQParameters m_inparams;
@@ -82,8 +119,13 @@ private:
     KernelMatrix m_kernel;
 
     std::vector<double> makeWindow(int len) const;
-    bool generateKernel();
+    static bool calculateLayout(const CQParameters &params, Properties &p,
+                                double &maxNK);
+    bool generateKernel(const Properties *layout);
     void finaliseKernel();
+
+    static std::shared_ptr<const CQKernel> getShared(CQParameters params,
+                                                     const Properties *layout);
 };
 
 #endif
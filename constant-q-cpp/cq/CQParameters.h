@@ -32,6 +32,8 @@
 #ifndef CQ_PARAMETERS_H
 #define CQ_PARAMETERS_H
 
+class TaskScheduler;
+
 /**
  * Common parameters for constructing Constant-Q implementation
  * objects (both forward and inverse transforms).
@@ -72,7 +74,9 @@ public:
 	atomHopFactor(0.25),        // hop size of shortest temporal atom
 	threshold(0.0005),          // sparsity threshold for resulting kernel
 	window(SqrtBlackmanHarris), // window shape
-        decimator(BetterDecimator)  // decimator quality setting
+        decimator(BetterDecimator), // decimator quality setting
+        parallelOctaves(false),     // process octaves as parallel tasks
+        scheduler(0)                // scheduler for those tasks
     { }
 
     /**
@@ -125,6 +129,23 @@ public:
      * Quality setting for the sample rate decimator.
      */
     DecimatorType decimator;
+
+    /**
+     * Whether to carry out the decimation for each octave, and the
+     * FFT and kernel multiplication for each hop within each octave,
+     * as separate tasks that may run in parallel. This does not
+     * change the results, but may reduce the time taken to process
+     * each block when there are spare cores.
+     */
+    bool parallelOctaves;
+
+    /**
+     * Scheduler to run the tasks on, if parallelOctaves is set. This
+     * may be shared with other objects, and must outlive the
+     * transform object. If it is null, the process-wide scheduler
+     * returned by TaskScheduler::getGlobal() is used.
+     */
+    TaskScheduler *scheduler;
 };
 
 #endif
@@ -60,6 +60,15 @@ public:
      * given transform parameters.
      */
     CQSpectrogram(CQParameters params, Interpolation interpolation);
+
+    /**
+     * Construct a Constant-Q magnitude spectrogram object producing
+     * several streams of output from a single shared front end. See
+     * the corresponding ConstantQ constructor for details.
+     */
+    CQSpectrogram(std::vector<CQParameters> params,
+                  Interpolation interpolation);
+    
     virtual ~CQSpectrogram();
 
     // CQBase methods, see CQBase.h for documentation
@@ -70,6 +79,7 @@ public:
     virtual int getTotalBins() const { return m_cq.getTotalBins(); }
     virtual int getColumnHop() const { return m_cq.getColumnHop(); }
     virtual int getLatency() const { return m_cq.getLatency(); } 
+    int getInputAlignment() const { return m_cq.getInputAlignment(); }
     virtual double getMaxFrequency() const { return m_cq.getMaxFrequency(); }
     virtual double getMinFrequency() const { return m_cq.getMinFrequency(); }
     virtual double getBinFrequency(double bin) const { return m_cq.getBinFrequency(bin); }
@@ -107,16 +117,36 @@ public:
      */
     RealBlock getRemainingOutput();
 
+    /**
+     * Return the number of output streams, i.e. the number of sets
+     * of parameters this object was constructed with.
+     */
+    int getStreamCount() const { return m_cq.getStreamCount(); }
+
+    /**
+     * As process(), but returning the output for every stream, in
+     * the order in which their parameters were given on
+     * construction. Use either this or process() throughout, not a
+     * mixture of the two.
+     */
+    std::vector<RealBlock> processStreams(const RealSequence &);
+
+    /**
+     * As getRemainingOutput(), but returning the output for every
+     * stream.
+     */
+    std::vector<RealBlock> getRemainingOutputStreams();
+
 private:
     ConstantQ m_cq;
     Interpolation m_interpolation;
 
-    RealBlock m_buffer;
-    RealBlock postProcess(const ComplexBlock &, bool insist);
-    RealBlock fetchHold(bool insist);
-    RealBlock fetchLinear(bool insist);
+    std::vector<RealBlock> m_buffers; // per stream
+    std::vector<RealColumn> m_prevColumns; // per stream
+    RealBlock postProcess(const ComplexBlock &, bool insist, int stream);
+    RealBlock fetchHold(bool insist, int stream);
+    RealBlock fetchLinear(bool insist, int stream);
     RealBlock linearInterpolated(const RealBlock &, int, int);
-    RealColumn m_prevColumn;
 };
 
 #endif
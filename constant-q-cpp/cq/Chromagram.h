@@ -50,7 +50,9 @@ public:
             q(1.0),                    // Q scaling factor
             atomHopFactor(0.25),       // hop size of shortest temporal atom
             threshold(0.0005),         // sparsity threshold for resulting kernel
-            window(CQParameters::SqrtBlackmanHarris) // window shape
+            window(CQParameters::SqrtBlackmanHarris), // window shape
+            parallelOctaves(false),    // process octaves as parallel tasks
+            scheduler(0)               // scheduler for those tasks
         { }
 
         /**
@@ -106,14 +108,58 @@ public:
          * Window shape to use for the Constant-Q kernel atoms.
          */
         CQParameters::WindowType window;
+
+        /**
+         * Whether to process the constant-Q octaves as parallel
+         * tasks. See CQParameters::parallelOctaves.
+         */
+        bool parallelOctaves;
+
+        /**
+         * Scheduler for those tasks. See CQParameters::scheduler.
+         */
+        TaskScheduler *scheduler;
     };
 
     Chromagram(Parameters params);
+
+    /**
+     * Construct a chromagram producing several streams of output,
+     * one per set of parameters, from a single constant-Q front end
+     * whose resampling and FFTs are shared between all of them. The
+     * parameter sets may differ only in their tuning frequency. See
+     * the multi-stream ConstantQ constructor for details.
+     *
+     * Information about the chromagram returned by the other
+     * methods, such as getMinFrequency() or getBinName(), refers to
+     * the first stream.
+     */
+    Chromagram(std::vector<Parameters> params);
+    
     virtual ~Chromagram();
 
     CQBase::RealBlock process(const CQBase::RealSequence &);
     CQBase::RealBlock getRemainingOutput();
 
+    /**
+     * Return the number of output streams.
+     */
+    int getStreamCount() const;
+
+    /**
+     * As process(), but returning the output for every stream, in
+     * the order in which their parameters were given on
+     * construction. Use either this or process() throughout, not a
+     * mixture of the two.
+     */
+    std::vector<CQBase::RealBlock> processStreams(const CQBase::RealSequence &);
+
+    /**
+     * As getRemainingOutput(), but returning the output for every
+     * stream.
+     */
+    std::vector<CQBase::RealBlock> getRemainingOutputStreams();
+
     double getMinFrequency() const { return m_minFrequency; }
     double getMaxFrequency() const { return m_maxFrequency; }
 
@@ -122,12 +168,20 @@ public:
     bool isValid() const;
     int getColumnHop() const;
     int getLatency() const;
+
+    /**
+     * See ConstantQ::getInputAlignment().
+     */
+    int getInputAlignment() const;
     
 private:
     Parameters m_params;
     CQSpectrogram *m_cq;
     double m_minFrequency;
     double m_maxFrequency;
+    CQParameters makeCQParameters(const Parameters &,
+                                  double &minFrequency,
+                                  double &maxFrequency) const;
     CQBase::RealBlock convert(const CQBase::RealBlock &);
 };
 
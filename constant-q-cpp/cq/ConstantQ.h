@@ -35,6 +35,11 @@
 #include "CQBase.h"
 #include "CQParameters.h"
 #include "CQKernel.h"
+#include "TaskScheduler.h"
+
+#include <functional>
+#include <mutex>
+#include <memory>
 
 class Resampler;
 class FFTReal;
@@ -56,16 +61,44 @@ public:
      * transform parameters.
      */
     ConstantQ(CQParameters params);
+
+    /**
+     * Construct a complex Constant-Q transform object that applies
+     * several kernels, one per set of transform parameters, to the
+     * output of a single shared front end (decimators and FFT). This
+     * produces several streams of output for little more than the
+     * cost of one, for example when analysing the same frequency
+     * range at several slightly different tuning frequencies.
+     *
+     * The parameter sets must differ only in their frequency extents,
+     * and must all span the same number of octaves. The kernels all
+     * share the frame layout of whichever of them has the longest
+     * atoms, so the timing of each stream is not necessarily
+     * identical to that of a ConstantQ constructed from its
+     * parameters alone. The CQBase methods describe the first stream.
+     */
+    ConstantQ(std::vector<CQParameters> params);
+    
     virtual ~ConstantQ();
 
     // CQBase methods, see CQBase.h for documentation
-    virtual bool isValid() const { return m_kernel && m_kernel->isValid(); }
+    virtual bool isValid() const;
     virtual double getSampleRate() const { return m_sampleRate; }
     virtual int getBinsPerOctave() const { return m_binsPerOctave; }
     virtual int getOctaves() const { return m_octaves; }
     virtual int getTotalBins() const { return m_octaves * m_binsPerOctave; }
     virtual int getColumnHop() const { return m_p.fftHop / m_p.atomsPerFrame; }
     virtual int getLatency() const { return m_outputLatency; } 
+
+    /**
+     * Return the input alignment of the transform. The processing
+     * repeats exactly every this many input samples, so two
+     * transforms started at input positions a multiple of this apart
+     * produce identical columns for the same time, once both have
+     * seen enough input for the columns not to depend on what
+     * preceded their start.
+     */
+    int getInputAlignment() const { return m_p.fftHop * (1 << (m_octaves - 1)); }
     virtual double getMaxFrequency() const { return m_p.maxFrequency; }
     virtual double getMinFrequency() const;
     virtual double getBinFrequency(double bin) const; // bin may be nonintegral
@@ -103,15 +136,34 @@ public:
      */
     ComplexBlock getRemainingOutput();
 
+    /**
+     * Return the number of output streams, i.e. the number of sets
+     * of parameters this object was constructed with.
+     */
+    int getStreamCount() const { return int(m_inparams.size()); }
+
+    /**
+     * As process(), but returning the output for every stream, in
+     * the order in which their parameters were given on
+     * construction. (The plain process() returns only the first.)
+     */
+    std::vector<ComplexBlock> processStreams(const RealSequence &);
+
+    /**
+     * As getRemainingOutput(), but returning the output for every
+     * stream.
+     */
+    std::vector<ComplexBlock> getRemainingOutputStreams();
+
 private:
-    const CQParameters m_inparams;
+    const std::vector<CQParameters> m_inparams;
     const double m_sampleRate;
     const double m_maxFrequency;
     const double m_minFrequency;
     const int m_binsPerOctave;
 
     int m_octaves;
-    CQKernel *m_kernel;
+    std::vector<std::shared_ptr<const CQKernel> > m_kernels;
     CQKernel::Properties m_p;
     int m_bigBlockSize;
 
@@ -122,8 +174,33 @@ private:
 
     FFTReal *m_fft;
 
+    // When running in parallel, each task borrows an FFT object from
+    // the pool, as FFTReal has internal working buffers
+    TaskScheduler *m_scheduler;
+    TaskScheduler::Client m_client;
+    std::vector<FFTReal *> m_fftPool;
+    std::mutex m_fftPoolMutex;
+    FFTReal *acquireFFT();
+    void releaseFFT(FFTReal *);
+
+    // Holds an FFT object borrowed with acquireFFT, returning it to
+    // the pool on destruction, even if the task throws
+    class FFTGuard {
+    public:
+        FFTGuard(ConstantQ *cq) : m_cq(cq), m_fft(cq->acquireFFT()) { }
+        ~FFTGuard() { m_cq->releaseFFT(m_fft); }
+        FFTReal *get() const { return m_fft; }
+    private:
+        ConstantQ *m_cq;
+        FFTReal *m_fft;
+        FFTGuard(const FFTGuard &) =delete;
+        FFTGuard &operator=(const FFTGuard &) =delete;
+    };
+
     void initialise();
-    ComplexBlock processOctaveBlock(int octave);
+    std::vector<ComplexBlock> processOctaveBlock(int octave, int offset,
+                                                 FFTReal *fft);
+    void runTasks(int n, std::function<void(int)> task);
 };
 
 #endif
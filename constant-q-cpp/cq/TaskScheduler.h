@@ -0,0 +1,230 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Constant-Q library
+    Copyright (c) 2013-2014 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music; Queen Mary, University of London; and Chris Cannam
+    shall not be used in advertising or otherwise to promote the sale,
+    use or other dealings in this Software without prior written
+    authorization.
+*/
+
+#ifndef CQ_TASK_SCHEDULER_H
+#define CQ_TASK_SCHEDULER_H
+
+#include <functional>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+
+/**
+ * A fixed pool of worker threads that run small tasks, balancing
+ * them by work stealing.
+ *
+ * Each worker keeps its own double-ended queue of tasks. A task
+ * spawned from a worker goes on the back of that worker's queue, and
+ * the worker takes its next task from the back as well, so related
+ * tasks tend to run on the same core. A worker whose queue is empty
+ * steals from the front of another's.
+ *
+ * Tasks are spawned into a Group, and wait() returns once every task
+ * in the group has completed. A thread that waits does not simply
+ * block: it runs tasks from the group it is waiting for, so tasks may
+ * safely spawn subtasks and wait for them (as ConstantQ does, when
+ * called from a task) without tying up a worker. A waiting thread
+ * only ever runs tasks from its own group, which keeps the nesting
+ * depth bounded.
+ *
+ * Tasks spawned from outside the pool are queued per Client, and
+ * idle workers take them from each client in turn, so an object
+ * that submits a great many tasks at once delays the tasks of other
+ * clients by no more than one task each. Tasks spawned from within
+ * the pool skip this queue, so that work already begun is finished
+ * before new work is started.
+ *
+ * The scheduler can be shared between any number of objects and
+ * threads. Normally all objects in a process share the one returned
+ * by getGlobal().
+ */
+class TaskScheduler
+{
+public:
+    class Group;
+
+private:
+    struct Task {
+        std::function<void()> function;
+        Group *group;
+    };
+
+public:
+    /**
+     * A submitter of tasks, such as a plugin instance, which is to
+     * get a fair share of the pool. A client is registered with a
+     * scheduler the first time a task is spawned for it, may not be
+     * used with any other scheduler after that, and must not be
+     * destroyed while any of its tasks are outstanding.
+     */
+    class Client
+    {
+    public:
+        Client() : m_scheduler(0) { }
+        ~Client();
+
+    private:
+        friend class TaskScheduler;
+        TaskScheduler *m_scheduler;
+        std::deque<Task> m_queue;
+
+        Client(const Client &) =delete;
+        Client &operator=(const Client &) =delete;
+    };
+
+    /**
+     * A set of tasks that can be waited for together. Tasks spawned
+     * into the group from outside the pool are queued on behalf of
+     * the given client, or a default client shared by all groups
+     * that do not name one.
+     */
+    class Group
+    {
+    public:
+        Group(Client *client = 0) :
+            m_pending(0), m_unstarted(0), m_client(client) { }
+
+    private:
+        friend class TaskScheduler;
+        std::atomic<int> m_pending;   // spawned and not yet completed
+        std::atomic<int> m_unstarted; // still queued, not yet taken
+        Client *m_client;
+        std::mutex m_mutex;
+        std::condition_variable m_done;
+        std::exception_ptr m_failure;
+
+        Group(const Group &) =delete;
+        Group &operator=(const Group &) =delete;
+    };
+
+    /**
+     * Construct a scheduler with the given number of worker
+     * threads. Zero means one per hardware thread.
+     */
+    TaskScheduler(int threads = 0);
+
+    /**
+     * Return the scheduler shared by everything in the process,
+     * creating it on first use. Its thread count is taken from the
+     * CQ_THREADS environment variable if that is set to a positive
+     * number, and is otherwise one per hardware thread.
+     */
+    static TaskScheduler *getGlobal();
+
+    /**
+     * Wait for any outstanding tasks, then stop the worker threads.
+     */
+    ~TaskScheduler();
+
+    int getThreadCount() const { return int(m_workers.size()); }
+
+    /**
+     * Queue a task to run as part of the given group.
+     */
+    void spawn(Group &group, std::function<void()> task);
+
+    /**
+     * Return once every task spawned into the group (including any
+     * spawned while waiting) has completed, running tasks from the
+     * group on the calling thread meanwhile. If any of the tasks
+     * threw an exception, rethrow the first of them.
+     */
+    void wait(Group &group);
+
+    /**
+     * Convenience function to run task(i) for i in [0, n) and wait
+     * for them all, queueing them on behalf of the given client.
+     */
+    void run(int n, std::function<void(int)> task, Client *client = 0);
+
+    struct Statistics {
+        /// Seconds spent running tasks, per worker thread
+        std::vector<double> busy;
+        /// Seconds spent running tasks by threads waiting on a group
+        double helping;
+        /// Number of tasks run
+        long tasks;
+        /// Number of tasks taken from another worker's queue
+        long steals;
+    };
+
+    /**
+     * Return the time spent running tasks, and the number of tasks
+     * run and stolen, since construction or the last call to
+     * resetStatistics().
+     */
+    Statistics getStatistics() const;
+    void resetStatistics();
+
+private:
+    struct Worker {
+        Worker() : busy(0.0) { }
+        std::deque<Task> queue;
+        std::mutex mutex;
+        std::thread thread;
+        double busy;
+    };
+
+    std::vector<Worker *> m_workers;
+    std::atomic<int> m_queued;
+
+    // Clients with queues, taken from in turn. The queues are all
+    // guarded by m_clientMutex.
+    std::vector<Client *> m_clients;
+    int m_nextClient;
+    Client m_defaultClient;
+    std::mutex m_clientMutex;
+
+    bool m_stopping;
+    std::mutex m_sleepMutex;
+    std::condition_variable m_wake;
+
+    mutable std::mutex m_statsMutex;
+    double m_helping;
+    std::atomic<long> m_tasks;
+    std::atomic<long> m_steals;
+
+    int currentWorker() const;
+    bool take(int worker, Group *group, Task &task);
+    bool takeFromClient(Group *group, Task &task);
+    void removeClient(Client *client);
+    void execute(Task &task, int worker);
+    void runWorker(int index);
+
+    TaskScheduler(const TaskScheduler &) =delete;
+    TaskScheduler &operator=(const TaskScheduler &) =delete;
+};
+
+#endif
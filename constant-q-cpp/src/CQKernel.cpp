@@ -40,11 +40,20 @@
 #include <vector>
 #include <iostream>
 #include <algorithm>
+#include <map>
+#include <mutex>
+#include <future>
 
 #include <cmath>
 
 using std::vector;
 using std::complex;
+using std::map;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+using std::shared_ptr;
+using std::weak_ptr;
 using std::cerr;
 using std::endl;
 
@@ -60,7 +69,18 @@ CQKernel::CQKernel(CQParameters params) :
     m_p.sampleRate = params.sampleRate;
     m_p.maxFrequency = params.maxFrequency;
     m_p.binsPerOctave = params.binsPerOctave;
-    m_valid = generateKernel();
+    m_valid = generateKernel(0);
+}
+
+CQKernel::CQKernel(CQParameters params, Properties layout) :
+    m_inparams(params),
+    m_valid(false),
+    m_fft(0)
+{
+    m_p.sampleRate = params.sampleRate;
+    m_p.maxFrequency = params.maxFrequency;
+    m_p.binsPerOctave = params.binsPerOctave;
+    m_valid = generateKernel(&layout);
 }
 
 CQKernel::~CQKernel()
@@ -116,55 +136,102 @@ CQKernel::makeWindow(int len) const
     return win;
 }
 
+CQKernel::Properties
+CQKernel::calculateProperties(CQParameters params)
+{
+    Properties p;
+    p.sampleRate = params.sampleRate;
+    p.maxFrequency = params.maxFrequency;
+    p.binsPerOctave = params.binsPerOctave;
+    double maxNK = 0.0;
+    calculateLayout(params, p, maxNK);
+    return p;
+}
+
 bool
-CQKernel::generateKernel()
+CQKernel::calculateLayout(const CQParameters &params, Properties &p,
+                          double &maxNK)
 {
-    double q = m_inparams.q;
-    double atomHopFactor = m_inparams.atomHopFactor;
-    double thresh = m_inparams.threshold;
+    double q = params.q;
+    double atomHopFactor = params.atomHopFactor;
 
-    double bpo = m_p.binsPerOctave;
+    double bpo = p.binsPerOctave;
 
-    m_p.minFrequency = (m_p.maxFrequency / 2) * pow(2, 1.0/bpo);
-    m_p.Q = q / (pow(2, 1.0/bpo) - 1.0);
+    p.minFrequency = (p.maxFrequency / 2) * pow(2, 1.0/bpo);
+    p.Q = q / (pow(2, 1.0/bpo) - 1.0);
 
-    double maxNK = int(m_p.Q * m_p.sampleRate / m_p.minFrequency + 0.5);
+    maxNK = int(p.Q * p.sampleRate / p.minFrequency + 0.5);
     double minNK = int
-        (m_p.Q * m_p.sampleRate /
-         (m_p.minFrequency * pow(2, (bpo - 1.0) / bpo)) + 0.5);
+        (p.Q * p.sampleRate /
+         (p.minFrequency * pow(2, (bpo - 1.0) / bpo)) + 0.5);
 
     if (minNK == 0 || maxNK == 0) {
         // most likely pathological parameters of some sort
         cerr << "WARNING: CQKernel::generateKernel: minNK or maxNK is zero (minNK == " << minNK << ", maxNK == " << maxNK << "), not generating a kernel" << endl;
-        m_p.atomSpacing = 0;
-        m_p.firstCentre = 0;
-        m_p.fftSize = 0;
-        m_p.atomsPerFrame = 0;
-        m_p.lastCentre = 0;
-        m_p.fftHop = 0;
+        p.atomSpacing = 0;
+        p.firstCentre = 0;
+        p.fftSize = 0;
+        p.atomsPerFrame = 0;
+        p.lastCentre = 0;
+        p.fftHop = 0;
         return false;
     }
 
-    m_p.atomSpacing = int(minNK * atomHopFactor + 0.5);
-    m_p.firstCentre = m_p.atomSpacing * ceil(ceil(maxNK / 2.0) / m_p.atomSpacing);
-    m_p.fftSize = MathUtilities::nextPowerOfTwo
-        (m_p.firstCentre + ceil(maxNK / 2.0));
+    p.atomSpacing = int(minNK * atomHopFactor + 0.5);
+    p.firstCentre = p.atomSpacing * ceil(ceil(maxNK / 2.0) / p.atomSpacing);
+    p.fftSize = MathUtilities::nextPowerOfTwo
+        (p.firstCentre + ceil(maxNK / 2.0));
 
-    m_p.atomsPerFrame = floor
-        (1.0 + (m_p.fftSize - ceil(maxNK / 2.0) - m_p.firstCentre) / m_p.atomSpacing);
+    p.atomsPerFrame = floor
+        (1.0 + (p.fftSize - ceil(maxNK / 2.0) - p.firstCentre) / p.atomSpacing);
 
 #ifdef DEBUG_CQ_KERNEL
-    cerr << "atomsPerFrame = " << m_p.atomsPerFrame << " (q = " << q << ", Q = " << m_p.Q << ", atomHopFactor = " << atomHopFactor << ", atomSpacing = " << m_p.atomSpacing << ", fftSize = " << m_p.fftSize << ", maxNK = " << maxNK << ", firstCentre = " << m_p.firstCentre << ")" << endl;
+    cerr << "atomsPerFrame = " << p.atomsPerFrame << " (q = " << q << ", Q = " << p.Q << ", atomHopFactor = " << atomHopFactor << ", atomSpacing = " << p.atomSpacing << ", fftSize = " << p.fftSize << ", maxNK = " << maxNK << ", firstCentre = " << p.firstCentre << ")" << endl;
 #endif
 
-    m_p.lastCentre = m_p.firstCentre + (m_p.atomsPerFrame - 1) * m_p.atomSpacing;
+    p.lastCentre = p.firstCentre + (p.atomsPerFrame - 1) * p.atomSpacing;
 
-    m_p.fftHop = (m_p.lastCentre + m_p.atomSpacing) - m_p.firstCentre;
+    p.fftHop = (p.lastCentre + p.atomSpacing) - p.firstCentre;
 
 #ifdef DEBUG_CQ_KERNEL
-    cerr << "fftHop = " << m_p.fftHop << endl;
+    cerr << "fftHop = " << p.fftHop << endl;
 #endif
 
+    return true;
+}
+
+bool
+CQKernel::generateKernel(const Properties *layout)
+{
+    double thresh = m_inparams.threshold;
+
+    double bpo = m_p.binsPerOctave;
+
+    double maxNK = 0.0;
+    if (!calculateLayout(m_inparams, m_p, maxNK)) {
+        return false;
+    }
+
+    if (layout) {
+        
+        // Use the given frame layout in place of our own, so long as
+        // our longest atom (which is centred on firstCentre in the
+        // first atom position and lastCentre in the last) fits in it
+
+        if (ceil(maxNK / 2.0) > layout->firstCentre ||
+            layout->lastCentre + floor(maxNK / 2.0) > layout->fftSize) {
+            cerr << "WARNING: CQKernel::generateKernel: kernel atoms do not fit in the requested frame layout, not generating a kernel" << endl;
+            return false;
+        }
+        
+        m_p.fftSize = layout->fftSize;
+        m_p.fftHop = layout->fftHop;
+        m_p.atomsPerFrame = layout->atomsPerFrame;
+        m_p.atomSpacing = layout->atomSpacing;
+        m_p.firstCentre = layout->firstCentre;
+        m_p.lastCentre = layout->lastCentre;
+    }
+
     m_fft = new FFT(m_p.fftSize);
 
     for (int k = 1; k <= m_p.binsPerOctave; ++k) {
@@ -344,8 +411,130 @@ CQKernel::finaliseKernel()
     m_kernel = sk;
 }
 
+shared_ptr<const CQKernel>
+CQKernel::getShared(CQParameters params)
+{
+    return getShared(params, 0);
+}
+
+shared_ptr<const CQKernel>
+CQKernel::getShared(CQParameters params, Properties layout)
+{
+    return getShared(params, &layout);
+}
+
+// Shared kernels, identified by everything that affects how they
+// are generated, are held weakly unless retained. A kernel still
+// being generated is represented by a future for it, which anyone
+// else wanting the same kernel waits on
+
+typedef vector<double> KernelKey;
+typedef shared_ptr<const CQKernel> KernelPtr;
+
+struct SharedKernels {
+    SharedKernels() : retain(false) { }
+    mutex m;
+    map<KernelKey, weak_ptr<const CQKernel> > kernels;
+    map<KernelKey, std::shared_future<KernelPtr> > pending;
+    map<KernelKey, KernelPtr> retained;
+    bool retain;
+};
+
+static SharedKernels &
+getSharedKernels()
+{
+    static SharedKernels shared;
+    return shared;
+}
+
+shared_ptr<const CQKernel>
+CQKernel::getShared(CQParameters params, const Properties *layout)
+{
+    KernelKey key {
+        params.sampleRate, params.minFrequency, params.maxFrequency,
+        double(params.binsPerOctave), params.q, params.atomHopFactor,
+        params.threshold, double(params.window)
+    };
+    if (layout) {
+        key.insert(key.end(), {
+                double(layout->fftSize), double(layout->fftHop),
+                double(layout->atomsPerFrame), double(layout->atomSpacing),
+                double(layout->firstCentre), double(layout->lastCentre)
+            });
+    }
+
+    SharedKernels &shared = getSharedKernels();
+    unique_lock<mutex> lock(shared.m);
+
+    KernelPtr kernel = shared.kernels[key].lock();
+
+    if (!kernel) {
+
+        auto i = shared.pending.find(key);
+
+        if (i != shared.pending.end()) {
+
+            // Someone else is generating it: wait for them, without
+            // holding up callers wanting any other kernel
+            
+            std::shared_future<KernelPtr> future = i->second;
+            lock.unlock();
+            kernel = future.get();
+            lock.lock();
+
+        } else {
+
+            // Generate it ourselves, likewise outside the lock
+            
+            std::promise<KernelPtr> promise;
+            shared.pending[key] = promise.get_future().share();
+            lock.unlock();
+
+            try {
+                kernel = KernelPtr(layout ?
+                                   new CQKernel(params, *layout) :
+                                   new CQKernel(params));
+            } catch (...) {
+                lock.lock();
+                shared.pending.erase(key);
+                promise.set_exception(std::current_exception());
+                throw;
+            }
+
+            lock.lock();
+            shared.kernels[key] = kernel;
+            shared.pending.erase(key);
+            promise.set_value(kernel);
+        }
+    }
+    
+    if (shared.retain) {
+        shared.retained[key] = kernel;
+    }
+
+    // Forget kernels no longer in use by anyone
+
+    for (auto i = shared.kernels.begin(); i != shared.kernels.end(); ) {
+        if (i->second.expired()) i = shared.kernels.erase(i);
+        else ++i;
+    }
+    
+    return kernel;
+}
+
+void
+CQKernel::setRetainShared(bool retain)
+{
+    SharedKernels &shared = getSharedKernels();
+    lock_guard<mutex> guard(shared.m);
+    shared.retain = retain;
+    if (!retain) {
+        shared.retained.clear();
+    }
+}
+
 vector<C>
-CQKernel::processForward(const vector<C> &cv)
+CQKernel::processForward(const vector<C> &cv) const
 {
     // straightforward matrix multiply (taking into account m_kernel's
     // slightly-sparse representation)
@@ -367,7 +556,7 @@ CQKernel::processForward(const vector<C> &cv)
 }
 
 vector<C>
-CQKernel::processInverse(const vector<C> &cv)
+CQKernel::processInverse(const vector<C> &cv) const
 {
     // matrix multiply by conjugate transpose of m_kernel. This is
     // actually the original kernel as calculated, we just stored the
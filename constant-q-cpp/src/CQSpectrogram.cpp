@@ -42,7 +42,18 @@ using std::endl;
 CQSpectrogram::CQSpectrogram(CQParameters params,
                              Interpolation interpolation) :
     m_cq(params),
-    m_interpolation(interpolation)
+    m_interpolation(interpolation),
+    m_buffers(1),
+    m_prevColumns(1)
+{
+}
+
+CQSpectrogram::CQSpectrogram(std::vector<CQParameters> params,
+                             Interpolation interpolation) :
+    m_cq(params),
+    m_interpolation(interpolation),
+    m_buffers(params.size()),
+    m_prevColumns(params.size())
 {
 }
 
@@ -53,17 +64,39 @@ CQSpectrogram::~CQSpectrogram()
 CQSpectrogram::RealBlock
 CQSpectrogram::process(const RealSequence &td)
 {
-    return postProcess(m_cq.process(td), false);
+    return postProcess(m_cq.process(td), false, 0);
 }
 
 CQSpectrogram::RealBlock
 CQSpectrogram::getRemainingOutput()
 {
-    return postProcess(m_cq.getRemainingOutput(), true);
+    return postProcess(m_cq.getRemainingOutput(), true, 0);
+}
+
+std::vector<CQSpectrogram::RealBlock>
+CQSpectrogram::processStreams(const RealSequence &td)
+{
+    std::vector<ComplexBlock> cq = m_cq.processStreams(td);
+    std::vector<RealBlock> out;
+    for (int s = 0; s < int(cq.size()); ++s) {
+        out.push_back(postProcess(cq[s], false, s));
+    }
+    return out;
+}
+
+std::vector<CQSpectrogram::RealBlock>
+CQSpectrogram::getRemainingOutputStreams()
+{
+    std::vector<ComplexBlock> cq = m_cq.getRemainingOutputStreams();
+    std::vector<RealBlock> out;
+    for (int s = 0; s < int(cq.size()); ++s) {
+        out.push_back(postProcess(cq[s], true, s));
+    }
+    return out;
 }
 
 CQSpectrogram::RealBlock
-CQSpectrogram::postProcess(const ComplexBlock &cq, bool insist)
+CQSpectrogram::postProcess(const ComplexBlock &cq, bool insist, int stream)
 {
     int width = cq.size();
 
@@ -97,54 +130,61 @@ CQSpectrogram::postProcess(const ComplexBlock &cq, bool insist)
 	return spec;
     }
 
+    RealBlock &buffer = m_buffers[stream];
+    
     for (int i = 0; i < width; ++i) {
-	m_buffer.push_back(spec[i]);
+	buffer.push_back(spec[i]);
     }
     
     if (m_interpolation == InterpolateHold) {
-	return fetchHold(insist);
+	return fetchHold(insist, stream);
     } else {
-	return fetchLinear(insist);
+	return fetchLinear(insist, stream);
     }
 }
 
 CQSpectrogram::RealBlock
-CQSpectrogram::fetchHold(bool)
+CQSpectrogram::fetchHold(bool, int stream)
 {
     RealBlock out;
+
+    RealBlock &buffer = m_buffers[stream];
+    RealColumn &prevColumn = m_prevColumns[stream];
     
-    int width = m_buffer.size();
+    int width = buffer.size();
     int height = getTotalBins();
 
     for (int i = 0; i < width; ++i) {
 	
-	RealColumn col = m_buffer[i];
+	RealColumn col = buffer[i];
 
 	int thisHeight = col.size();
-	int prevHeight = m_prevColumn.size();
+	int prevHeight = prevColumn.size();
 
 	for (int j = thisHeight; j < height; ++j) {
 	    if (j < prevHeight) {
-		col.push_back(m_prevColumn[j]);
+		col.push_back(prevColumn[j]);
 	    } else {
 		col.push_back(0.0);
 	    }
 	}
 
-	m_prevColumn = col;
+	prevColumn = col;
 	out.push_back(col);
     }
 
-    m_buffer.clear();
+    buffer.clear();
 
     return out;
 }
 
 CQSpectrogram::RealBlock
-CQSpectrogram::fetchLinear(bool insist)
+CQSpectrogram::fetchLinear(bool insist, int stream)
 {
     RealBlock out;
 
+    RealBlock &buffer = m_buffers[stream];
+
     //!!! This is surprisingly messy. I must be missing something.
 
     // We can only return any data when we have at least one column
@@ -163,7 +203,7 @@ CQSpectrogram::fetchLinear(bool insist)
     // reached the first full-height column in the CQ output, and we
     // can interpolate nothing.
     
-    int width = m_buffer.size();
+    int width = buffer.size();
     int height = getTotalBins();
 
     if (width == 0) return out;
@@ -172,7 +212,7 @@ CQSpectrogram::fetchLinear(bool insist)
     int secondFullHeight = -1;
 
     for (int i = 0; i < width; ++i) {
-	if ((int)m_buffer[i].size() == height) {
+	if ((int)buffer[i].size() == height) {
 	    if (firstFullHeight == -1) {
 		firstFullHeight = i;
 	    } else if (secondFullHeight == -1) {
@@ -186,30 +226,30 @@ CQSpectrogram::fetchLinear(bool insist)
 
     if (firstFullHeight < 0) {
 	if (insist) {
-            return fetchHold(true);
+            return fetchHold(true, stream);
 	} else {
 	    return out;
 	}
     } else if (firstFullHeight > 0) {
 	// can interpolate nothing, stash up to first full height & recurse
-	out = RealBlock(m_buffer.begin(), m_buffer.begin() + firstFullHeight);
-	m_buffer = RealBlock(m_buffer.begin() + firstFullHeight, m_buffer.end());
-	RealBlock more = fetchLinear(insist);
+	out = RealBlock(buffer.begin(), buffer.begin() + firstFullHeight);
+	buffer = RealBlock(buffer.begin() + firstFullHeight, buffer.end());
+	RealBlock more = fetchLinear(insist, stream);
 	out.insert(out.end(), more.begin(), more.end());
 	return out;
     } else if (secondFullHeight < 0) {
 	// firstFullHeight == 0, but there is no second full height --
 	// wait for it unless insist flag is set
 	if (insist) {
-            return fetchHold(true);
+            return fetchHold(true, stream);
 	} else {
 	    return out;
 	}
     } else {
 	// firstFullHeight == 0 and secondFullHeight also valid. Can interpolate
-	out = linearInterpolated(m_buffer, 0, secondFullHeight);
-	m_buffer = RealBlock(m_buffer.begin() + secondFullHeight, m_buffer.end());
-	RealBlock more = fetchLinear(insist);
+	out = linearInterpolated(buffer, 0, secondFullHeight);
+	buffer = RealBlock(buffer.begin() + secondFullHeight, buffer.end());
+	RealBlock more = fetchLinear(insist, stream);
 	out.insert(out.end(), more.begin(), more.end());
 	return out;
     }
@@ -34,6 +34,7 @@
 #include "Pitch.h"
 
 #include <cstdio>
+#include <stdexcept>
 
 using namespace std;
 
@@ -41,33 +42,67 @@ Chromagram::Chromagram(Parameters params) :
     m_params(params),
     m_cq(0)
 {
-    int highestOctave = m_params.lowestOctave + m_params.octaveCount - 1;
+    CQParameters p = makeCQParameters(params, m_minFrequency, m_maxFrequency);
+    
+    m_cq = new CQSpectrogram(p, CQSpectrogram::InterpolateLinear);
+}
+
+Chromagram::Chromagram(vector<Parameters> params) :
+    m_params(params.empty() ? Parameters(0) : params[0]),
+    m_cq(0)
+{
+    if (params.empty()) {
+        throw invalid_argument("At least one set of parameters is required");
+    }
+
+    vector<CQParameters> pp;
+    
+    for (int i = 0; i < int(params.size()); ++i) {
+        double minf, maxf;
+        pp.push_back(makeCQParameters(params[i], minf, maxf));
+        if (i == 0) {
+            m_minFrequency = minf;
+            m_maxFrequency = maxf;
+        }
+    }
+    
+    m_cq = new CQSpectrogram(pp, CQSpectrogram::InterpolateLinear);
+}
+
+CQParameters
+Chromagram::makeCQParameters(const Parameters &params,
+                             double &minFrequency,
+                             double &maxFrequency) const
+{
+    int highestOctave = params.lowestOctave + params.octaveCount - 1;
 
     int midiPitchLimit = (1 + highestOctave) * 12 + 12; // C just beyond top
     double midiPitchLimitFreq = Pitch::getFrequencyForPitch
-        (midiPitchLimit, 0, m_params.tuningFrequency);
+        (midiPitchLimit, 0, params.tuningFrequency);
 
     // Max frequency is frequency of the MIDI pitch just beyond the
     // top octave range (midiPitchLimit) minus one bin, then minus
     // floor(bins per semitone / 2)
-    int bps = m_params.binsPerOctave / 12;
-    m_maxFrequency = midiPitchLimitFreq /
-        pow(2.0, (1.0 + floor(bps/2)) / m_params.binsPerOctave);
+    int bps = params.binsPerOctave / 12;
+    maxFrequency = midiPitchLimitFreq /
+        pow(2.0, (1.0 + floor(bps/2)) / params.binsPerOctave);
 
     // Min frequency is frequency of midiPitchLimit lowered by the
     // appropriate number of octaveCount.
-    m_minFrequency = midiPitchLimitFreq /
-        pow(2.0, m_params.octaveCount + 1);
+    minFrequency = midiPitchLimitFreq /
+        pow(2.0, params.octaveCount + 1);
 
     CQParameters p
-        (params.sampleRate, m_minFrequency, m_maxFrequency, params.binsPerOctave);
+        (params.sampleRate, minFrequency, maxFrequency, params.binsPerOctave);
 
     p.q = params.q;
     p.atomHopFactor = params.atomHopFactor;
     p.threshold = params.threshold;
     p.window = params.window;
-    
-    m_cq = new CQSpectrogram(p, CQSpectrogram::InterpolateLinear);
+    p.parallelOctaves = params.parallelOctaves;
+    p.scheduler = params.scheduler;
+
+    return p;
 }
 
 Chromagram::~Chromagram()
@@ -93,6 +128,12 @@ Chromagram::getLatency() const
     return m_cq->getLatency();
 }
 
+int
+Chromagram::getInputAlignment() const
+{
+    return m_cq->getInputAlignment();
+}
+
 string
 Chromagram::getBinName(int bin) const
 {
@@ -126,6 +167,32 @@ Chromagram::getRemainingOutput()
     return convert(m_cq->getRemainingOutput());
 }
 
+int
+Chromagram::getStreamCount() const
+{
+    return m_cq->getStreamCount();
+}
+
+vector<CQBase::RealBlock>
+Chromagram::processStreams(const CQBase::RealSequence &data)
+{
+    vector<CQBase::RealBlock> out = m_cq->processStreams(data);
+    for (int s = 0; s < int(out.size()); ++s) {
+        out[s] = convert(out[s]);
+    }
+    return out;
+}
+
+vector<CQBase::RealBlock>
+Chromagram::getRemainingOutputStreams()
+{
+    vector<CQBase::RealBlock> out = m_cq->getRemainingOutputStreams();
+    for (int s = 0; s < int(out.size()); ++s) {
+        out[s] = convert(out[s]);
+    }
+    return out;
+}
+
 CQBase::RealBlock
 Chromagram::convert(const CQBase::RealBlock &cqout)
 {    
@@ -32,6 +32,7 @@
 #include "ConstantQ.h"
 
 #include "CQKernel.h"
+#include "TaskScheduler.h"
 
 #include "dsp/Resampler.h"
 #include "dsp/MathUtilities.h"
@@ -50,28 +51,69 @@ using std::endl;
 //#define DEBUG_CQ 1
 
 ConstantQ::ConstantQ(CQParameters params) :
+    ConstantQ(vector<CQParameters>(1, params))
+{
+}
+
+ConstantQ::ConstantQ(vector<CQParameters> params) :
     m_inparams(params),
-    m_sampleRate(params.sampleRate),
-    m_maxFrequency(params.maxFrequency),
-    m_minFrequency(params.minFrequency),
-    m_binsPerOctave(params.binsPerOctave),
-    m_kernel(0),
-    m_fft(0)
+    m_sampleRate(params.empty() ? 0.0 : params[0].sampleRate),
+    m_maxFrequency(params.empty() ? 0.0 : params[0].maxFrequency),
+    m_minFrequency(params.empty() ? 0.0 : params[0].minFrequency),
+    m_binsPerOctave(params.empty() ? 0 : params[0].binsPerOctave),
+    m_fft(0),
+    m_scheduler(0)
 {
-    if (m_minFrequency <= 0.0 || m_maxFrequency <= 0.0) {
-        throw std::invalid_argument("Frequency extents must be positive");
+    if (params.empty()) {
+        throw std::invalid_argument("At least one set of parameters is required");
     }
+    
+    for (int i = 0; i < (int)params.size(); ++i) {
 
+        const CQParameters &p = params[i];
+        
+        if (p.minFrequency <= 0.0 || p.maxFrequency <= 0.0) {
+            throw std::invalid_argument("Frequency extents must be positive");
+        }
+
+        if (p.sampleRate != m_sampleRate ||
+            p.binsPerOctave != m_binsPerOctave ||
+            p.q != params[0].q ||
+            p.atomHopFactor != params[0].atomHopFactor ||
+            p.threshold != params[0].threshold ||
+            p.window != params[0].window ||
+            p.decimator != params[0].decimator) {
+            throw std::invalid_argument("Parameters for all streams must differ only in frequency extents");
+        }
+
+        if (int(ceil(log(p.maxFrequency / p.minFrequency) / log(2))) !=
+            int(ceil(log(m_maxFrequency / m_minFrequency) / log(2)))) {
+            throw std::invalid_argument("Frequency extents for all streams must span the same number of octaves");
+        }
+    }
+    
     initialise();
 }
 
 ConstantQ::~ConstantQ()
 {
     delete m_fft;
+    for (int i = 0; i < (int)m_fftPool.size(); ++i) {
+        delete m_fftPool[i];
+    }
     for (int i = 0; i < (int)m_decimators.size(); ++i) {
         delete m_decimators[i];
     }
-    delete m_kernel;
+}
+
+bool
+ConstantQ::isValid() const
+{
+    if (m_kernels.empty()) return false;
+    for (int i = 0; i < (int)m_kernels.size(); ++i) {
+        if (!m_kernels[i]->isValid()) return false;
+    }
+    return true;
 }
 
 double
@@ -94,14 +136,41 @@ ConstantQ::initialise()
     m_octaves = int(ceil(log(m_maxFrequency / m_minFrequency) / log(2)));
 
     if (m_octaves < 1) {
-        m_kernel = 0; // incidentally causing isValid() to return false
+        // no kernels, incidentally causing isValid() to return false
         return;
     }
 
-    m_kernel = new CQKernel(m_inparams);
-    m_p = m_kernel->getProperties();
+    if (m_inparams.size() == 1) {
+
+        m_kernels.push_back(CQKernel::getShared(m_inparams[0]));
+
+    } else {
+
+        // All kernels use the frame layout of the one with the
+        // longest atoms, which is the only layout they are all
+        // guaranteed to fit into
+        
+        CQKernel::Properties layout =
+            CQKernel::calculateProperties(m_inparams[0]);
+        
+        for (int i = 1; i < (int)m_inparams.size(); ++i) {
+            CQKernel::Properties p =
+                CQKernel::calculateProperties(m_inparams[i]);
+            if (p.firstCentre > layout.firstCentre ||
+                (p.firstCentre == layout.firstCentre &&
+                 p.fftSize > layout.fftSize)) {
+                layout = p;
+            }
+        }
+
+        for (int i = 0; i < (int)m_inparams.size(); ++i) {
+            m_kernels.push_back(CQKernel::getShared(m_inparams[i], layout));
+        }
+    }
     
-    if (!m_kernel->isValid()) {
+    m_p = m_kernels[0]->getProperties();
+    
+    if (!isValid()) {
         return;
     }
 
@@ -124,7 +193,7 @@ ConstantQ::initialise()
 
         Resampler *r;
 
-        if (m_inparams.decimator == CQParameters::BetterDecimator) {
+        if (m_inparams[0].decimator == CQParameters::BetterDecimator) {
             r = new Resampler
                 (sourceRate, sourceRate / factor, 50, 0.05);
         } else {
@@ -261,39 +330,98 @@ ConstantQ::initialise()
     }
 
     m_fft = new FFTReal(m_p.fftSize);
+
+    if (m_inparams[0].parallelOctaves) {
+        m_scheduler = m_inparams[0].scheduler;
+        if (!m_scheduler) {
+            m_scheduler = TaskScheduler::getGlobal();
+        }
+    }
 }
 
 ConstantQ::ComplexBlock
 ConstantQ::process(const RealSequence &td)
 {
-    m_buffers[0].insert(m_buffers[0].end(), td.begin(), td.end());
+    return processStreams(td)[0];
+}
 
-    for (int i = 1; i < m_octaves; ++i) {
-        RealSequence dec = m_decimators[i]->process(td.data(), td.size());
-        m_buffers[i].insert(m_buffers[i].end(), dec.begin(), dec.end());
+vector<ConstantQ::ComplexBlock>
+ConstantQ::processStreams(const RealSequence &td)
+{
+    // The decimation for each octave is independent of the other
+    // octaves, and the FFT and kernel multiplication for each hop is
+    // independent of all other hops, so they are carried out as
+    // separate tasks (in parallel, if so configured). Only the final
+    // interleaving into output columns needs all of them.
+
+    runTasks(m_octaves, [&](int octave) {
+            if (octave == 0) {
+                m_buffers[0].insert(m_buffers[0].end(), td.begin(), td.end());
+            } else {
+                RealSequence dec =
+                    m_decimators[octave]->process(td.data(), td.size());
+                m_buffers[octave].insert(m_buffers[octave].end(),
+                                         dec.begin(), dec.end());
+            }
+        });
+
+    // We could have quite different remaining sample counts in
+    // different octaves, because (apart from the predictable added
+    // counts for decimator output on each block) we also have
+    // variable additional latency per octave. Work out how many
+    // whole big blocks every octave has enough input for.
+
+    int bigBlocks = -1;
+    for (int i = 0; i < m_octaves; ++i) {
+        int blocksThisOctave = pow(2, (m_octaves - i - 1));
+        int required = m_p.fftSize * blocksThisOctave;
+        int consumed = m_p.fftHop * blocksThisOctave;
+        int available = m_buffers[i].size();
+        int n = 0;
+        if (available >= required) {
+            n = (available - required) / consumed + 1;
+        }
+        if (bigBlocks < 0 || n < bigBlocks) {
+            bigBlocks = n;
+        }
+    }
+
+    // blocks[octave][hop][stream]
+    vector<vector<vector<ComplexBlock> > > blocks(m_octaves);
+
+    vector<std::pair<int, int> > hops; // (octave, hop) per task
+    for (int octave = 0; octave < m_octaves; ++octave) {
+        int n = bigBlocks * pow(2, (m_octaves - octave - 1));
+        blocks[octave].resize(n);
+        for (int i = 0; i < n; ++i) {
+            hops.push_back(std::pair<int, int>(octave, i));
+        }
     }
 
-    ComplexBlock out;
+    runTasks(int(hops.size()), [&](int t) {
+            int octave = hops[t].first, hop = hops[t].second;
+            FFTGuard fft(this);
+            blocks[octave][hop] =
+                processOctaveBlock(octave, hop * m_p.fftHop, fft.get());
+        });
+
+    for (int octave = 0; octave < m_octaves; ++octave) {
+        int consumed = int(blocks[octave].size()) * m_p.fftHop;
+        m_buffers[octave].erase(m_buffers[octave].begin(),
+                                m_buffers[octave].begin() + consumed);
+    }
 
-    while (true) {
+    int streams = int(m_kernels.size());
+    vector<ComplexBlock> outs(streams);
 
-	// We could have quite different remaining sample counts in
-	// different octaves, because (apart from the predictable
-	// added counts for decimator output on each block) we also
-	// have variable additional latency per octave
-	bool enough = true;
-	for (int i = 0; i < m_octaves; ++i) {
-	    int required = m_p.fftSize * pow(2, m_octaves - i - 1);
-	    if ((int)m_buffers[i].size() < required) {
-		enough = false;
-	    }
-	}
-	if (!enough) break;
+    for (int big = 0; big < bigBlocks; ++big) {
 
-        int base = out.size();
+        int base = outs[0].size();
         int totalColumns = pow(2, m_octaves - 1) * m_p.atomsPerFrame;
-        for (int i = 0; i < totalColumns; ++i) {
-            out.push_back(ComplexColumn());
+        for (int s = 0; s < streams; ++s) {
+            for (int i = 0; i < totalColumns; ++i) {
+                outs[s].push_back(ComplexColumn());
+            }
         }
 
         for (int octave = 0; octave < m_octaves; ++octave) {
@@ -301,69 +429,121 @@ ConstantQ::process(const RealSequence &td)
             int blocksThisOctave = pow(2, (m_octaves - octave - 1));
 
             for (int b = 0; b < blocksThisOctave; ++b) {
-                ComplexBlock block = processOctaveBlock(octave);
+
+                const vector<ComplexBlock> &octaveBlocks =
+                    blocks[octave][big * blocksThisOctave + b];
+
+                for (int s = 0; s < streams; ++s) {
+
+                    ComplexBlock &out = outs[s];
+                    const ComplexBlock &block = octaveBlocks[s];
                 
-                for (int j = 0; j < m_p.atomsPerFrame; ++j) {
+                    for (int j = 0; j < m_p.atomsPerFrame; ++j) {
 
-                    int target = base +
-			    (b * (totalColumns / blocksThisOctave) + 
-			     (j * ((totalColumns / blocksThisOctave) /
-				   m_p.atomsPerFrame)));
+                        int target = base +
+                            (b * (totalColumns / blocksThisOctave) + 
+                             (j * ((totalColumns / blocksThisOctave) /
+                                   m_p.atomsPerFrame)));
 
-                    while (int(out[target].size()) < 
-                           m_p.binsPerOctave * (octave + 1)) {
-                        out[target].push_back(Complex());
-                    }
+                        while (int(out[target].size()) < 
+                               m_p.binsPerOctave * (octave + 1)) {
+                            out[target].push_back(Complex());
+                        }
                     
-                    for (int i = 0; i < m_p.binsPerOctave; ++i) {
-                        out[target][m_p.binsPerOctave * octave + i] = 
-                            block[j][m_p.binsPerOctave - i - 1];
+                        for (int i = 0; i < m_p.binsPerOctave; ++i) {
+                            out[target][m_p.binsPerOctave * octave + i] = 
+                                block[j][m_p.binsPerOctave - i - 1];
+                        }
                     }
                 }
             }
         }
     }
 
-    return out;
+    return outs;
+}
+
+void
+ConstantQ::runTasks(int n, std::function<void(int)> task)
+{
+    if (m_scheduler) {
+        m_scheduler->run(n, task, &m_client);
+    } else {
+        for (int i = 0; i < n; ++i) {
+            task(i);
+        }
+    }
+}
+
+FFTReal *
+ConstantQ::acquireFFT()
+{
+    if (!m_scheduler) return m_fft;
+
+    std::lock_guard<std::mutex> guard(m_fftPoolMutex);
+    if (m_fftPool.empty()) {
+        return new FFTReal(m_p.fftSize);
+    }
+    FFTReal *fft = m_fftPool.back();
+    m_fftPool.pop_back();
+    return fft;
+}
+
+void
+ConstantQ::releaseFFT(FFTReal *fft)
+{
+    if (fft == m_fft) return;
+
+    std::lock_guard<std::mutex> guard(m_fftPoolMutex);
+    m_fftPool.push_back(fft);
 }
 
 ConstantQ::ComplexBlock
 ConstantQ::getRemainingOutput()
+{
+    return getRemainingOutputStreams()[0];
+}
+
+vector<ConstantQ::ComplexBlock>
+ConstantQ::getRemainingOutputStreams()
 {
     // Same as padding added at start, though rounded up
     int pad = ceil(double(m_outputLatency) / m_bigBlockSize) * m_bigBlockSize;
     RealSequence zeros(pad, 0.0);
-    return process(zeros);
+    return processStreams(zeros);
 }
 
-ConstantQ::ComplexBlock
-ConstantQ::processOctaveBlock(int octave)
+vector<ConstantQ::ComplexBlock>
+ConstantQ::processOctaveBlock(int octave, int offset, FFTReal *fft)
 {
     RealSequence ro(m_p.fftSize, 0.0);
     RealSequence io(m_p.fftSize, 0.0);
 
-    m_fft->forward(m_buffers[octave].data(), ro.data(), io.data());
-
-    m_buffers[octave] = RealSequence(m_buffers[octave].begin() + m_p.fftHop,
-                                     m_buffers[octave].end());
+    fft->forward(m_buffers[octave].data() + offset, ro.data(), io.data());
 
     ComplexSequence cv(m_p.fftSize);
     for (int i = 0; i < m_p.fftSize; ++i) {
         cv[i] = Complex(ro[i], io[i]);
     }
 
-    ComplexSequence cqrowvec = m_kernel->processForward(cv);
-
-    // Reform into a column matrix
-    ComplexBlock cqblock;
-    for (int j = 0; j < m_p.atomsPerFrame; ++j) {
-        cqblock.push_back(ComplexColumn());
-        for (int i = 0; i < m_p.binsPerOctave; ++i) {
-            cqblock[j].push_back(cqrowvec[i * m_p.atomsPerFrame + j]);
+    vector<ComplexBlock> cqblocks;
+    
+    for (int s = 0; s < (int)m_kernels.size(); ++s) {
+        
+        ComplexSequence cqrowvec = m_kernels[s]->processForward(cv);
+
+        // Reform into a column matrix
+        ComplexBlock cqblock;
+        for (int j = 0; j < m_p.atomsPerFrame; ++j) {
+            cqblock.push_back(ComplexColumn());
+            for (int i = 0; i < m_p.binsPerOctave; ++i) {
+                cqblock[j].push_back(cqrowvec[i * m_p.atomsPerFrame + j]);
+            }
         }
+
+        cqblocks.push_back(cqblock);
     }
 
-    return cqblock;
+    return cqblocks;
 }
 
-
@@ -0,0 +1,380 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    Constant-Q library
+    Copyright (c) 2013-2014 Queen Mary, University of London
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+    CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of the Centre for
+    Digital Music; Queen Mary, University of London; and Chris Cannam
+    shall not be used in advertising or otherwise to promote the sale,
+    use or other dealings in this Software without prior written
+    authorization.
+*/
+
+#include "TaskScheduler.h"
+
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <stdexcept>
+
+using std::vector;
+using std::function;
+using std::thread;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+
+// The worker index of the current thread, for each scheduler it
+// belongs to (a thread only ever belongs to one)
+static thread_local const TaskScheduler *tl_scheduler = 0;
+static thread_local int tl_worker = -1;
+
+TaskScheduler::TaskScheduler(int threads) :
+    m_queued(0),
+    m_nextClient(0),
+    m_stopping(false),
+    m_helping(0.0),
+    m_tasks(0),
+    m_steals(0)
+{
+    if (threads <= 0) {
+        threads = int(thread::hardware_concurrency());
+        if (threads < 1) threads = 1;
+    }
+
+    for (int i = 0; i < threads; ++i) {
+        m_workers.push_back(new Worker);
+    }
+    for (int i = 0; i < threads; ++i) {
+        m_workers[i]->thread = thread([this, i]() { runWorker(i); });
+    }
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    {
+        lock_guard<mutex> lock(m_sleepMutex);
+        m_stopping = true;
+    }
+    m_wake.notify_all();
+
+    for (int i = 0; i < int(m_workers.size()); ++i) {
+        m_workers[i]->thread.join();
+        delete m_workers[i];
+    }
+
+    lock_guard<mutex> lock(m_clientMutex);
+    for (Client *c : m_clients) {
+        c->m_scheduler = 0;
+    }
+}
+
+TaskScheduler *
+TaskScheduler::getGlobal()
+{
+    static TaskScheduler scheduler([]() {
+            const char *env = getenv("CQ_THREADS");
+            int threads = (env ? atoi(env) : 0);
+            return threads > 0 ? threads : 0;
+        }());
+    return &scheduler;
+}
+
+TaskScheduler::Client::~Client()
+{
+    if (m_scheduler) {
+        m_scheduler->removeClient(this);
+    }
+}
+
+void
+TaskScheduler::removeClient(Client *client)
+{
+    lock_guard<mutex> lock(m_clientMutex);
+    auto i = std::find(m_clients.begin(), m_clients.end(), client);
+    if (i == m_clients.end()) return;
+    int index = int(i - m_clients.begin());
+    m_clients.erase(i);
+    if (m_nextClient > index) --m_nextClient;
+    client->m_scheduler = 0;
+}
+
+int
+TaskScheduler::currentWorker() const
+{
+    return (tl_scheduler == this ? tl_worker : -1);
+}
+
+void
+TaskScheduler::spawn(Group &group, function<void()> function)
+{
+    Task task;
+    task.function = function;
+    task.group = &group;
+
+    ++group.m_pending;
+
+    // A worker pushes onto its own queue; any other thread queues
+    // the task on behalf of the group's client. We hold the group's
+    // mutex throughout, so that the task cannot complete, and the
+    // group be destroyed by its waiter, before we have notified it
+
+    int w = currentWorker();
+
+    {
+        lock_guard<mutex> groupLock(group.m_mutex);
+
+        if (w >= 0) {
+            lock_guard<mutex> lock(m_workers[w]->mutex);
+            m_workers[w]->queue.push_back(task);
+        } else {
+            Client *client = (group.m_client ? group.m_client : &m_defaultClient);
+            lock_guard<mutex> lock(m_clientMutex);
+            if (client->m_scheduler != this) {
+                if (client->m_scheduler) {
+                    --group.m_pending;
+                    throw std::invalid_argument
+                        ("Client is already registered with another scheduler");
+                }
+                client->m_scheduler = this;
+                m_clients.push_back(client);
+            }
+            client->m_queue.push_back(task);
+        }
+
+        ++m_queued;
+
+        // A thread waiting on the group can run the new task itself
+        ++group.m_unstarted;
+        group.m_done.notify_all();
+    }
+
+    // Taking the lock ensures no worker is between finding nothing to
+    // do and going to sleep, so none can miss this
+    { lock_guard<mutex> lock(m_sleepMutex); }
+    m_wake.notify_one();
+}
+
+bool
+TaskScheduler::take(int worker, Group *group, Task &task)
+{
+    // Take a task from the back of our own queue, or else steal one
+    // from the front of someone else's, or else take the oldest task
+    // of the next client in turn. If group is non-null, take only
+    // tasks belonging to that group.
+
+    int n = int(m_workers.size());
+
+    if (worker >= 0) {
+        Worker *w = m_workers[worker];
+        lock_guard<mutex> lock(w->mutex);
+        for (auto i = w->queue.rbegin(); i != w->queue.rend(); ++i) {
+            if (!group || i->group == group) {
+                task = *i;
+                w->queue.erase(std::next(i).base());
+                --m_queued;
+                --task.group->m_unstarted;
+                return true;
+            }
+        }
+    }
+
+    if (m_queued.load() == 0) {
+        return false;
+    }
+
+    int start = (worker >= 0 ? worker + 1 : 0);
+
+    for (int k = 0; k < n; ++k) {
+        int v = (start + k) % n;
+        if (v == worker) continue;
+        Worker *w = m_workers[v];
+        lock_guard<mutex> lock(w->mutex);
+        for (auto i = w->queue.begin(); i != w->queue.end(); ++i) {
+            if (!group || i->group == group) {
+                task = *i;
+                w->queue.erase(i);
+                --m_queued;
+                --task.group->m_unstarted;
+                if (worker >= 0) ++m_steals;
+                return true;
+            }
+        }
+    }
+
+    return takeFromClient(group, task);
+}
+
+bool
+TaskScheduler::takeFromClient(Group *group, Task &task)
+{
+    lock_guard<mutex> lock(m_clientMutex);
+
+    int n = int(m_clients.size());
+
+    for (int k = 0; k < n; ++k) {
+        int c = (m_nextClient + k) % n;
+        std::deque<Task> &queue = m_clients[c]->m_queue;
+        for (auto i = queue.begin(); i != queue.end(); ++i) {
+            if (!group || i->group == group) {
+                task = *i;
+                queue.erase(i);
+                --m_queued;
+                --task.group->m_unstarted;
+                m_nextClient = (c + 1) % n;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+void
+TaskScheduler::execute(Task &task, int worker)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    try {
+        task.function();
+    } catch (...) {
+        lock_guard<mutex> lock(task.group->m_mutex);
+        if (!task.group->m_failure) {
+            task.group->m_failure = std::current_exception();
+        }
+    }
+
+    double elapsed = std::chrono::duration<double>
+        (std::chrono::steady_clock::now() - start).count();
+
+    {
+        lock_guard<mutex> lock(m_statsMutex);
+        if (worker >= 0) {
+            m_workers[worker]->busy += elapsed;
+        } else {
+            m_helping += elapsed;
+        }
+    }
+    ++m_tasks;
+
+    Group *group = task.group;
+    task.function = function<void()>();
+
+    // The waiter may destroy the group as soon as it sees the count
+    // reach zero, but not before it has taken the group's mutex, so
+    // we must not touch the group once we have let go of that
+    lock_guard<mutex> lock(group->m_mutex);
+    if (--group->m_pending == 0) {
+        group->m_done.notify_all();
+    }
+}
+
+void
+TaskScheduler::runWorker(int index)
+{
+    tl_scheduler = this;
+    tl_worker = index;
+
+    Task task;
+
+    while (true) {
+
+        if (take(index, 0, task)) {
+            execute(task, index);
+            continue;
+        }
+
+        unique_lock<mutex> lock(m_sleepMutex);
+        if (m_queued.load() > 0) continue;
+        if (m_stopping) break;
+        m_wake.wait(lock);
+    }
+}
+
+void
+TaskScheduler::wait(Group &group)
+{
+    int worker = currentWorker();
+    Task task;
+
+    while (group.m_pending.load() > 0) {
+
+        if (take(worker, &group, task)) {
+            execute(task, worker);
+            continue;
+        }
+
+        // Everything left in the group is running elsewhere. Sleep
+        // until it is done, or until one of those tasks spawns more
+        // into the group for us to run
+
+        unique_lock<mutex> lock(group.m_mutex);
+        group.m_done.wait(lock, [&]() {
+                return group.m_pending.load() == 0 ||
+                    group.m_unstarted.load() > 0;
+            });
+    }
+
+    std::exception_ptr failure;
+    {
+        lock_guard<mutex> lock(group.m_mutex);
+        failure = group.m_failure;
+        group.m_failure = nullptr;
+    }
+    if (failure) std::rethrow_exception(failure);
+}
+
+void
+TaskScheduler::run(int n, function<void(int)> task, Client *client)
+{
+    Group group(client);
+    for (int i = 0; i < n; ++i) {
+        spawn(group, [&task, i]() { task(i); });
+    }
+    wait(group);
+}
+
+TaskScheduler::Statistics
+TaskScheduler::getStatistics() const
+{
+    Statistics stats;
+    lock_guard<mutex> lock(m_statsMutex);
+    for (int i = 0; i < int(m_workers.size()); ++i) {
+        stats.busy.push_back(m_workers[i]->busy);
+    }
+    stats.helping = m_helping;
+    stats.tasks = m_tasks.load();
+    stats.steals = m_steals.load();
+    return stats;
+}
+
+void
+TaskScheduler::resetStatistics()
+{
+    lock_guard<mutex> lock(m_statsMutex);
+    for (int i = 0; i < int(m_workers.size()); ++i) {
+        m_workers[i]->busy = 0.0;
+    }
+    m_helping = 0.0;
+    m_tasks = 0;
+    m_steals = 0;
+}
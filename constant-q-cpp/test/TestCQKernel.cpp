@@ -5,6 +5,7 @@
 #include <cmath>
 #include <vector>
 #include <iostream>
+#include <thread>
 
 using std::vector;
 using std::cerr;
@@ -63,5 +64,51 @@ BOOST_AUTO_TEST_CASE(fftSize) {
     BOOST_CHECK_EQUAL(k.getProperties().fftSize, 32);
 }
 
+BOOST_AUTO_TEST_CASE(shared) {
+    CQParameters params(rate, min, max, bpo);
+    std::shared_ptr<const CQKernel> a = CQKernel::getShared(params);
+    std::shared_ptr<const CQKernel> b = CQKernel::getShared(params);
+    BOOST_CHECK(a == b);
+    params.binsPerOctave = bpo * 2;
+    std::shared_ptr<const CQKernel> c = CQKernel::getShared(params);
+    BOOST_CHECK(a != c);
+    BOOST_CHECK_EQUAL(c->getProperties().binsPerOctave, bpo * 2);
+}
+
+BOOST_AUTO_TEST_CASE(sharedSameAsUnshared) {
+    CQParameters params(rate, min, max, bpo);
+    CQKernel k(params);
+    std::shared_ptr<const CQKernel> s = CQKernel::getShared(params);
+    vector<std::complex<double> > in(k.getProperties().fftSize);
+    for (int i = 0; i < int(in.size()); ++i) {
+        in[i] = std::complex<double>(sin(i), cos(i * 0.3));
+    }
+    vector<std::complex<double> > out1 = k.processForward(in);
+    vector<std::complex<double> > out2 = s->processForward(in);
+    BOOST_CHECK_EQUAL(out1.size(), out2.size());
+    for (int i = 0; i < int(out1.size()); ++i) {
+        BOOST_CHECK_EQUAL(out1[i], out2[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sharedConcurrent) {
+    // Callers asking for the same kernel at once all get the one
+    // generated by the first of them
+    CQParameters params(44100, 100, 14700, 48);
+    const int n = 4;
+    vector<std::shared_ptr<const CQKernel> > kernels(n);
+    vector<std::thread> threads;
+    for (int i = 0; i < n; ++i) {
+        threads.push_back(std::thread([&, i]() {
+                    kernels[i] = CQKernel::getShared(params);
+                }));
+    }
+    for (auto &t: threads) t.join();
+    for (int i = 1; i < n; ++i) {
+        BOOST_CHECK(kernels[i] == kernels[0]);
+    }
+    BOOST_CHECK(kernels[0]->isValid());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
@@ -0,0 +1,328 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+#include "cq/CQSpectrogram.h"
+#include "cq/Chromagram.h"
+
+#include "dsp/Window.h"
+
+#include <cmath>
+#include <vector>
+#include <iostream>
+#include <stdexcept>
+
+using std::vector;
+using std::cerr;
+using std::endl;
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(TestCQMulti)
+
+// Multi-stream transforms share a single front end between several
+// kernels. Check that each stream gives what a standalone transform
+// with the same kernel layout would, and that a stream tuned away
+// from the first one finds its peaks at its own bin frequencies.
+
+// Same small 2-octave setup as TestCQFrequency
+static const double sampleRate = 100;
+static const double cqmin = 11.8921;
+static const double cqmax = 40;
+static const double bpo = 4;
+static const int duration = sampleRate * 2;
+
+static vector<double>
+windowedSine(double freq)
+{
+    vector<double> input;
+    for (int i = 0; i < duration; ++i) {
+        input.push_back(sin((i * 2 * M_PI * freq) / sampleRate));
+    }
+    Window<double>(HanningWindow, duration).cut(input.data());
+    return input;
+}
+
+static CQSpectrogram::RealBlock
+runSingle(CQParameters params, const vector<double> &input)
+{
+    CQSpectrogram cq(params, CQSpectrogram::InterpolateLinear);
+    CQSpectrogram::RealBlock output = cq.process(input);
+    CQSpectrogram::RealBlock rest = cq.getRemainingOutput();
+    output.insert(output.end(), rest.begin(), rest.end());
+    return output;
+}
+
+static vector<CQSpectrogram::RealBlock>
+runMulti(vector<CQParameters> params, const vector<double> &input)
+{
+    CQSpectrogram cq(params, CQSpectrogram::InterpolateLinear);
+    BOOST_CHECK_EQUAL(cq.getStreamCount(), int(params.size()));
+    vector<CQSpectrogram::RealBlock> output = cq.processStreams(input);
+    vector<CQSpectrogram::RealBlock> rest = cq.getRemainingOutputStreams();
+    BOOST_CHECK_EQUAL(output.size(), params.size());
+    BOOST_CHECK_EQUAL(rest.size(), params.size());
+    for (int s = 0; s < int(output.size()); ++s) {
+        output[s].insert(output[s].end(), rest[s].begin(), rest[s].end());
+    }
+    return output;
+}
+
+static void
+checkBlocksEqual(const CQSpectrogram::RealBlock &a,
+                 const CQSpectrogram::RealBlock &b)
+{
+    BOOST_REQUIRE_EQUAL(a.size(), b.size());
+    for (int i = 0; i < int(a.size()); ++i) {
+        BOOST_REQUIRE_EQUAL(a[i].size(), b[i].size());
+        for (int j = 0; j < int(a[i].size()); ++j) {
+            BOOST_CHECK_EQUAL(a[i][j], b[i][j]);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(identical)
+{
+    // Two identical parameter sets share the standalone layout, so
+    // both streams must match the standalone transform exactly
+
+    CQParameters params(sampleRate, cqmin, cqmax, bpo);
+    vector<double> input = windowedSine(17);
+
+    CQSpectrogram::RealBlock single = runSingle(params, input);
+    vector<CQSpectrogram::RealBlock> multi =
+        runMulti(vector<CQParameters>(2, params), input);
+
+    checkBlocksEqual(multi[0], single);
+    checkBlocksEqual(multi[1], single);
+}
+
+BOOST_AUTO_TEST_CASE(order)
+{
+    // The common layout does not depend on the order in which the
+    // parameters are given, so neither does the output
+
+    double ratio = pow(2.0, 0.5 / bpo);
+    CQParameters p0(sampleRate, cqmin, cqmax, bpo);
+    CQParameters p1(sampleRate, cqmin * ratio, cqmax * ratio, bpo);
+    vector<double> input = windowedSine(24);
+
+    vector<CQParameters> forward, backward;
+    forward.push_back(p0);
+    forward.push_back(p1);
+    backward.push_back(p1);
+    backward.push_back(p0);
+
+    vector<CQSpectrogram::RealBlock> a = runMulti(forward, input);
+    vector<CQSpectrogram::RealBlock> b = runMulti(backward, input);
+
+    checkBlocksEqual(a[0], b[1]);
+    checkBlocksEqual(a[1], b[0]);
+}
+
+BOOST_AUTO_TEST_CASE(retuned)
+{
+    // A sinusoid at a bin frequency of the second, retuned stream
+    // should peak in that bin of that stream
+
+    double ratio = pow(2.0, 0.5 / bpo);
+    CQParameters p0(sampleRate, cqmin, cqmax, bpo);
+    CQParameters p1(sampleRate, cqmin * ratio, cqmax * ratio, bpo);
+
+    vector<CQParameters> params;
+    params.push_back(p0);
+    params.push_back(p1);
+
+    CQSpectrogram reference(p1, CQSpectrogram::InterpolateLinear);
+    int bin = 5;
+    double freq = reference.getBinFrequency(bin);
+
+    vector<CQSpectrogram::RealBlock> output =
+        runMulti(params, windowedSine(freq));
+
+    const CQSpectrogram::RealColumn &column =
+        output[1][output[1].size() / 2];
+
+    int maxidx = 0;
+    for (int j = 1; j < int(column.size()); ++j) {
+        if (column[j] > column[maxidx]) maxidx = j;
+    }
+    BOOST_CHECK_EQUAL(maxidx, bin);
+}
+
+BOOST_AUTO_TEST_CASE(chroma)
+{
+    // The chromagram wrapper gives one stream per parameter set and
+    // its first stream matches a standalone chromagram when the
+    // parameter sets are the same
+
+    Chromagram::Parameters params(sampleRate);
+    params.lowestOctave = 1;
+    params.octaveCount = 2;
+    params.binsPerOctave = 12;
+    vector<double> input = windowedSine(33);
+
+    Chromagram single(params);
+    CQBase::RealBlock a = single.process(input);
+    CQBase::RealBlock rest = single.getRemainingOutput();
+    a.insert(a.end(), rest.begin(), rest.end());
+
+    Chromagram multi(vector<Chromagram::Parameters>(3, params));
+    BOOST_CHECK_EQUAL(multi.getStreamCount(), 3);
+    vector<CQBase::RealBlock> b = multi.processStreams(input);
+    vector<CQBase::RealBlock> brest = multi.getRemainingOutputStreams();
+    for (int s = 0; s < 3; ++s) {
+        b[s].insert(b[s].end(), brest[s].begin(), brest[s].end());
+        checkBlocksEqual(b[s], a);
+    }
+}
+
+// Fine-tuning setup as used by the tuning-difference plugin: 120 bins
+// per octave over 4 octaves from C2, at a reference rate of 11025,
+// with one stream per cent either side of 440Hz
+static const double fineRate = 11025;
+static const int fineDistance = 4;
+
+static Chromagram::Parameters
+fineParams(int cents)
+{
+    Chromagram::Parameters params(fineRate);
+    params.lowestOctave = 2;
+    params.octaveCount = 4;
+    params.binsPerOctave = 120;
+    params.tuningFrequency = 440 * pow(2.0, cents / 1200.0);
+    params.atomHopFactor = 0.5;
+    params.window = CQParameters::Hann;
+    return params;
+}
+
+static vector<double>
+chords(double cents)
+{
+    static const double freqs[] = { 130.0, 196.5, 262.2, 311.0, 523.9, 659.0 };
+    double ratio = pow(2.0, cents / 1200.0);
+    int n = int(fineRate * 6);
+    vector<double> input(n, 0.0);
+    for (int i = 0; i < n; ++i) {
+        for (double f: freqs) {
+            input[i] += 0.1 * sin((i * 2 * M_PI * f * ratio) / fineRate);
+        }
+    }
+    return input;
+}
+
+static vector<double>
+profile(const CQBase::RealBlock &block)
+{
+    // Column totals, normalised to sum to 1
+    vector<double> totals(block.at(0).size(), 0.0);
+    for (const auto &column: block) {
+        for (int i = 0; i < int(column.size()); ++i) {
+            totals[i] += column[i];
+        }
+    }
+    double sum = 0.0;
+    for (double v: totals) sum += v;
+    for (double &v: totals) v /= sum;
+    return totals;
+}
+
+static vector<double>
+profile(Chromagram &chroma, const vector<double> &input)
+{
+    CQBase::RealBlock block = chroma.process(input);
+    CQBase::RealBlock rest = chroma.getRemainingOutput();
+    block.insert(block.end(), rest.begin(), rest.end());
+    return profile(block);
+}
+
+static double
+profileDistance(const vector<double> &a, const vector<double> &b)
+{
+    double d = 0.0;
+    for (int i = 0; i < int(a.size()); ++i) {
+        d += fabs(a[i] - b[i]);
+    }
+    return d;
+}
+
+static int
+closest(const vector<vector<double>> &candidates, const vector<double> &p)
+{
+    int best = 0;
+    for (int i = 1; i < int(candidates.size()); ++i) {
+        if (profileDistance(candidates[i], p) <
+            profileDistance(candidates[best], p)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+BOOST_AUTO_TEST_CASE(fineTuning)
+{
+    // Streams tuned a few cents apart share the layout of the lowest
+    // tuned, so the others differ slightly from standalone
+    // chromagrams at their tunings. The difference must be small
+    // beside that between neighbouring offsets, and must not change
+    // which offset best matches a retuned input
+
+    vector<Chromagram::Parameters> params;
+    for (int c = -fineDistance; c <= fineDistance; ++c) {
+        params.push_back(fineParams(c));
+    }
+
+    vector<double> input = chords(0);
+    Chromagram multi(params);
+    vector<CQBase::RealBlock> blocks = multi.processStreams(input);
+    vector<CQBase::RealBlock> rest = multi.getRemainingOutputStreams();
+
+    vector<vector<double>> shared, standalone;
+    for (int s = 0; s < int(params.size()); ++s) {
+        blocks[s].insert(blocks[s].end(), rest[s].begin(), rest[s].end());
+        shared.push_back(profile(blocks[s]));
+        Chromagram single(params[s]);
+        standalone.push_back(profile(single, input));
+    }
+
+    // The lowest tuned stream has its own layout
+    BOOST_CHECK(shared[0] == standalone[0]);
+
+    for (int s = 0; s + 1 < int(params.size()); ++s) {
+        double step = profileDistance(standalone[s], standalone[s+1]);
+        BOOST_CHECK_LT(profileDistance(shared[s], standalone[s]), step / 10);
+    }
+
+    // An input retuned up by d cents best matches the stream tuned
+    // down by d, whichever way the streams were computed
+
+    for (int d = -fineDistance; d <= fineDistance; ++d) {
+        Chromagram other(fineParams(0));
+        vector<double> p = profile(other, chords(d));
+        BOOST_CHECK_EQUAL(closest(shared, p), fineDistance - d);
+        BOOST_CHECK_EQUAL(closest(standalone, p), fineDistance - d);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(mismatched)
+{
+    CQParameters p0(sampleRate, cqmin, cqmax, bpo);
+
+    CQParameters p1(p0);
+    p1.binsPerOctave = bpo * 2;
+    vector<CQParameters> params;
+    params.push_back(p0);
+    params.push_back(p1);
+    BOOST_CHECK_THROW(ConstantQ cq(params), std::invalid_argument);
+
+    CQParameters p2(sampleRate, cqmin, cqmax * 2, bpo);
+    params[1] = p2;
+    BOOST_CHECK_THROW(ConstantQ cq(params), std::invalid_argument);
+
+    vector<CQParameters> none;
+    BOOST_CHECK_THROW(ConstantQ cq(none), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
@@ -0,0 +1,99 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+#include "cq/ConstantQ.h"
+#include "cq/TaskScheduler.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+#include <iostream>
+
+using std::vector;
+using std::cerr;
+using std::endl;
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(TestCQParallel)
+
+// Processing octaves in parallel must give exactly the same output as
+// processing them serially, whatever the input block size
+
+static const double sampleRate = 400;
+static const double cqmin = 10;
+static const double cqmax = 160;
+static const int bpo = 4;
+static const int duration = sampleRate * 10;
+
+static ConstantQ::ComplexBlock
+run(bool parallel, TaskScheduler *scheduler,
+    int blockSize, const vector<double> &input)
+{
+    CQParameters params(sampleRate, cqmin, cqmax, bpo);
+    params.parallelOctaves = parallel;
+    params.scheduler = scheduler;
+    ConstantQ cq(params);
+    BOOST_CHECK(cq.isValid());
+
+    ConstantQ::ComplexBlock output;
+    for (int i = 0; i < int(input.size()); i += blockSize) {
+        int n = std::min(blockSize, int(input.size()) - i);
+        ConstantQ::RealSequence block(input.begin() + i,
+                                      input.begin() + i + n);
+        ConstantQ::ComplexBlock out = cq.process(block);
+        output.insert(output.end(), out.begin(), out.end());
+    }
+    ConstantQ::ComplexBlock rest = cq.getRemainingOutput();
+    output.insert(output.end(), rest.begin(), rest.end());
+    return output;
+}
+
+static void
+testParallelWith(int blockSize)
+{
+    vector<double> input;
+    srand(0);
+    for (int i = 0; i < duration; ++i) {
+        input.push_back(sin(i * 2 * M_PI * 50 / sampleRate) +
+                        (double(rand()) / RAND_MAX) - 0.5);
+    }
+
+    ConstantQ::ComplexBlock serial = run(false, 0, blockSize, input);
+    BOOST_CHECK(serial.size() > 0);
+
+    // Once with a scheduler of the transform's own, and once with
+    // one shared between two transforms running at the same time
+
+    vector<ConstantQ::ComplexBlock> parallel;
+    parallel.push_back(run(true, 0, blockSize, input));
+
+    TaskScheduler scheduler(3);
+    parallel.push_back(ConstantQ::ComplexBlock());
+    parallel.push_back(ConstantQ::ComplexBlock());
+    scheduler.run(2, [&](int i) {
+            parallel[i + 1] = run(true, &scheduler, blockSize, input);
+        });
+
+    for (int p = 0; p < int(parallel.size()); ++p) {
+        BOOST_REQUIRE_EQUAL(serial.size(), parallel[p].size());
+        for (int i = 0; i < int(serial.size()); ++i) {
+            BOOST_REQUIRE_EQUAL(serial[i].size(), parallel[p][i].size());
+            for (int j = 0; j < int(serial[i].size()); ++j) {
+                BOOST_CHECK_EQUAL(serial[i][j].real(),
+                                  parallel[p][i][j].real());
+                BOOST_CHECK_EQUAL(serial[i][j].imag(),
+                                  parallel[p][i][j].imag());
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(block_64) { testParallelWith(64); }
+BOOST_AUTO_TEST_CASE(block_1000) { testParallelWith(1000); }
+BOOST_AUTO_TEST_CASE(block_all) { testParallelWith(duration); }
+
+BOOST_AUTO_TEST_SUITE_END()
+
@@ -0,0 +1,168 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+#include "cq/TaskScheduler.h"
+
+#include <atomic>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <stdexcept>
+
+using std::vector;
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(TestTaskScheduler)
+
+BOOST_AUTO_TEST_CASE(runAll)
+{
+    TaskScheduler scheduler(4);
+    BOOST_CHECK_EQUAL(scheduler.getThreadCount(), 4);
+
+    int n = 1000;
+    vector<int> done(n, 0);
+    scheduler.run(n, [&](int i) { done[i] += i; });
+
+    for (int i = 0; i < n; ++i) {
+        BOOST_CHECK_EQUAL(done[i], i);
+    }
+
+    TaskScheduler::Statistics stats = scheduler.getStatistics();
+    BOOST_CHECK_EQUAL(stats.tasks, n);
+    BOOST_CHECK_EQUAL(int(stats.busy.size()), 4);
+}
+
+BOOST_AUTO_TEST_CASE(nested)
+{
+    // Tasks that spawn subtasks and wait for them, with more outer
+    // tasks than threads, must neither deadlock nor lose any work
+
+    TaskScheduler scheduler(2);
+    std::atomic<int> count(0);
+
+    scheduler.run(50, [&](int) {
+            scheduler.run(20, [&](int) {
+                    scheduler.run(3, [&](int) { ++count; });
+                });
+        });
+
+    BOOST_CHECK_EQUAL(count.load(), 50 * 20 * 3);
+}
+
+BOOST_AUTO_TEST_CASE(lateSpawn)
+{
+    // A task spawned into a group by a running task of that group,
+    // while the only worker is busy, can only be run by the thread
+    // waiting on the group, which must therefore be woken for it
+
+    TaskScheduler scheduler(1);
+    TaskScheduler::Group group;
+    std::atomic<bool> ran(false);
+
+    scheduler.spawn(group, [&]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            scheduler.spawn(group, [&]() { ran = true; });
+            while (!ran) std::this_thread::yield();
+        });
+
+    scheduler.wait(group);
+
+    BOOST_CHECK(ran.load());
+    BOOST_CHECK_EQUAL(scheduler.getStatistics().tasks, 2);
+}
+
+BOOST_AUTO_TEST_CASE(groups)
+{
+    TaskScheduler scheduler(3);
+    TaskScheduler::Group a, b;
+    std::atomic<int> ca(0), cb(0);
+
+    for (int i = 0; i < 100; ++i) {
+        scheduler.spawn(a, [&]() { ++ca; });
+        scheduler.spawn(b, [&]() { ++cb; });
+    }
+
+    scheduler.wait(a);
+    BOOST_CHECK_EQUAL(ca.load(), 100);
+    scheduler.wait(b);
+    BOOST_CHECK_EQUAL(cb.load(), 100);
+}
+
+BOOST_AUTO_TEST_CASE(exception)
+{
+    TaskScheduler scheduler(2);
+    std::atomic<int> count(0);
+
+    BOOST_CHECK_THROW(scheduler.run(10, [&](int i) {
+                ++count;
+                if (i == 5) throw std::runtime_error("task failed");
+            }), std::runtime_error);
+
+    // All the other tasks still ran
+    BOOST_CHECK_EQUAL(count.load(), 10);
+
+    // And the scheduler is still usable
+    scheduler.run(10, [&](int) { ++count; });
+    BOOST_CHECK_EQUAL(count.load(), 20);
+}
+
+BOOST_AUTO_TEST_CASE(fairness)
+{
+    // One client queueing many tasks must not hold up another that
+    // queues a few: the single worker should alternate between them
+
+    TaskScheduler scheduler(1);
+    TaskScheduler::Client busyClient, otherClient;
+    TaskScheduler::Group gate, busy(&busyClient), other(&otherClient);
+
+    std::atomic<bool> open(false);
+    std::mutex mutex;
+    std::vector<int> order;
+
+    // Hold the worker up until everything has been queued
+    scheduler.spawn(gate, [&]() { while (!open) std::this_thread::yield(); });
+
+    for (int i = 0; i < 100; ++i) {
+        scheduler.spawn(busy, [&]() {
+                std::lock_guard<std::mutex> guard(mutex);
+                order.push_back(0);
+            });
+    }
+    for (int i = 0; i < 2; ++i) {
+        scheduler.spawn(other, [&]() {
+                std::lock_guard<std::mutex> guard(mutex);
+                order.push_back(1);
+            });
+    }
+
+    open = true;
+    scheduler.wait(gate);
+    scheduler.wait(other);
+    scheduler.wait(busy);
+
+    BOOST_REQUIRE_EQUAL(int(order.size()), 102);
+    int last = 0;
+    for (int i = 0; i < int(order.size()); ++i) {
+        if (order[i] == 1) last = i;
+    }
+    BOOST_CHECK(last < 4);
+}
+
+BOOST_AUTO_TEST_CASE(global)
+{
+    TaskScheduler *scheduler = TaskScheduler::getGlobal();
+    BOOST_CHECK(scheduler);
+    BOOST_CHECK_EQUAL(scheduler, TaskScheduler::getGlobal());
+    BOOST_CHECK(scheduler->getThreadCount() > 0);
+
+    std::atomic<int> count(0);
+    scheduler->run(10, [&](int) { ++count; });
+    BOOST_CHECK_EQUAL(count.load(), 10);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
@@ -0,0 +1,133 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+   Run many channels of chromagram analysis through one shared
+   TaskScheduler, in the way the tuning-difference plugin does, and
+   report how well the pool's threads are kept busy.
+
+   Each configuration is run twice: once with one task per channel
+   per block only, and once with the octaves and hops of each channel
+   also split into tasks (parallelOctaves). The former is limited by
+   the slowest channel whenever there are few channels; the latter
+   should keep every thread busy regardless.
+
+   Utilisation is the time spent in tasks as a proportion of the wall
+   time available to all threads. It is measured in wall time, so it
+   will read high if there are more threads than free cores.
+*/
+
+#include "Chromagram.h"
+#include "TaskScheduler.h"
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+
+using std::vector;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+static double
+bench(TaskScheduler &scheduler, int channels, double seconds,
+      bool parallelOctaves)
+{
+    // A low input rate keeps the kernels and buffers small enough
+    // for a thousand channels to fit comfortably in memory
+
+    const double sampleRate = 8000;
+    const int blockSize = 1024;
+
+    Chromagram::Parameters params(sampleRate);
+    params.lowestOctave = 2;
+    params.octaveCount = 4;
+    params.binsPerOctave = 36;
+    params.atomHopFactor = 0.5;
+    params.parallelOctaves = parallelOctaves;
+    params.scheduler = &scheduler;
+
+    vector<Chromagram *> chroma;
+    for (int c = 0; c < channels; ++c) {
+        chroma.push_back(new Chromagram(params));
+    }
+
+    vector<double> block(blockSize);
+    int blocks = int(ceil(seconds * sampleRate / blockSize));
+
+    scheduler.resetStatistics();
+    auto start = std::chrono::steady_clock::now();
+
+    for (int b = 0; b < blocks; ++b) {
+        for (int i = 0; i < blockSize; ++i) {
+            block[i] = sin(2.0 * M_PI * 440.0 * (b * blockSize + i) / sampleRate);
+        }
+        scheduler.run(channels, [&](int c) { chroma[c]->process(block); });
+    }
+    scheduler.run(channels, [&](int c) { chroma[c]->getRemainingOutput(); });
+
+    double wall = std::chrono::duration<double>
+        (std::chrono::steady_clock::now() - start).count();
+
+    for (int c = 0; c < channels; ++c) {
+        delete chroma[c];
+    }
+
+    return wall;
+}
+
+static void
+report(TaskScheduler &scheduler, int channels, double seconds,
+       bool parallelOctaves)
+{
+    double wall = bench(scheduler, channels, seconds, parallelOctaves);
+
+    TaskScheduler::Statistics stats = scheduler.getStatistics();
+    double busy = stats.helping;
+    for (double b : stats.busy) busy += b;
+
+    cout << std::setw(8) << channels
+         << std::setw(12) << (parallelOctaves ? "octaves" : "channels")
+         << std::setw(10) << std::fixed << std::setprecision(3) << wall
+         << std::setw(10) << std::setprecision(1)
+         << 100.0 * busy / (wall * scheduler.getThreadCount())
+         << std::setw(12) << stats.tasks
+         << std::setw(10) << stats.steals
+         << endl;
+}
+
+int main(int argc, char **argv)
+{
+    int threads = 0;
+    double seconds = 2.0;
+
+    if (argc > 3) {
+        cerr << "Usage: " << argv[0] << " [threads [seconds]]" << endl;
+        return 2;
+    }
+    if (argc > 1) threads = atoi(argv[1]);
+    if (argc > 2) seconds = atof(argv[2]);
+
+    TaskScheduler scheduler(threads);
+
+    cout << scheduler.getThreadCount() << " threads, "
+         << seconds << " seconds of audio per channel" << endl << endl;
+
+    cout << std::setw(8) << "channels"
+         << std::setw(12) << "tasks per"
+         << std::setw(10) << "wall (s)"
+         << std::setw(10) << "util %"
+         << std::setw(12) << "tasks"
+         << std::setw(10) << "steals"
+         << endl;
+
+    int counts[] = { 2, 8, 64, 1000 };
+    for (int channels : counts) {
+        report(scheduler, channels, seconds, false);
+        report(scheduler, channels, seconds, true);
+    }
+
+    return 0;
+}
@@ -51,6 +51,7 @@ CQChromaVamp::CQChromaVamp(float inputSampleRate) :
     m_octaveCount(defaultOctaveCount),
     m_tuningFrequency(defaultTuningFrequency),
     m_bpo(defaultBPO),
+    m_parallel(false),
     m_chroma(0),
     m_haveStartTime(false),
     m_columnCount(0)
@@ -148,6 +149,17 @@ CQChromaVamp::getParameterDescriptors() const
     desc.quantizeStep = 1;
     list.push_back(desc);
 
+    desc.identifier = "parallel";
+    desc.name = "Parallel Octaves";
+    desc.unit = "";
+    desc.description = "Process octaves as parallel tasks on the process-wide task pool";
+    desc.minValue = 0;
+    desc.maxValue = 1;
+    desc.defaultValue = 0;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    list.push_back(desc);
+
     return list;
 }
 
@@ -166,6 +178,9 @@ CQChromaVamp::getParameter(std::string param) const
     if (param == "bpo") {
         return m_bpo;
     }
+    if (param == "parallel") {
+        return m_parallel ? 1.f : 0.f;
+    }
     std::cerr << "WARNING: CQChromaVamp::getParameter: unknown parameter \""
               << param << "\"" << std::endl;
     return 0.0;
@@ -182,6 +197,8 @@ CQChromaVamp::setParameter(std::string param, float value)
         m_tuningFrequency = value;
     } else if (param == "bpo") {
         m_bpo = int(value + 0.5f);
+    } else if (param == "parallel") {
+        m_parallel = (value > 0.5f);
     } else {
         std::cerr << "WARNING: CQChromaVamp::setParameter: unknown parameter \""
                   << param << "\"" << std::endl;
@@ -221,6 +238,7 @@ CQChromaVamp::reset()
     p.octaveCount = m_octaveCount;
     p.binsPerOctave = m_bpo;
     p.tuningFrequency = m_tuningFrequency;
+    p.parallelOctaves = m_parallel; // on the process-wide scheduler
 
     m_chroma = new Chromagram(p);
 
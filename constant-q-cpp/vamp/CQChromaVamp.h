@@ -73,6 +73,7 @@ protected:
     int m_octaveCount;
     float m_tuningFrequency;
     int m_bpo;
+    bool m_parallel;
 
     Chromagram *m_chroma;
     int m_stepSize;
@@ -62,6 +62,7 @@ CQVamp::CQVamp(float inputSampleRate, bool midiPitchParameters) :
     m_tuningFrequency(defaultTuningFrequency),
     m_bpo(defaultBPO),
     m_interpolation(CQSpectrogram::InterpolateLinear),
+    m_parallel(false),
     m_cq(0),
     m_maxFrequency(defaultMaxFrequency),
     m_minFrequency(defaultMinFrequency),
@@ -212,6 +213,18 @@ CQVamp::getParameterDescriptors() const
     desc.valueNames.push_back("Linear interpolation");
     list.push_back(desc);
 
+    desc.identifier = "parallel";
+    desc.name = "Parallel Octaves";
+    desc.unit = "";
+    desc.description = "Process octaves as parallel tasks on the process-wide task pool";
+    desc.minValue = 0;
+    desc.maxValue = 1;
+    desc.defaultValue = 0;
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    desc.valueNames.clear();
+    list.push_back(desc);
+
     return list;
 }
 
@@ -233,6 +246,9 @@ CQVamp::getParameter(std::string param) const
     if (param == "interpolation") {
         return (float)m_interpolation;
     }
+    if (param == "parallel") {
+        return m_parallel ? 1.f : 0.f;
+    }
     if (param == "minfreq" && !m_midiPitchParameters) {
         return m_minFrequency;
     }
@@ -257,6 +273,8 @@ CQVamp::setParameter(std::string param, float value)
         m_bpo = int(value + 0.5f);
     } else if (param == "interpolation") {
         m_interpolation = (CQSpectrogram::Interpolation)int(value + 0.5f);
+    } else if (param == "parallel") {
+        m_parallel = (value > 0.5f);
     } else if (param == "minfreq" && !m_midiPitchParameters) {
         m_minFrequency = value;
     } else if (param == "maxfreq" && !m_midiPitchParameters) {
@@ -303,6 +321,7 @@ CQVamp::reset()
 {
     delete m_cq;
     CQParameters p(m_inputSampleRate, m_minFrequency, m_maxFrequency, m_bpo);
+    p.parallelOctaves = m_parallel; // on the process-wide scheduler
     m_cq = new CQSpectrogram(p, m_interpolation);
     m_haveStartTime = false;
     m_columnCount = 0;
@@ -77,6 +77,7 @@ protected:
     float m_tuningFrequency;
     int m_bpo;
     CQSpectrogram::Interpolation m_interpolation;
+    bool m_parallel;
 
     CQSpectrogram *m_cq;
     float m_maxFrequency;
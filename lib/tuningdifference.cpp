@@ -0,0 +1,527 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#include "tuningdifference.h"
+
+#include "src/TuningDifference.h"
+#include "src/ProfileIndex.h"
+#include "src/TuningMatrix.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <memory>
+
+using namespace std;
+
+// The plugin is fed fixed-size blocks, the audio given to
+// td_process() being gathered into them
+static const int blockSize = 1024;
+
+// The number of indexed profiles with the closest signatures that
+// td_find_nearest() compares properly, for each one it returns
+static const int shortListFactor = 10;
+static const int minShortList = 50;
+
+struct td_analyser
+{
+    td_analyser(float rate, int channelCount) :
+        plugin(rate),
+        sampleRate(rate),
+        channels(channelCount),
+        references(0),
+        initialised(false),
+        finished(false),
+        segmentStart(0),
+        segmentEnd(0),
+        filled(0),
+        frame(0),
+        blocks(channelCount, vector<float>(blockSize, 0.f)),
+        buffers(channelCount)
+    { }
+
+    TuningDifference plugin;
+    float sampleRate;
+    int channels;
+    int references;
+    bool initialised;
+    bool finished;
+    int64_t segmentStart;
+    int64_t segmentEnd;
+    unique_ptr<TuningState> checkpoint;
+    int filled;
+    int64_t frame;
+    vector<vector<float>> blocks;
+    vector<const float *> buffers;
+    vector<float> cents;
+    vector<float> frequencies;
+    vector<float> stages;
+    vector<float> probes;
+    vector<float> gated;
+    vector<vector<float>> profiles;
+    mutable string error;
+
+    void initialise() {
+        if (initialised) return;
+        if (!plugin.initialise(channels, blockSize, blockSize)) {
+            throw invalid_argument("Channel count must exceed the number "
+                                   "of references");
+        }
+        references = int(plugin.getParameter("references"));
+        if (segmentEnd > segmentStart) {
+            plugin.setSegment(segmentStart, segmentEnd);
+        }
+        if (checkpoint) {
+            plugin.resume(*checkpoint);
+            checkpoint.reset();
+        }
+        frame = plugin.getSegmentFeedStart();
+        initialised = true;
+    }
+
+    void processBlock() {
+        for (int c = 0; c < channels; ++c) {
+            buffers[c] = blocks[c].data();
+        }
+        plugin.process(buffers.data(),
+                       Vamp::RealTime::frame2RealTime(frame, int(sampleRate)));
+        frame += blockSize;
+        filled = 0;
+    }
+
+    void finishInput() {
+        initialise();
+        // The last block is padded with silence, as a host would
+        if (filled > 0) {
+            for (auto &b: blocks) {
+                fill(b.begin() + filled, b.end(), 0.f);
+            }
+            processBlock();
+        }
+    }
+
+    void finish(const TuningState &state) {
+
+        // Outputs are identified by index, as in any host, and must
+        // be described before the features are calculated
+        
+        int centsOutput = -1, hzOutput = -1, stagesOutput = -1;
+        int probesOutput = -1, gatedOutput = -1;
+        int refOutput = -1, otherOutput = -1;
+        Vamp::Plugin::OutputList outputs = plugin.getOutputDescriptors();
+        for (int i = 0; i < int(outputs.size()); ++i) {
+            if (outputs[i].identifier == "cents") centsOutput = i;
+            if (outputs[i].identifier == "tuningfreq") hzOutput = i;
+            if (outputs[i].identifier == "stages") stagesOutput = i;
+            if (outputs[i].identifier == "probes") probesOutput = i;
+            if (outputs[i].identifier == "gated") gatedOutput = i;
+            if (outputs[i].identifier == "reffeature") refOutput = i;
+            if (outputs[i].identifier == "otherfeature") otherOutput = i;
+        }
+
+        Vamp::Plugin::FeatureSet fs = plugin.getFeaturesForState(state);
+
+        int others = channels - references;
+        if (fs[centsOutput].empty() || fs[hzOutput].empty() ||
+            fs[stagesOutput].empty() || fs[probesOutput].empty() ||
+            fs[gatedOutput].empty() ||
+            int(fs[refOutput].size()) != references * others ||
+            int(fs[otherOutput].size()) != references * others) {
+            throw runtime_error("Analysis returned no results");
+        }
+        cents = fs[centsOutput][0].values;
+        frequencies = fs[hzOutput][0].values;
+        stages = fs[stagesOutput][0].values;
+        probes = fs[probesOutput][0].values;
+        gated = fs[gatedOutput][0].values;
+
+        // The profiles of the reference and the other channel are
+        // returned for each result, in the same order as the results
+        
+        for (int c = 0; c < references; ++c) {
+            profiles.push_back(fs[refOutput][c * others].values);
+        }
+        for (int c = 0; c < others; ++c) {
+            profiles.push_back(fs[otherOutput][c].values);
+        }
+
+        finished = true;
+    }
+};
+
+static thread_local string createError;
+
+template <typename F>
+static int
+guard(const td_analyser *analyser, F f)
+{
+    if (!analyser) return 1;
+    try {
+        f();
+        analyser->error = "";
+        return 0;
+    } catch (const std::exception &e) {
+        analyser->error = e.what();
+        return 1;
+    }
+}
+
+int
+td_get_api_version(void)
+{
+    return TD_API_VERSION;
+}
+
+td_analyser *
+td_create(float sampleRate, int channels)
+{
+    if (!(sampleRate > 0.f) || channels < 2) {
+        createError = "Invalid sample rate or channel count";
+        return 0;
+    }
+    try {
+        td_analyser *analyser = new td_analyser(sampleRate, channels);
+        createError = "";
+        return analyser;
+    } catch (const std::exception &e) {
+        createError = e.what();
+        return 0;
+    }
+}
+
+void
+td_destroy(td_analyser *analyser)
+{
+    delete analyser;
+}
+
+int
+td_set_parameter(td_analyser *analyser, const char *identifier, float value)
+{
+    return guard(analyser, [&]() {
+            if (analyser->initialised) {
+                throw logic_error("Parameters must be set before the "
+                                  "first call to td_process()");
+            }
+            analyser->plugin.setParameter(identifier, value);
+        });
+}
+
+int
+td_process(td_analyser *analyser, const float *const *channels, int frames)
+{
+    return guard(analyser, [&]() {
+            if (analyser->finished) {
+                throw logic_error("Analyser has already finished");
+            }
+            if (frames < 0) {
+                throw invalid_argument("Negative frame count");
+            }
+            analyser->initialise();
+            int done = 0;
+            while (done < frames) {
+                int n = min(frames - done, blockSize - analyser->filled);
+                for (int c = 0; c < analyser->channels; ++c) {
+                    copy(channels[c] + done, channels[c] + done + n,
+                         analyser->blocks[c].begin() + analyser->filled);
+                }
+                analyser->filled += n;
+                done += n;
+                if (analyser->filled == blockSize) {
+                    analyser->processBlock();
+                }
+            }
+        });
+}
+
+int
+td_finish(td_analyser *analyser)
+{
+    return guard(analyser, [&]() {
+            if (analyser->finished) {
+                throw logic_error("Analyser has already finished");
+            }
+            analyser->finishInput();
+            analyser->finish(analyser->plugin.getState());
+        });
+}
+
+int
+td_set_segment(td_analyser *analyser, long long startFrame,
+               long long endFrame)
+{
+    return guard(analyser, [&]() {
+            if (analyser->initialised) {
+                throw logic_error("Segment must be set before the "
+                                  "first call to td_process()");
+            }
+            if (startFrame < 0 || endFrame <= startFrame) {
+                throw invalid_argument("Invalid segment range");
+            }
+            analyser->segmentStart = startFrame;
+            analyser->segmentEnd = endFrame;
+        });
+}
+
+long long
+td_get_segment_feed_start(td_analyser *analyser)
+{
+    long long frame = -1;
+    guard(analyser, [&]() {
+            analyser->initialise();
+            frame = analyser->plugin.getSegmentFeedStart();
+        });
+    return frame;
+}
+
+long long
+td_get_segment_feed_end(td_analyser *analyser)
+{
+    long long frame = -1;
+    guard(analyser, [&]() {
+            analyser->initialise();
+            frame = analyser->plugin.getSegmentFeedEnd();
+        });
+    return frame;
+}
+
+int
+td_save_state(td_analyser *analyser, const char *path)
+{
+    return guard(analyser, [&]() {
+            if (analyser->finished) {
+                throw logic_error("Analyser has already finished");
+            }
+            analyser->finishInput();
+            TuningState state = analyser->plugin.getState();
+            state.save(path);
+            analyser->finish(state);
+        });
+}
+
+int
+td_save_checkpoint(td_analyser *analyser, const char *path)
+{
+    return guard(analyser, [&]() {
+            if (analyser->finished) {
+                throw logic_error("Analyser has already finished");
+            }
+            analyser->initialise();
+            analyser->plugin.getCheckpoint().save(path);
+        });
+}
+
+int
+td_resume(td_analyser *analyser, const char *path)
+{
+    return guard(analyser, [&]() {
+            if (analyser->initialised) {
+                throw logic_error("Analyser must be resumed before the "
+                                  "first call to td_process()");
+            }
+            unique_ptr<TuningState> checkpoint(new TuningState);
+            checkpoint->load(path);
+            analyser->checkpoint = move(checkpoint);
+            // Resume now, so that a mismatched checkpoint is reported
+            // here rather than when the audio is first fed
+            try {
+                analyser->initialise();
+            } catch (...) {
+                analyser->checkpoint.reset();
+                throw;
+            }
+        });
+}
+
+int
+td_finish_from_states(td_analyser *analyser, const char *const *paths,
+                      int count)
+{
+    return guard(analyser, [&]() {
+            if (analyser->finished) {
+                throw logic_error("Analyser has already finished");
+            }
+            if (count < 1) {
+                throw invalid_argument("No states given");
+            }
+            TuningState state;
+            for (int i = 0; i < count; ++i) {
+                TuningState segment;
+                segment.load(paths[i]);
+                if (i == 0) state = segment;
+                else state.merge(segment);
+            }
+            analyser->initialise();
+            analyser->finish(state);
+        });
+}
+
+int
+td_get_result_count(const td_analyser *analyser)
+{
+    if (!analyser) return 0;
+    return int(analyser->cents.size());
+}
+
+float
+td_get_cents(const td_analyser *analyser, int result)
+{
+    if (result < 0 || result >= td_get_result_count(analyser)) return 0.f;
+    return analyser->cents[result];
+}
+
+float
+td_get_frequency(const td_analyser *analyser, int result)
+{
+    if (result < 0 || result >= td_get_result_count(analyser)) return 0.f;
+    return analyser->frequencies[result];
+}
+
+int
+td_get_stages(const td_analyser *analyser, int result)
+{
+    if (result < 0 || result >= td_get_result_count(analyser)) return 0;
+    return int(analyser->stages[result]);
+}
+
+int
+td_get_probes(const td_analyser *analyser, int result)
+{
+    if (result < 0 || result >= td_get_result_count(analyser)) return 0;
+    return int(analyser->probes[result]);
+}
+
+long long
+td_get_gated_frames(const td_analyser *analyser, int channel)
+{
+    if (!analyser || channel < 0 ||
+        channel >= int(analyser->gated.size())) return 0;
+    return (long long)(analyser->gated[channel]);
+}
+
+int
+td_get_profile_size(const td_analyser *analyser)
+{
+    if (!analyser) return 0;
+    for (const auto &o: analyser->plugin.getOutputDescriptors()) {
+        if (o.identifier == "reffeature") return int(o.binCount);
+    }
+    return 0;
+}
+
+int
+td_get_profile(const td_analyser *analyser, int channel, float *profile)
+{
+    return guard(analyser, [&]() {
+            if (!analyser->finished) {
+                throw logic_error("Analyser has not finished");
+            }
+            const vector<float> &values = analyser->profiles.at(channel);
+            copy(values.begin(), values.end(), profile);
+        });
+}
+
+int
+td_get_tuning_matrix(const td_analyser *analyser, float *cents,
+                     float *distances)
+{
+    return guard(analyser, [&]() {
+            if (!analyser->finished) {
+                throw logic_error("Analyser has not finished");
+            }
+            vector<TuningMatrix::Feature> profiles;
+            for (const auto &p: analyser->profiles) {
+                profiles.push_back(TuningMatrix::Feature(p.begin(), p.end()));
+            }
+            int n = int(profiles.size());
+            int bins = int(profiles[0].size());
+            int maxSemis = int(analyser->plugin.getParameter("maxrange"));
+            vector<vector<TuningMatrix::Entry>> matrix =
+                TuningMatrix(bins, maxSemis).compute(profiles);
+            for (int i = 0; i < n; ++i) {
+                for (int j = 0; j < n; ++j) {
+                    const TuningMatrix::Entry &e = matrix[i][j];
+                    if (cents) cents[i * n + j] = float(e.cents);
+                    if (distances) distances[i * n + j] = float(e.distance);
+                }
+            }
+        });
+}
+
+static const vector<float> &
+getFinishedProfile(const td_analyser *analyser, int channel)
+{
+    if (!analyser->finished) {
+        throw logic_error("Analyser has not finished");
+    }
+    if (channel < 0 || channel >= int(analyser->profiles.size())) {
+        throw invalid_argument("Channel out of range");
+    }
+    return analyser->profiles[channel];
+}
+
+int
+td_add_to_index(td_analyser *analyser, int channel,
+                const char *indexPath, unsigned long long id)
+{
+    return guard(analyser, [&]() {
+            const vector<float> &profile =
+                getFinishedProfile(analyser, channel);
+            ProfileIndex::append(indexPath, uint64_t(id),
+                                 ProfileIndex::Feature(profile.begin(),
+                                                       profile.end()));
+        });
+}
+
+int
+td_find_nearest(td_analyser *analyser, int channel,
+                const char *indexPath, int count,
+                unsigned long long *ids, float *cents,
+                float *distances)
+{
+    int found = -1;
+    guard(analyser, [&]() {
+            const vector<float> &profile =
+                getFinishedProfile(analyser, channel);
+            if (count < 0) {
+                throw invalid_argument("Negative result count");
+            }
+            
+            int bins = int(profile.size());
+            int maxSemis = int(analyser->plugin.getParameter("maxrange"));
+            int maxRotation = (bins * maxSemis) / 12;
+
+            ProfileIndex index(indexPath);
+            vector<ProfileIndex::Match> matches =
+                index.findNearest(ProfileIndex::Feature(profile.begin(),
+                                                        profile.end()),
+                                  maxRotation, count,
+                                  max(minShortList, count * shortListFactor));
+
+            // A rotation of the channel's profile up by one bin
+            // matches an indexed profile that is one bin higher
+            
+            for (int i = 0; i < int(matches.size()); ++i) {
+                if (ids) ids[i] = (unsigned long long)(matches[i].id);
+                if (cents) cents[i] = float(matches[i].rotation * 1200.0 / bins);
+                if (distances) distances[i] = float(matches[i].distance);
+            }
+            found = int(matches.size());
+        });
+    return found;
+}
+
+const char *
+td_get_error(const td_analyser *analyser)
+{
+    if (!analyser) return createError.c_str();
+    return analyser->error.c_str();
+}
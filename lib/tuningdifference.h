@@ -0,0 +1,241 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#ifndef TUNINGDIFFERENCE_LIBRARY_H
+#define TUNINGDIFFERENCE_LIBRARY_H
+
+/*
+  C interface to the tuning-difference analysis, for use in-process
+  without a Vamp host, from C, C++ or any language that can call C
+  (such as Python through ctypes).
+
+  An analyser is created for a sample rate and channel count, given
+  any parameters, fed the audio for each channel, and finished, after
+  which its results can be read. The channels, parameters, results
+  and ordering are as for the Vamp plugin: the first channels are the
+  references, and every other channel is compared against each of
+  them. See the plugin's parameter and output descriptions.
+
+  Functions returning int return zero on success and nonzero on
+  failure, in which case td_get_error() describes the failure. An
+  analyser must be used from one thread at a time, but separate
+  analysers may be used on separate threads at once.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Incremented only if the interface changes incompatibly. */
+#define TD_API_VERSION 1
+
+int td_get_api_version(void);
+
+typedef struct td_analyser td_analyser;
+
+/*
+  Create an analyser for audio at the given sample rate with the
+  given number of channels, of which there must be at least two.
+  Return NULL on failure.
+*/
+td_analyser *td_create(float sampleRate, int channels);
+
+void td_destroy(td_analyser *analyser);
+
+/*
+  Set a parameter by its plugin identifier, for example "maxrange",
+  "finetuning" or "references". Call before the first td_process().
+*/
+int td_set_parameter(td_analyser *analyser, const char *identifier,
+                     float value);
+
+/*
+  Feed the next frames of audio, given as one array of frames per
+  channel. Any number of frames may be given at a time.
+*/
+int td_process(td_analyser *analyser, const float *const *channels,
+               int frames);
+
+/*
+  Analyse the audio fed so far and calculate the results. Call once,
+  after the last td_process().
+*/
+int td_finish(td_analyser *analyser);
+
+/*
+  Analyse only the segment of the input from startFrame up to
+  endFrame, so that the segments of a long input can be analysed
+  separately, for example in parallel, and their states saved with
+  td_save_state() and combined with td_finish_from_states(). Call
+  after setting any parameters and before the first td_process().
+  Then feed the input from frame td_get_segment_feed_start() up to
+  td_get_segment_feed_end() or the end of the input, whichever is
+  sooner, rather than from the start. The segments of a partition
+  of the input give the same results as the input analysed whole, to
+  within rounding, if the last of them ends at the end of the input.
+*/
+int td_set_segment(td_analyser *analyser, long long startFrame,
+                   long long endFrame);
+
+/*
+  Return the range of input frames to feed, which is all of it
+  (from 0, and with no end) unless td_set_segment() was called. Call
+  after setting any parameters. Return -1 on failure.
+*/
+long long td_get_segment_feed_start(td_analyser *analyser);
+long long td_get_segment_feed_end(td_analyser *analyser);
+
+/*
+  Analyse the audio fed so far, save the state from which the
+  results are calculated to the given file, and calculate the
+  results. Call in place of td_finish().
+*/
+int td_save_state(td_analyser *analyser, const char *path);
+
+/*
+  Calculate the results from the given number of states saved by
+  td_save_state() for consecutive segments of the same input, in
+  order, in place of feeding any audio. Call in place of td_finish()
+  on an analyser with the sample rate, channel count and parameters
+  of those that saved them.
+*/
+int td_finish_from_states(td_analyser *analyser,
+                          const char *const *paths, int count);
+
+/*
+  Save a checkpoint of the analysis so far to the given file, from
+  which another analyser can resume with td_resume() should this one
+  not finish. May be called between any two td_process() calls, and
+  waits for the audio given so far to be analysed; the analysis then
+  carries on as before. Not available when sampling windows (the
+  "samplewindow" parameter).
+*/
+int td_save_checkpoint(td_analyser *analyser, const char *path);
+
+/*
+  Resume from a checkpoint saved by td_save_checkpoint() from an
+  analyser with the same sample rate, channel count and parameters
+  (and segment, if any). Call after setting any parameters and
+  segment, which can then no longer be changed, and before the first
+  td_process(). Then feed the input
+  from td_get_segment_feed_start() onwards. The results are those the
+  checkpointed analyser would have given, to within rounding.
+*/
+int td_resume(td_analyser *analyser, const char *path);
+
+/*
+  Return the number of results, one for each reference and other
+  channel: the results for every other channel against the first
+  reference, then against the second, and so on. Call after
+  td_finish().
+*/
+int td_get_result_count(const td_analyser *analyser);
+
+/*
+  Return the given result as the tuning difference in cents, or as
+  the tuning frequency of the other channel if the reference is at
+  A=440Hz.
+*/
+float td_get_cents(const td_analyser *analyser, int result);
+float td_get_frequency(const td_analyser *analyser, int result);
+
+/*
+  Return which stages of the analysis the given result was obtained
+  from, as the sum of TD_STAGE_ALL_INPUT if all of the input was
+  analysed and TD_STAGE_FINE_TUNING if the fine tuning stage was
+  completed. Stages are only left out when the "deadline", "stable"
+  or "samplewindow" parameter is set.
+*/
+#define TD_STAGE_ALL_INPUT 1
+#define TD_STAGE_FINE_TUNING 2
+
+int td_get_stages(const td_analyser *analyser, int result);
+
+/*
+  Return the number of fine-tuning offsets evaluated to obtain the
+  given result, or 0 if fine tuning is disabled.
+*/
+int td_get_probes(const td_analyser *analyser, int result);
+
+/*
+  Return the number of sample frames of the given channel whose
+  analysis was skipped by the silence gate (the "silencegate"
+  parameter).
+*/
+long long td_get_gated_frames(const td_analyser *analyser, int channel);
+
+/*
+  Return the number of bins in a chroma profile.
+*/
+int td_get_profile_size(const td_analyser *analyser);
+
+/*
+  Copy the averaged chroma profile of the given channel, as compared
+  by the analysis, into the given array of td_get_profile_size()
+  values. Call after td_finish().
+*/
+int td_get_profile(const td_analyser *analyser, int channel,
+                   float *profile);
+
+/*
+  Compare the chroma profile of every channel against every other,
+  for finding the tuning differences among recordings none of which
+  is a trusted reference. Fill cents, an array of channels x channels
+  values, so that element [i * channels + j] is the tuning difference
+  of channel j from channel i, within the "maxrange" parameter, and
+  distances likewise with the distance between their profiles at
+  that difference. Either may be NULL. The differences have the
+  resolution of the profile, as the fine tuning stage needs the audio
+  of each channel taken as reference. Call after td_finish().
+*/
+int td_get_tuning_matrix(const td_analyser *analyser, float *cents,
+                         float *distances);
+
+/*
+  Add the chroma profile of the given channel to the index of
+  profiles in the given file, creating the file if it does not exist,
+  under an identifier of the caller's choosing (such as a database
+  key for the recording). Call after td_finish(). Any number of
+  analysers and processes may add to the same index.
+*/
+int td_add_to_index(td_analyser *analyser, int channel,
+                    const char *indexPath, unsigned long long id);
+
+/*
+  Find the profiles in the given index closest to that of the given
+  channel, for example to find which of many indexed references a
+  recording is a performance of. Profiles are compared at every
+  tuning difference within the "maxrange" parameter. Copy up to count
+  of them, closest first and each identifier only once, into ids,
+  with the tuning difference of each indexed recording from the
+  channel, in cents to the resolution of the profile, in cents, and
+  the distance between the profiles (0 for identical profiles) in
+  distances. Either of those may be NULL. Call after td_finish().
+  Return the number found, or -1 on failure. A missing index has no
+  profiles in it.
+*/
+int td_find_nearest(td_analyser *analyser, int channel,
+                    const char *indexPath, int count,
+                    unsigned long long *ids, float *cents,
+                    float *distances);
+
+/*
+  Return a description of the last failure, or an empty string. A
+  NULL analyser gives the last failure of td_create() on this thread.
+*/
+const char *td_get_error(const td_analyser *analyser);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,306 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#include "AnalysisQueue.h"
+#include "TuningDifference.h"
+
+#include <atomic>
+#include <algorithm>
+
+using namespace std;
+
+struct AnalysisQueue::Task
+{
+    Task(JobId i, int p, Request r) :
+        id(i), priority(p), request(r),
+        centsOutput(-1), hzOutput(-1), stagesOutput(-1), probesOutput(-1),
+        gatedOutput(-1),
+        frame(0), feedEnd(INT64_MAX), lastCheckpoint(0),
+        cancelled(false) { }
+
+    JobId id;
+    int priority;
+    Request request;
+    promise<Result> result;
+
+    // The analysis so far, kept while the job waits to be resumed,
+    // and only touched by the thread running the job
+    unique_ptr<TuningDifference> plugin;
+    int centsOutput;
+    int hzOutput;
+    int stagesOutput;
+    int probesOutput;
+    int gatedOutput;
+    vector<vector<float>> blocks;
+    vector<const float *> buffers;
+    int64_t frame;
+    int64_t feedEnd;
+    int64_t lastCheckpoint;
+
+    atomic<bool> cancelled;
+
+    pair<int, JobId> key() const { return { -priority, id }; }
+};
+
+AnalysisQueue::AnalysisQueue(int concurrency) :
+    m_nextId(1),
+    m_idle(0),
+    m_stopping(false)
+{
+    for (int i = 0; i < max(1, concurrency); ++i) {
+        m_threads.push_back(thread([this]() { runThread(); }));
+    }
+}
+
+AnalysisQueue::~AnalysisQueue()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stopping = true;
+        for (auto &j: m_jobs) {
+            j.second->cancelled = true;
+        }
+        for (auto &w: m_waiting) {
+            w.second->result.set_exception(make_exception_ptr(Cancelled()));
+            m_jobs.erase(w.second->id);
+        }
+        m_waiting.clear();
+    }
+    m_wake.notify_all();
+    for (auto &t: m_threads) {
+        t.join();
+    }
+}
+
+AnalysisQueue::Job
+AnalysisQueue::submit(Request request, int priority)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    TaskPtr task = make_shared<Task>(m_nextId++, priority, request);
+    Job job;
+    job.id = task->id;
+    job.result = task->result.get_future();
+
+    if (m_stopping) {
+        task->result.set_exception(make_exception_ptr(Cancelled()));
+        return job;
+    }
+
+    m_jobs[task->id] = task;
+    m_waiting[task->key()] = task;
+    m_wake.notify_one();
+    return job;
+}
+
+bool
+AnalysisQueue::cancel(JobId id)
+{
+    lock_guard<mutex> lock(m_mutex);
+
+    auto i = m_jobs.find(id);
+    if (i == m_jobs.end()) return false;
+    TaskPtr task = i->second;
+    task->cancelled = true;
+
+    // A job that is running stops itself; one that is waiting is
+    // never run again, so it is finished here
+
+    if (m_waiting.erase(task->key()) > 0) {
+        task->result.set_exception(make_exception_ptr(Cancelled()));
+        task->plugin.reset();
+        m_jobs.erase(i);
+    }
+    return true;
+}
+
+void
+AnalysisQueue::runThread()
+{
+    unique_lock<mutex> lock(m_mutex);
+
+    while (true) {
+
+        while (!m_stopping && m_waiting.empty()) {
+            ++m_idle;
+            m_wake.wait(lock);
+            --m_idle;
+        }
+        if (m_stopping) return;
+
+        TaskPtr task = m_waiting.begin()->second;
+        m_waiting.erase(m_waiting.begin());
+
+        lock.unlock();
+        bool finished = runTask(*task);
+        lock.lock();
+
+        if (finished) {
+            task->plugin.reset();
+        } else if (task->cancelled) {
+            // cancelled as it stepped aside
+            task->result.set_exception(make_exception_ptr(Cancelled()));
+            task->plugin.reset();
+            m_jobs.erase(task->id);
+        } else {
+            m_waiting[task->key()] = task;
+        }
+    }
+}
+
+bool
+AnalysisQueue::shouldYield(const Task &task)
+{
+    lock_guard<mutex> lock(m_mutex);
+    return (m_idle == 0 &&
+            !m_waiting.empty() &&
+            m_waiting.begin()->second->priority > task.priority);
+}
+
+bool
+AnalysisQueue::runTask(Task &task)
+{
+    const Request &request = task.request;
+
+    try {
+
+        if (!task.plugin) {
+
+            if (!(request.sampleRate > 0.f) || request.channels < 2 ||
+                !request.source) {
+                throw invalid_argument("Job needs a sample rate, at least "
+                                       "two channels, and a source");
+            }
+
+            task.plugin.reset(new TuningDifference(request.sampleRate));
+            for (const auto &p: request.parameters) {
+                task.plugin->setParameter(p.first, p.second);
+            }
+            if (!task.plugin->initialise(request.channels,
+                                         blockSize, blockSize)) {
+                throw invalid_argument("Channel count must exceed the "
+                                       "number of references");
+            }
+
+            // Outputs are identified by index, as in any host
+
+            Vamp::Plugin::OutputList outputs =
+                task.plugin->getOutputDescriptors();
+            for (int i = 0; i < int(outputs.size()); ++i) {
+                if (outputs[i].identifier == "cents") task.centsOutput = i;
+                if (outputs[i].identifier == "tuningfreq") task.hzOutput = i;
+                if (outputs[i].identifier == "stages") task.stagesOutput = i;
+                if (outputs[i].identifier == "probes") task.probesOutput = i;
+                if (outputs[i].identifier == "gated") task.gatedOutput = i;
+            }
+
+            if (request.segmentEnd > request.segmentStart) {
+                task.plugin->setSegment(request.segmentStart,
+                                        request.segmentEnd);
+            }
+            if (request.resume) {
+                task.plugin->resume(*request.resume);
+            }
+            task.frame = task.plugin->getSegmentFeedStart();
+            task.feedEnd = task.plugin->getSegmentFeedEnd();
+            task.lastCheckpoint = task.frame;
+            if (request.seek) {
+                request.seek(task.frame, task.feedEnd);
+            }
+
+            task.blocks = vector<vector<float>>
+                (request.channels, vector<float>(blockSize, 0.f));
+            task.buffers = vector<const float *>(request.channels);
+        }
+
+        TuningDifference &plugin = *task.plugin;
+
+        // Time spent waiting to resume does not count against any
+        // deadline the job has
+        plugin.resumeClock();
+
+        while (true) {
+
+            if (task.cancelled) throw Cancelled();
+            if (shouldYield(task)) {
+                plugin.pauseClock();
+                return false;
+            }
+            if (!plugin.isAcceptingInput() || task.frame >= task.feedEnd) {
+                break;
+            }
+
+            int n = request.source(task.blocks);
+            if (n < 0 || n > blockSize ||
+                int(task.blocks.size()) != request.channels) {
+                throw runtime_error("Source returned an invalid block");
+            }
+            if (n == 0) break;
+
+            for (int c = 0; c < request.channels; ++c) {
+                task.blocks[c].resize(blockSize);
+                fill(task.blocks[c].begin() + n, task.blocks[c].end(), 0.f);
+                task.buffers[c] = task.blocks[c].data();
+            }
+            plugin.process(task.buffers.data(),
+                           Vamp::RealTime::frame2RealTime
+                           (task.frame, int(request.sampleRate)));
+            task.frame += blockSize;
+
+            if (request.checkpointInterval > 0 && request.checkpoint &&
+                task.frame - task.lastCheckpoint >=
+                request.checkpointInterval) {
+                request.checkpoint(plugin.getCheckpoint());
+                task.lastCheckpoint = task.frame;
+            }
+
+            if (n < blockSize) break;
+        }
+
+        if (task.cancelled) throw Cancelled();
+
+        Result result;
+        result.state = plugin.getState();
+        
+        Vamp::Plugin::FeatureSet fs = plugin.getFeaturesForState(result.state);
+        if (fs[task.centsOutput].empty() || fs[task.hzOutput].empty() ||
+            fs[task.stagesOutput].empty() || fs[task.probesOutput].empty() ||
+            fs[task.gatedOutput].empty()) {
+            throw runtime_error("Analysis returned no results");
+        }
+
+        result.cents = fs[task.centsOutput][0].values;
+        result.frequencies = fs[task.hzOutput][0].values;
+        result.stages = fs[task.stagesOutput][0].values;
+        result.probes = fs[task.probesOutput][0].values;
+        result.gatedFrames = fs[task.gatedOutput][0].values;
+
+        // Forget the job before making its future ready, so that
+        // cancel() never succeeds on a job whose results the caller
+        // may already have. One cancelled before this point fails
+        {
+            lock_guard<mutex> lock(m_mutex);
+            if (task.cancelled) throw Cancelled();
+            m_jobs.erase(task.id);
+        }
+        task.result.set_value(result);
+
+    } catch (...) {
+        {
+            lock_guard<mutex> lock(m_mutex);
+            m_jobs.erase(task.id);
+        }
+        task.result.set_exception(current_exception());
+    }
+
+    return true;
+}
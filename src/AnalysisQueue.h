@@ -0,0 +1,193 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#ifndef ANALYSIS_QUEUE_H
+#define ANALYSIS_QUEUE_H
+
+#include <vector>
+#include <map>
+#include <string>
+#include <functional>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdexcept>
+#include <memory>
+#include <cstdint>
+
+#include "TuningState.h"
+
+/**
+ * Runs tuning-difference analyses in the background, for callers
+ * that have many of them to do and should not tie up a thread on
+ * each. A job is submitted with a priority and returns a future for
+ * its results.
+ *
+ * A fixed number of jobs run at once, each on a thread of the
+ * queue's own, and the rest wait, highest priority first and then in
+ * order of submission. A running job checks between every block of
+ * audio whether it has been cancelled, and whether a job of higher
+ * priority is waiting with no thread to run it. If so it steps aside
+ * and waits to be resumed where it left off, so a short job of high
+ * priority does not wait for a long one of lower priority to finish.
+ * The results of a job do not depend on whether it was interrupted,
+ * and the time it spends waiting to resume does not count against
+ * any deadline set in its parameters.
+ *
+ * Each job analyses its channels on the process-wide task pool, as
+ * the plugin does, so the number of jobs running at once need only
+ * be large enough to keep the pool busy between blocks.
+ */
+class AnalysisQueue
+{
+public:
+    /**
+     * A function that fills the given buffers, one per channel and
+     * each of the block size, with the next block of audio, and
+     * returns the number of frames filled. Anything less than the
+     * block size ends the audio, the rest of the block being taken
+     * as silence. Called on the thread running the job, and not
+     * called again once the analysis needs no more input.
+     */
+    typedef std::function<int(std::vector<std::vector<float>> &)> Source;
+
+    /**
+     * A function told, before the source is first called, which
+     * input frames the source is to supply: from startFrame, and up
+     * to endFrame or the end of the audio if sooner. This is all of
+     * the audio unless the job analyses a segment of it. Called on
+     * the thread running the job.
+     */
+    typedef std::function<void(int64_t startFrame, int64_t endFrame)> Seek;
+
+    /**
+     * A function given a checkpoint of the job's analysis, from which
+     * another job can resume (see TuningDifference::getCheckpoint).
+     * Called on the thread running the job, which waits for it.
+     */
+    typedef std::function<void(const TuningState &)> Checkpoint;
+
+    struct Request {
+        Request() :
+            sampleRate(0.f), channels(0), segmentStart(0), segmentEnd(0),
+            checkpointInterval(0) { }
+        float sampleRate;
+        int channels;
+        /// Plugin parameters by identifier, as for the plugin
+        std::map<std::string, float> parameters;
+        /// If segmentEnd exceeds segmentStart, count only the input
+        /// frames between them (see TuningDifference::setSegment)
+        int64_t segmentStart;
+        int64_t segmentEnd;
+        /// If set, resume from this checkpoint of an earlier job with
+        /// the same channel count, parameters and segment
+        std::shared_ptr<const TuningState> resume;
+        /// If checkpointInterval is positive, call checkpoint every
+        /// checkpointInterval input frames
+        int64_t checkpointInterval;
+        Checkpoint checkpoint;
+        Source source;
+        /// Optional, see Seek
+        Seek seek;
+    };
+
+    /**
+     * The results of a job, in the order in which the plugin returns
+     * them: every other channel against the first reference, then
+     * against the second, and so on. The stages and probes are as
+     * for the plugin's stages and probes outputs, and the gated
+     * frames, one value per channel, as for its gated output. The state is that from
+     * which the results were calculated, to be saved or merged with
+     * the states of other segments.
+     */
+    struct Result {
+        std::vector<float> cents;
+        std::vector<float> frequencies;
+        std::vector<float> stages;
+        std::vector<float> probes;
+        std::vector<float> gatedFrames;
+        TuningState state;
+    };
+
+    /**
+     * The exception with which the future of a cancelled job fails.
+     */
+    class Cancelled : public std::runtime_error {
+    public:
+        Cancelled() : std::runtime_error("Analysis cancelled") { }
+    };
+
+    typedef uint64_t JobId;
+
+    struct Job {
+        JobId id;
+        std::future<Result> result;
+    };
+
+    static const int blockSize = 1024;
+
+    /**
+     * Construct a queue that runs the given number of jobs at once,
+     * at least one.
+     */
+    AnalysisQueue(int concurrency = 1);
+
+    /**
+     * Cancel every job not yet finished, and wait for those running
+     * to stop.
+     */
+    ~AnalysisQueue();
+
+    /**
+     * Queue a job with the given priority, higher numbers running
+     * first. If the request is invalid, the future fails with
+     * std::invalid_argument once the job is started.
+     */
+    Job submit(Request request, int priority = 0);
+
+    /**
+     * Cancel the given job. A waiting job is dropped at once, and a
+     * running one stops at its next block. Either way its future
+     * fails with Cancelled. Return false if the job has already
+     * finished or is unknown.
+     */
+    bool cancel(JobId id);
+
+    int getConcurrency() const { return int(m_threads.size()); }
+
+private:
+    struct Task;
+    typedef std::shared_ptr<Task> TaskPtr;
+
+    std::vector<std::thread> m_threads;
+
+    // Jobs waiting to start or resume, by priority (highest first)
+    // and then submission order, and every job not yet finished by
+    // id. All guarded by m_mutex.
+    std::map<std::pair<int, JobId>, TaskPtr> m_waiting;
+    std::map<JobId, TaskPtr> m_jobs;
+    JobId m_nextId;
+    int m_idle;
+    bool m_stopping;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+
+    void runThread();
+    bool runTask(Task &task);
+    bool shouldYield(const Task &task);
+
+    AnalysisQueue(const AnalysisQueue &) =delete;
+    AnalysisQueue &operator=(const AnalysisQueue &) =delete;
+};
+
+#endif
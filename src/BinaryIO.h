@@ -0,0 +1,78 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#ifndef BINARY_IO_H
+#define BINARY_IO_H
+
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+
+/**
+ * Helpers for reading and writing saved analysis state. Integers are
+ * stored little-endian whatever the host byte order, and doubles as
+ * their IEEE 754 bit patterns, so that files can be moved between
+ * machines. The readers throw std::runtime_error at end of input.
+ */
+namespace BinaryIO {
+
+inline void writeUInt64(std::ostream &out, uint64_t v)
+{
+    char bytes[8];
+    for (int i = 0; i < 8; ++i) {
+        bytes[i] = char((v >> (8 * i)) & 0xff);
+    }
+    out.write(bytes, 8);
+}
+
+inline uint64_t readUInt64(std::istream &in)
+{
+    unsigned char bytes[8];
+    if (!in.read(reinterpret_cast<char *>(bytes), 8)) {
+        throw std::runtime_error("Unexpected end of saved state");
+    }
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) {
+        v |= uint64_t(bytes[i]) << (8 * i);
+    }
+    return v;
+}
+
+inline void writeInt64(std::ostream &out, int64_t v)
+{
+    writeUInt64(out, uint64_t(v));
+}
+
+inline int64_t readInt64(std::istream &in)
+{
+    return int64_t(readUInt64(in));
+}
+
+inline void writeDouble(std::ostream &out, double d)
+{
+    uint64_t v;
+    memcpy(&v, &d, 8);
+    writeUInt64(out, v);
+}
+
+inline double readDouble(std::istream &in)
+{
+    uint64_t v = readUInt64(in);
+    double d;
+    memcpy(&d, &v, 8);
+    return d;
+}
+
+}
+
+#endif
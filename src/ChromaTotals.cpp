@@ -0,0 +1,125 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#include "ChromaTotals.h"
+#include "BinaryIO.h"
+
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+using namespace BinaryIO;
+
+ChromaTotals::ChromaTotals(int bins) :
+    m_sums(bins, 0.0),
+    m_compensations(bins, 0.0),
+    m_columns(0)
+{
+    if (bins < 1) {
+        throw invalid_argument("Invalid bin count");
+    }
+}
+
+void
+ChromaTotals::addCompensated(int bin, double value)
+{
+    // The low-order part lost in rounding the new sum is recovered
+    // from whichever operand is the larger in magnitude, and kept
+    // aside to be added back at the end
+
+    double sum = m_sums[bin];
+    double t = sum + value;
+    if (fabs(sum) >= fabs(value)) {
+        m_compensations[bin] += (sum - t) + value;
+    } else {
+        m_compensations[bin] += (value - t) + sum;
+    }
+    m_sums[bin] = t;
+}
+
+void
+ChromaTotals::add(const Column &column)
+{
+    int n = getBinCount();
+    if (int(column.size()) != n) {
+        throw invalid_argument("Column has wrong size");
+    }
+    for (int i = 0; i < n; ++i) {
+        addCompensated(i, column[i]);
+    }
+    ++m_columns;
+}
+
+void
+ChromaTotals::add(const vector<Column> &columns)
+{
+    for (const auto &c: columns) {
+        add(c);
+    }
+}
+
+void
+ChromaTotals::merge(const ChromaTotals &other)
+{
+    int n = getBinCount();
+    if (other.getBinCount() != n) {
+        throw invalid_argument("Totals have different bin counts");
+    }
+    for (int i = 0; i < n; ++i) {
+        addCompensated(i, other.m_sums[i]);
+        m_compensations[i] += other.m_compensations[i];
+    }
+    m_columns += other.m_columns;
+}
+
+vector<double>
+ChromaTotals::getTotals() const
+{
+    int n = getBinCount();
+    vector<double> totals(n);
+    for (int i = 0; i < n; ++i) {
+        totals[i] = m_sums[i] + m_compensations[i];
+    }
+    return totals;
+}
+
+void
+ChromaTotals::write(ostream &out) const
+{
+    writeUInt64(out, uint64_t(m_sums.size()));
+    writeUInt64(out, uint64_t(m_columns));
+    for (int i = 0; i < getBinCount(); ++i) {
+        writeDouble(out, m_sums[i]);
+        writeDouble(out, m_compensations[i]);
+    }
+    if (!out) {
+        throw runtime_error("Failed to write chroma totals");
+    }
+}
+
+void
+ChromaTotals::read(istream &in)
+{
+    uint64_t bins = readUInt64(in);
+    uint64_t columns = readUInt64(in);
+    if (bins < 1 || bins > 100000) {
+        throw runtime_error("Invalid bin count in chroma totals data");
+    }
+    vector<double> sums(bins), compensations(bins);
+    for (uint64_t i = 0; i < bins; ++i) {
+        sums[i] = readDouble(in);
+        compensations[i] = readDouble(in);
+    }
+    m_sums = sums;
+    m_compensations = compensations;
+    m_columns = long(columns);
+}
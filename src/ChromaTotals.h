@@ -0,0 +1,94 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#ifndef CHROMA_TOTALS_H
+#define CHROMA_TOTALS_H
+
+#include <vector>
+#include <iosfwd>
+
+/**
+ * Per-bin running totals of a series of chroma columns.
+ *
+ * Each bin is summed with compensation for rounding error (Neumaier's
+ * variant of Kahan summation), so the totals stay accurate to within
+ * a few units in the last place however many columns are added,
+ * rather than losing precision as the totals grow large relative to
+ * each column, as a naive sum would over a multi-hour input.
+ *
+ * The result depends only on the order in which columns are added
+ * and partial totals merged, never on which thread does it. Callers
+ * that split a series into parts and accumulate them in parallel
+ * should merge the parts in a fixed order (for example in time
+ * order) to get the same result every time.
+ *
+ * This must not be compiled with -ffast-math or equivalent, which
+ * would allow the compensation to be optimised away.
+ */
+class ChromaTotals
+{
+public:
+    typedef std::vector<double> Column;
+
+    ChromaTotals() : m_columns(0) { }
+    ChromaTotals(int bins);
+
+    int getBinCount() const { return int(m_sums.size()); }
+
+    /**
+     * Return the number of columns added so far, including those of
+     * any merged totals.
+     */
+    long getColumnCount() const { return m_columns; }
+
+    /**
+     * Add a column, which must have getBinCount() elements.
+     */
+    void add(const Column &column);
+
+    /**
+     * Add a series of columns, in order.
+     */
+    void add(const std::vector<Column> &columns);
+
+    /**
+     * Add the totals accumulated by another object, which must have
+     * the same bin count.
+     */
+    void merge(const ChromaTotals &other);
+
+    /**
+     * Return the totals for each bin.
+     */
+    std::vector<double> getTotals() const;
+
+    /**
+     * Write the complete state, including the compensation terms, in
+     * a portable binary form. Throw std::runtime_error on failure.
+     */
+    void write(std::ostream &out) const;
+
+    /**
+     * Read a state written by write(), replacing the current
+     * one. Throw std::runtime_error if it cannot be read.
+     */
+    void read(std::istream &in);
+
+private:
+    std::vector<double> m_sums;
+    std::vector<double> m_compensations;
+    long m_columns;
+
+    void addCompensated(int bin, double value);
+};
+
+#endif
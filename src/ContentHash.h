@@ -0,0 +1,74 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#ifndef CONTENT_HASH_H
+#define CONTENT_HASH_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/**
+ * A 64-bit FNV-1a hash, accumulated incrementally, of audio samples
+ * and of the analysis parameters they were analysed with. Samples are
+ * hashed by their IEEE 754 bit patterns in little-endian order, so the
+ * same audio hashes the same on any machine. This is for recognising
+ * content seen before, not for security: it is easily forged.
+ */
+class ContentHash
+{
+public:
+    ContentHash() : m_hash(14695981039346656037ull) { }
+
+    void add(const float *samples, int n) {
+        for (int i = 0; i < n; ++i) {
+            uint32_t bits;
+            memcpy(&bits, samples + i, 4);
+            addBytes(bits, 4);
+        }
+    }
+
+    void add(int64_t v) {
+        addBytes(uint64_t(v), 8);
+    }
+
+    void add(double v) {
+        uint64_t bits;
+        memcpy(&bits, &v, 8);
+        addBytes(bits, 8);
+    }
+
+    void add(const std::string &s) {
+        for (char c: s) {
+            addByte(uint8_t(c));
+        }
+        addByte(0);
+    }
+
+    uint64_t get() const { return m_hash; }
+
+private:
+    uint64_t m_hash;
+
+    void addByte(uint8_t b) {
+        m_hash ^= b;
+        m_hash *= 1099511628211ull;
+    }
+
+    void addBytes(uint64_t v, int n) {
+        for (int i = 0; i < n; ++i) {
+            addByte(uint8_t(v >> (8 * i)));
+        }
+    }
+};
+
+#endif
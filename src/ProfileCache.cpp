@@ -0,0 +1,232 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#include "ProfileCache.h"
+#include "BinaryIO.h"
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <stdexcept>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+
+using namespace std;
+using namespace BinaryIO;
+
+static const char *const channelMagic = "TDCHAN01";
+static const char *const offsetsMagic = "TDOFFS01";
+
+static void
+readMagic(istream &in, const char *magic, uint64_t key)
+{
+    char m[8];
+    if (!in.read(m, 8) || string(m, 8) != magic) {
+        throw runtime_error("Not a cache entry of the expected type");
+    }
+    if (readUInt64(in) != key) {
+        throw runtime_error("Cache entry has wrong key");
+    }
+}
+
+static uint64_t
+readCount(istream &in)
+{
+    uint64_t n = readUInt64(in);
+    if (n > 10000000) {
+        throw runtime_error("Invalid count in cache entry");
+    }
+    return n;
+}
+
+string
+ProfileCache::getDefaultDirectory()
+{
+    const char *dir = getenv("TUNING_DIFFERENCE_CACHE");
+    if (!dir) return "";
+    return dir;
+}
+
+ProfileCache::ProfileCache(string directory) :
+    m_directory(directory)
+{
+}
+
+string
+ProfileCache::getPath(uint64_t key, string suffix) const
+{
+    char name[40];
+    sprintf(name, "%016llx", (unsigned long long)key);
+    return m_directory + "/" + name + suffix;
+}
+
+string
+ProfileCache::getIndexFilename() const
+{
+    return m_directory + "/profiles.tdi";
+}
+
+void
+ProfileCache::store(string path, string contents) const
+{
+    // Write to a file of our own and rename it into place, so that
+    // other processes never see a partly written entry
+
+    ostringstream tmp;
+    tmp << path << "." << chrono::steady_clock::now().time_since_epoch().count()
+        << "." << hash<thread::id>()(this_thread::get_id()) << ".tmp";
+    string tmpPath = tmp.str();
+
+    {
+        ofstream out(tmpPath, ios::binary);
+        out.write(contents.data(), contents.size());
+        if (!out) {
+            cerr << "ProfileCache: Failed to write " << tmpPath << endl;
+            out.close();
+            remove(tmpPath.c_str());
+            return;
+        }
+    }
+
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+        // Renaming over an existing file fails on some platforms
+        remove(path.c_str());
+        if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+            cerr << "ProfileCache: Failed to store " << path << endl;
+            remove(tmpPath.c_str());
+        }
+    }
+}
+
+static ProfileCache::ChannelEntry
+readChannelEntry(istream &in)
+{
+    ProfileCache::ChannelEntry e;
+    uint64_t chunks = readCount(in);
+    for (uint64_t i = 0; i < chunks; ++i) {
+        e.chunkHashes.push_back(readUInt64(in));
+        e.chunkResumeFrames.push_back(readInt64(in));
+        ChromaTotals totals;
+        totals.read(in);
+        e.chunkTotals.push_back(totals);
+    }
+    e.blockCount = long(readInt64(in));
+    e.contentHash = readUInt64(in);
+    e.totals.read(in);
+    return e;
+}
+
+static void
+writeChannelEntry(ostream &out, const ProfileCache::ChannelEntry &entry)
+{
+    writeUInt64(out, entry.chunkHashes.size());
+    for (size_t i = 0; i < entry.chunkHashes.size(); ++i) {
+        writeUInt64(out, entry.chunkHashes[i]);
+        writeInt64(out, entry.chunkResumeFrames[i]);
+        entry.chunkTotals[i].write(out);
+    }
+    writeInt64(out, entry.blockCount);
+    writeUInt64(out, entry.contentHash);
+    entry.totals.write(out);
+}
+
+bool
+ProfileCache::loadChannels(uint64_t key, vector<ChannelEntry> &entries) const
+{
+    ifstream in(getPath(key, ".tdc"), ios::binary);
+    if (!in) return false;
+
+    try {
+        readMagic(in, channelMagic, key);
+        uint64_t count = readCount(in);
+        vector<ChannelEntry> e;
+        for (uint64_t i = 0; i < count; ++i) {
+            e.push_back(readChannelEntry(in));
+        }
+        entries = e;
+        return !entries.empty();
+    } catch (const runtime_error &e) {
+        cerr << "ProfileCache: Ignoring unreadable entry "
+             << getPath(key, ".tdc") << ": " << e.what() << endl;
+        return false;
+    }
+}
+
+void
+ProfileCache::storeChannel(uint64_t key, const ChannelEntry &entry) const
+{
+    // Another process may be filing an entry under the same key at
+    // the same time, in which case one of the two is lost. That costs
+    // no more than a later analysis of the input it was for
+
+    vector<ChannelEntry> entries;
+    loadChannels(key, entries);
+    entries.erase(remove_if(entries.begin(), entries.end(),
+                            [&](const ChannelEntry &e) {
+                                return e.blockCount == entry.blockCount &&
+                                    e.contentHash == entry.contentHash;
+                            }),
+                  entries.end());
+    entries.push_back(entry);
+    if (int(entries.size()) > maxChannelEntries) {
+        entries.erase(entries.begin(),
+                      entries.end() - maxChannelEntries);
+    }
+    
+    ostringstream out;
+    out.write(channelMagic, 8);
+    writeUInt64(out, key);
+    writeUInt64(out, entries.size());
+    for (const auto &e: entries) {
+        writeChannelEntry(out, e);
+    }
+    store(getPath(key, ".tdc"), out.str());
+}
+
+bool
+ProfileCache::loadOffsets(uint64_t key, vector<ChromaTotals> &totals) const
+{
+    ifstream in(getPath(key, ".tdo"), ios::binary);
+    if (!in) return false;
+
+    try {
+        readMagic(in, offsetsMagic, key);
+        vector<ChromaTotals> t(readCount(in));
+        for (auto &o: t) {
+            o.read(in);
+        }
+        totals = t;
+        return true;
+    } catch (const runtime_error &e) {
+        cerr << "ProfileCache: Ignoring unreadable entry "
+             << getPath(key, ".tdo") << ": " << e.what() << endl;
+        return false;
+    }
+}
+
+void
+ProfileCache::storeOffsets(uint64_t key,
+                           const vector<ChromaTotals> &totals) const
+{
+    ostringstream out;
+    out.write(offsetsMagic, 8);
+    writeUInt64(out, key);
+    writeUInt64(out, totals.size());
+    for (const auto &o: totals) {
+        o.write(out);
+    }
+    store(getPath(key, ".tdo"), out.str());
+}
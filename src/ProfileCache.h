@@ -0,0 +1,117 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#ifndef PROFILE_CACHE_H
+#define PROFILE_CACHE_H
+
+#include "ChromaTotals.h"
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+/**
+ * An on-disk cache of chroma totals, so that audio analysed once
+ * need not be analysed again. Entries are filed under a 64-bit key,
+ * which the caller derives from the audio content and the analysis
+ * parameters, in files in a single directory that may be shared
+ * between processes.
+ *
+ * A channel entry holds the totals for a channel's whole input, and
+ * also the totals at the end of each fixed-length chunk of it with
+ * the hash of that chunk. The caller can then look entries up as
+ * soon as it has seen the first chunk, skip analysing the chunks that
+ * go on to match one, and pick up the analysis from the end of the
+ * last one that did if the input stops matching. Different inputs
+ * can begin alike, so channel entries are filed by their first
+ * chunk, up to maxChannelEntries of them to a file, and told apart
+ * by the hash of their whole content.
+ *
+ * An offsets entry holds the totals of a whole input analysed at
+ * each of a range of tuning offsets.
+ *
+ * Failing to read an entry is treated as a miss, and failing to
+ * write one is reported to stderr but otherwise ignored, so that a
+ * missing, full or corrupted cache never causes an analysis to fail.
+ */
+class ProfileCache
+{
+public:
+    /**
+     * Return the directory named by the TUNING_DIFFERENCE_CACHE
+     * environment variable, or an empty string if it is not set, in
+     * which case no cache should be used.
+     */
+    static std::string getDefaultDirectory();
+
+    ProfileCache(std::string directory);
+
+    struct ChannelEntry {
+        ChannelEntry() : blockCount(0), contentHash(0) { }
+
+        // For each complete chunk: the hash of its content, and the
+        // totals of the columns centred before the resume frame (an
+        // input frame, counted from the start of the input) when the
+        // chunk had been analysed
+        std::vector<uint64_t> chunkHashes;
+        std::vector<ChromaTotals> chunkTotals;
+        std::vector<int64_t> chunkResumeFrames;
+
+        // For the whole input
+        long blockCount;
+        uint64_t contentHash;
+        ChromaTotals totals;
+    };
+
+    static const int maxChannelEntries = 8;
+
+    /**
+     * Load the channel entries filed under the given key into
+     * entries, returning false if there are none or they cannot be
+     * read.
+     */
+    bool loadChannels(uint64_t key, std::vector<ChannelEntry> &entries) const;
+
+    /**
+     * File a channel entry under the given key, replacing any with
+     * the same content and dropping the oldest if there are then
+     * more than maxChannelEntries.
+     */
+    void storeChannel(uint64_t key, const ChannelEntry &entry) const;
+
+    /**
+     * Load the offsets entry with the given key, returning false if
+     * there is none or it cannot be read.
+     */
+    bool loadOffsets(uint64_t key, std::vector<ChromaTotals> &totals) const;
+
+    /**
+     * Store an offsets entry under the given key, replacing any
+     * existing one.
+     */
+    void storeOffsets(uint64_t key,
+                      const std::vector<ChromaTotals> &totals) const;
+
+    /**
+     * Return the name of the file in the cache directory holding a
+     * ProfileIndex of the profiles stored there.
+     */
+    std::string getIndexFilename() const;
+
+private:
+    std::string m_directory;
+
+    std::string getPath(uint64_t key, std::string suffix) const;
+    void store(std::string path, std::string contents) const;
+};
+
+#endif
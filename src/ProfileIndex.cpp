@@ -0,0 +1,395 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#include "ProfileIndex.h"
+#include "RotationSearch.h"
+#include "BinaryIO.h"
+
+#include <sstream>
+#include <stdexcept>
+#include <algorithm>
+#include <set>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace BinaryIO;
+
+// Each record is the magic, then the bin count and signature length
+// as 32-bit integers, the identifier, the signature as 32-bit floats
+// and the profile as doubles, all little-endian
+static const char *const magic = "TDPROF01";
+static const int headerSize = 24;
+
+// Enough coefficients for the semitone comb of a 120-bin profile
+// (coefficient 10) and its second harmonic, as well as the broad
+// shape of the pitch-class distribution below it
+static const int signatureLength = 24;
+
+static uint64_t
+decodeUInt64(const char *p)
+{
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(p);
+    uint64_t v = 0;
+    for (int i = 0; i < 8; ++i) {
+        v |= uint64_t(bytes[i]) << (8 * i);
+    }
+    return v;
+}
+
+static uint32_t
+decodeUInt32(const char *p)
+{
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(p);
+    uint32_t v = 0;
+    for (int i = 0; i < 4; ++i) {
+        v |= uint32_t(bytes[i]) << (8 * i);
+    }
+    return v;
+}
+
+static void
+writeUInt32(ostream &out, uint32_t v)
+{
+    char bytes[4];
+    for (int i = 0; i < 4; ++i) {
+        bytes[i] = char((v >> (8 * i)) & 0xff);
+    }
+    out.write(bytes, 4);
+}
+
+// No more bins than any profile could plausibly have, so as not to
+// take a corrupt bin count for the record size
+static const int maxBins = 100000;
+
+static size_t
+recordSize(int bins)
+{
+    return headerSize + signatureLength * 4 + size_t(bins) * 8;
+}
+
+static const char *
+findMagic(const char *from, const char *end)
+{
+    while (end - from >= 8) {
+        const char *p = static_cast<const char *>
+            (memchr(from, magic[0], size_t(end - from) - 7));
+        if (!p) return 0;
+        if (memcmp(p, magic, 8) == 0) return p;
+        from = p + 1;
+    }
+    return 0;
+}
+
+vector<float>
+ProfileIndex::getSignature(const Feature &profile)
+{
+    const int n = int(profile.size());
+    const int count = min(signatureLength, n / 2);
+    vector<float> signature(signatureLength, 0.f);
+
+    for (int k = 1; k <= count; ++k) {
+        double re = 0.0, im = 0.0;
+        for (int i = 0; i < n; ++i) {
+            double phase = 2.0 * M_PI * double(k) * i / n;
+            re += profile[i] * cos(phase);
+            im -= profile[i] * sin(phase);
+        }
+        signature[k-1] = float(sqrt(re * re + im * im));
+    }
+
+    return signature;
+}
+
+void
+ProfileIndex::append(string filename, uint64_t id, const Feature &profile)
+{
+    if (profile.empty()) {
+        throw invalid_argument("Cannot index an empty profile");
+    }
+
+    ostringstream out;
+    out.write(magic, 8);
+    writeUInt32(out, uint32_t(profile.size()));
+    writeUInt32(out, uint32_t(signatureLength));
+    writeUInt64(out, id);
+    for (float f: getSignature(profile)) {
+        uint32_t bits;
+        memcpy(&bits, &f, 4);
+        writeUInt32(out, bits);
+    }
+    for (double d: profile) {
+        writeDouble(out, d);
+    }
+
+    // A single write in append mode, so that records appended by
+    // different processes are not interleaved
+
+    string record = out.str();
+    FILE *f = fopen(filename.c_str(), "ab");
+    if (!f) {
+        throw runtime_error("Failed to open " + filename + " for appending");
+    }
+    size_t written = fwrite(record.data(), 1, record.size(), f);
+    if (fclose(f) != 0 || written != record.size()) {
+        throw runtime_error("Failed to append to " + filename);
+    }
+}
+
+ProfileIndex::ProfileIndex(string filename) :
+    m_filename(filename),
+    m_data(0),
+    m_size(0),
+#ifdef _WIN32
+    m_file(0),
+    m_mapping(0),
+#endif
+    m_bins(0)
+{
+    map();
+
+    // All records have the size implied by the bin count of the
+    // first readable one. A record is readable if it has the magic,
+    // that bin count and the signature length, and no other record's
+    // magic appears within it, as it would if the record had been
+    // cut short by a failed append. After anything unreadable we
+    // carry on from the next magic
+
+    const char *end = m_data + m_size;
+    const char *record = findMagic(m_data, end);
+    size_t size = 0;
+
+    while (record && record + headerSize <= end) {
+
+        int bins = int(decodeUInt32(record + 8));
+        int length = int(decodeUInt32(record + 12));
+        
+        if (m_bins == 0 && length == signatureLength &&
+            bins > 0 && bins <= maxBins) {
+            m_bins = bins;
+            size = recordSize(m_bins);
+        }
+
+        const char *next = findMagic(record + 1, end);
+        
+        if (m_bins > 0 && bins == m_bins && length == signatureLength &&
+            size_t(end - record) >= size &&
+            (!next || next >= record + size)) {
+            m_records.push_back(record);
+        }
+
+        record = next;
+    }
+}
+
+ProfileIndex::~ProfileIndex()
+{
+    unmap();
+}
+
+#ifdef _WIN32
+
+void
+ProfileIndex::map()
+{
+    HANDLE file = CreateFileA(m_filename.c_str(), GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE |
+                              FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        if (GetLastError() == ERROR_FILE_NOT_FOUND) return;
+        throw runtime_error("Failed to open " + m_filename);
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        throw runtime_error("Failed to query size of " + m_filename);
+    }
+    m_file = file;
+    if (size.QuadPart == 0) return;
+    m_mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!m_mapping) {
+        unmap();
+        throw runtime_error("Failed to map " + m_filename);
+    }
+    m_data = static_cast<const char *>
+        (MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!m_data) {
+        unmap();
+        throw runtime_error("Failed to map " + m_filename);
+    }
+    m_size = size_t(size.QuadPart);
+}
+
+void
+ProfileIndex::unmap()
+{
+    if (m_data) UnmapViewOfFile(m_data);
+    if (m_mapping) CloseHandle(m_mapping);
+    if (m_file) CloseHandle(m_file);
+    m_data = 0;
+    m_mapping = 0;
+    m_file = 0;
+    m_size = 0;
+}
+
+#else
+
+void
+ProfileIndex::map()
+{
+    int fd = open(m_filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        if (errno == ENOENT) return;
+        throw runtime_error("Failed to open " + m_filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw runtime_error("Failed to query size of " + m_filename);
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return;
+    }
+    void *data = mmap(0, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw runtime_error("Failed to map " + m_filename);
+    }
+    m_data = static_cast<const char *>(data);
+    m_size = size_t(st.st_size);
+}
+
+void
+ProfileIndex::unmap()
+{
+    if (m_data) munmap(const_cast<char *>(m_data), m_size);
+    m_data = 0;
+    m_size = 0;
+}
+
+#endif
+
+uint64_t
+ProfileIndex::getId(int record) const
+{
+    return decodeUInt64(m_records.at(record) + 16);
+}
+
+ProfileIndex::Feature
+ProfileIndex::getProfile(int record) const
+{
+    return decodeProfile(m_records.at(record));
+}
+
+ProfileIndex::Feature
+ProfileIndex::decodeProfile(const char *record) const
+{
+    const char *p = record + headerSize + signatureLength * 4;
+    Feature profile(m_bins);
+    for (int i = 0; i < m_bins; ++i) {
+        uint64_t bits = decodeUInt64(p + i * 8);
+        memcpy(&profile[i], &bits, 8);
+    }
+    return profile;
+}
+
+vector<ProfileIndex::Match>
+ProfileIndex::findNearest(const Feature &profile,
+                          int maxRotation,
+                          int resultCount,
+                          int shortListSize) const
+{
+    vector<Match> matches;
+    if (m_records.empty() || resultCount < 1 || shortListSize < 1) {
+        return matches;
+    }
+    if (int(profile.size()) != m_bins) {
+        throw invalid_argument("Profile has wrong number of bins for index");
+    }
+
+    // Rank every record by the distance between signatures, then
+    // search the short list at every rotation
+
+    vector<float> query = getSignature(profile);
+    vector<pair<float, int>> ranked(m_records.size());
+
+    for (int r = 0; r < int(m_records.size()); ++r) {
+        const char *p = m_records[r] + headerSize;
+        float sum = 0.f;
+        for (int k = 0; k < signatureLength; ++k) {
+            uint32_t bits = decodeUInt32(p + k * 4);
+            float f;
+            memcpy(&f, &bits, 4);
+            float d = f - query[k];
+            sum += d * d;
+        }
+        ranked[r] = { sum, r };
+    }
+
+    int listed = min(shortListSize, int(ranked.size()));
+    partial_sort(ranked.begin(), ranked.begin() + listed, ranked.end());
+
+    vector<Feature> candidates;
+    for (int i = 0; i < listed; ++i) {
+        candidates.push_back(decodeProfile(m_records[ranked[i].second]));
+    }
+
+    // RotationSearch rotates the candidates against a fixed
+    // reference; here the query is the one to be rotated, which is
+    // the same as rotating each stored profile the other way
+
+    RotationSearch search(m_bins, min(maxRotation, m_bins / 2));
+    vector<RotationSearch::Result> results = search.search(profile, candidates);
+
+    for (int i = 0; i < listed; ++i) {
+        int best = results[i].rotation + search.getMaxRotation();
+        Match m;
+        m.id = getId(ranked[i].second);
+        m.rotation = -results[i].rotation;
+        m.distance = results[i].distances[best];
+        matches.push_back(m);
+    }
+
+    stable_sort(matches.begin(), matches.end(),
+                [](const Match &a, const Match &b) {
+                    return a.distance < b.distance;
+                });
+
+    vector<Match> distinct;
+    set<uint64_t> seen;
+    for (const auto &m: matches) {
+        if (int(distinct.size()) == resultCount) break;
+        if (seen.insert(m.id).second) {
+            distinct.push_back(m);
+        }
+    }
+
+    return distinct;
+}
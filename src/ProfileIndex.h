@@ -0,0 +1,130 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#ifndef PROFILE_INDEX_H
+#define PROFILE_INDEX_H
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+/**
+ * An on-disk index of chroma profiles (normalised chroma features,
+ * as compared by the tuning-difference search), for finding which of
+ * many stored reference recordings a new recording is a performance
+ * of, or for comparing stored recordings with one another (see
+ * TuningMatrix).
+ *
+ * Each profile is stored with a signature that does not change when
+ * the profile is rotated: the magnitudes of the low-order
+ * coefficients of its discrete Fourier transform. By Parseval's
+ * theorem the Euclidean distance between two signatures is bounded
+ * by a fixed multiple of that between the profiles at whichever
+ * relative rotation brings them closest, so comparing signatures,
+ * which is cheap, picks out a short list of candidates that can then
+ * be searched properly with RotationSearch.
+ *
+ * The index is a single file of fixed-size records, memory-mapped
+ * for searching. Profiles are added by appending one record at a
+ * time, so several processes can add to the same index, and an
+ * index opened for searching sees the records present when it was
+ * opened. Records that cannot be read, such as one only partly
+ * written, are skipped, and reading carries on from the start of the
+ * next record after them.
+ */
+class ProfileIndex
+{
+public:
+    typedef std::vector<double> Feature;
+
+    /**
+     * Open the index in the given file for searching. A file that
+     * does not exist is treated as an empty index. Throw
+     * std::runtime_error if it exists but cannot be mapped.
+     */
+    ProfileIndex(std::string filename);
+    ~ProfileIndex();
+
+    ProfileIndex(const ProfileIndex &) = delete;
+    ProfileIndex &operator=(const ProfileIndex &) = delete;
+
+    /**
+     * Append a profile to the index in the given file, creating the
+     * file if necessary, under an identifier of the caller's
+     * choosing. Throw std::runtime_error on failure.
+     */
+    static void append(std::string filename, uint64_t id,
+                       const Feature &profile);
+
+    /**
+     * Return the number of readable records in the index. The same
+     * identifier may appear in more than one of them.
+     */
+    int getProfileCount() const { return int(m_records.size()); }
+
+    /**
+     * Return the identifier and profile of the given record, counting
+     * from zero in the order the records were appended.
+     */
+    uint64_t getId(int record) const;
+    Feature getProfile(int record) const;
+
+    struct Match {
+        uint64_t id;
+
+        /**
+         * Rotation of the query giving the smallest distance to the
+         * stored profile, as returned by RotationSearch.
+         */
+        int rotation;
+
+        /**
+         * L1 distance between the rotated query and the stored
+         * profile.
+         */
+        double distance;
+    };
+
+    /**
+     * Find the stored profiles closest to the given one, which must
+     * have the same number of bins. The shortListSize profiles with
+     * the closest signatures are searched at every rotation up to
+     * maxRotation, and up to resultCount distinct identifiers are
+     * returned, closest first.
+     */
+    std::vector<Match> findNearest(const Feature &profile,
+                                   int maxRotation,
+                                   int resultCount,
+                                   int shortListSize) const;
+
+    /**
+     * Return the rotation-invariant signature of a profile.
+     */
+    static std::vector<float> getSignature(const Feature &profile);
+
+private:
+    std::string m_filename;
+    const char *m_data;
+    size_t m_size;
+#ifdef _WIN32
+    void *m_file;
+    void *m_mapping;
+#endif
+    int m_bins;
+    std::vector<const char *> m_records;
+
+    void map();
+    void unmap();
+    Feature decodeProfile(const char *record) const;
+};
+
+#endif
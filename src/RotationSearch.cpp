@@ -0,0 +1,136 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#include "RotationSearch.h"
+
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+#if defined(_MSC_VER)
+#define R__ __restrict
+#elif defined(__GNUC__)
+#define R__ __restrict__
+#else
+#define R__
+#endif
+
+RotationSearch::RotationSearch(int binsPerOctave, int maxRotation) :
+    m_bpo(binsPerOctave),
+    m_maxRotation(maxRotation)
+{
+    if (m_bpo < 1 || m_maxRotation < 0) {
+        throw invalid_argument("Invalid bins-per-octave or rotation range");
+    }
+}
+
+RotationSearch::Result
+RotationSearch::search(const Feature &reference,
+                       const Feature &candidate) const
+{
+    return search(reference, vector<Feature>(1, candidate))[0];
+}
+
+vector<RotationSearch::Result>
+RotationSearch::search(const Feature &reference,
+                       const vector<Feature> &candidates) const
+{
+    if (int(reference.size()) != m_bpo) {
+        throw invalid_argument("Reference feature has wrong size");
+    }
+    return search(reference, prepare(candidates));
+}
+
+RotationSearch::Candidates
+RotationSearch::prepare(const vector<Feature> &candidates) const
+{
+    const int n = m_bpo;
+    const int m = m_maxRotation;
+    const int width = n + 2 * m;
+    const int count = int(candidates.size());
+
+    // Lay the candidates out as rows of a matrix, each row being its
+    // candidate extended periodically (and reversed) so that every
+    // rotation is a contiguous window into it. For rotation r = k - m
+    // the candidate value compared against reference bin i is
+    // candidate[(i - r) mod n], which is found at row[n - 1 - i + k].
+
+    Candidates prepared;
+    prepared.m_count = count;
+    prepared.m_matrix.resize(size_t(count) * width);
+
+    for (int c = 0; c < count; ++c) {
+        const Feature &f = candidates[c];
+        if (int(f.size()) != n) {
+            throw invalid_argument("Candidate feature has wrong size");
+        }
+        double *row = prepared.m_matrix.data() + size_t(c) * width;
+        for (int t = 0; t < width; ++t) {
+            int j = (n + m - 1 - t) % n;
+            if (j < 0) j += n;
+            row[t] = f[j];
+        }
+    }
+
+    return prepared;
+}
+
+vector<RotationSearch::Result>
+RotationSearch::search(const Feature &reference,
+                       const Candidates &candidates) const
+{
+    const int n = m_bpo;
+    const int m = m_maxRotation;
+    const int nrot = 2 * m + 1;
+    const int width = n + 2 * m;
+    const int count = candidates.m_count;
+
+    if (int(reference.size()) != n) {
+        throw invalid_argument("Reference feature has wrong size");
+    }
+    if (candidates.m_matrix.size() != size_t(count) * width) {
+        throw invalid_argument("Candidates prepared for a different search");
+    }
+
+    // Accumulate over reference bins in the outer loop and rotations
+    // in the inner one. Each rotation has its own accumulator, so the
+    // inner loop vectorises without reordering any individual sum.
+
+    vector<Result> results(count);
+
+    for (int c = 0; c < count; ++c) {
+
+        vector<double> acc(nrot, 0.0);
+        double *const R__ a = acc.data();
+        const double *const R__ row =
+            candidates.m_matrix.data() + size_t(c) * width;
+
+        for (int i = 0; i < n; ++i) {
+            const double ri = reference[i];
+            const double *const R__ q = row + (n - 1 - i);
+            for (int k = 0; k < nrot; ++k) {
+                a[k] += fabs(ri - q[k]);
+            }
+        }
+
+        int best = 0;
+        for (int k = 1; k < nrot; ++k) {
+            if (acc[k] <= acc[best]) best = k;
+        }
+
+        results[c].rotation = best - m;
+        results[c].distances = acc;
+    }
+
+    return results;
+}
@@ -0,0 +1,104 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#ifndef ROTATION_SEARCH_H
+#define ROTATION_SEARCH_H
+
+#include <vector>
+
+/**
+ * Find the rotation of each of a set of candidate chroma features
+ * that best matches (has the smallest L1 distance to) a reference
+ * chroma feature.
+ *
+ * A rotation r of a candidate is the feature with element i taken
+ * from element (i - r) of the original, wrapping around at the ends,
+ * so a positive rotation pushes the tuning frequency of the candidate
+ * up. All rotations in the range -maxRotation to maxRotation are
+ * evaluated, for all candidates at once, without making a rotated
+ * copy of any candidate.
+ *
+ * The distances are accumulated in the same order as a simple
+ * rotate-then-compare would use, so they are identical to those
+ * obtained that way.
+ */
+class RotationSearch
+{
+public:
+    typedef std::vector<double> Feature;
+
+    struct Result {
+        /**
+         * Rotation giving the smallest distance. If several
+         * rotations share the smallest distance, the highest of them
+         * is returned.
+         */
+        int rotation;
+
+        /**
+         * Distance between reference and rotated candidate for each
+         * rotation, indexed by rotation + maxRotation.
+         */
+        std::vector<double> distances;
+    };
+
+    RotationSearch(int binsPerOctave, int maxRotation);
+
+    int getBinsPerOctave() const { return m_bpo; }
+    int getMaxRotation() const { return m_maxRotation; }
+
+    /**
+     * Evaluate all rotations of all the given candidates against the
+     * reference. All features must have getBinsPerOctave() elements.
+     * Returns one result per candidate, in the same order.
+     */
+    std::vector<Result> search(const Feature &reference,
+                               const std::vector<Feature> &candidates) const;
+
+    /**
+     * Evaluate all rotations of a single candidate.
+     */
+    Result search(const Feature &reference, const Feature &candidate) const;
+
+    /**
+     * A set of candidates laid out for searching, for use when the
+     * same candidates are to be compared against several references.
+     */
+    class Candidates
+    {
+    public:
+        int getCount() const { return m_count; }
+    private:
+        friend class RotationSearch;
+        int m_count;
+        std::vector<double> m_matrix;
+    };
+
+    /**
+     * Lay out a set of candidates for searching. All features must
+     * have getBinsPerOctave() elements.
+     */
+    Candidates prepare(const std::vector<Feature> &candidates) const;
+
+    /**
+     * Evaluate all rotations of all the prepared candidates against
+     * the reference, with the same results as the search() above.
+     */
+    std::vector<Result> search(const Feature &reference,
+                               const Candidates &candidates) const;
+
+private:
+    int m_bpo;
+    int m_maxRotation;
+};
+
+#endif
@@ -0,0 +1,96 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <vector>
+#include <atomic>
+#include <utility>
+
+/**
+ * Bounded lock-free queue for one producer thread and one consumer
+ * thread.
+ *
+ * Elements are exchanged with the slots rather than copied in and
+ * out, so a caller that reuses the same element objects (for example
+ * vectors of a fixed size) does not cause any allocation once the
+ * queue has been round once.
+ *
+ * Neither push nor pop ever blocks; waiting for space or data, if
+ * required, is up to the caller.
+ */
+template <typename T>
+class SPSCQueue
+{
+public:
+    SPSCQueue(int capacity) :
+        m_slots(capacity + 1),
+        m_head(0),
+        m_tail(0)
+    { }
+
+    /**
+     * Exchange the given element with the next free slot, making it
+     * available to the consumer. Return false, leaving the element
+     * untouched, if the queue is full. Producer thread only.
+     */
+    bool push(T &element) {
+        int tail = m_tail.load(std::memory_order_relaxed);
+        int next = advance(tail);
+        if (next == m_head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        std::swap(m_slots[tail], element);
+        m_tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Exchange the given element with the oldest element in the
+     * queue, removing it from the queue. Return false, leaving the
+     * element untouched, if the queue is empty. Consumer thread only.
+     */
+    bool pop(T &element) {
+        int head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        std::swap(m_slots[head], element);
+        m_head.store(advance(head), std::memory_order_release);
+        return true;
+    }
+
+    bool isEmpty() const {
+        return m_head.load(std::memory_order_acquire) ==
+            m_tail.load(std::memory_order_acquire);
+    }
+
+    bool isFull() const {
+        return advance(m_tail.load(std::memory_order_acquire)) ==
+            m_head.load(std::memory_order_acquire);
+    }
+
+private:
+    std::vector<T> m_slots;
+    std::atomic<int> m_head; // next slot to read
+    std::atomic<int> m_tail; // next slot to write
+
+    int advance(int index) const {
+        return (index + 1 == int(m_slots.size())) ? 0 : index + 1;
+    }
+
+    SPSCQueue(const SPSCQueue &) =delete;
+    SPSCQueue &operator=(const SPSCQueue &) =delete;
+};
+
+#endif
@@ -11,6 +11,9 @@
 */
 
 #include "TuningDifference.h"
+#include "ProfileIndex.h"
+
+#include <src/dsp/Resampler.h>
 
 #include <iostream>
 
@@ -20,6 +23,7 @@
 
 #include <algorithm>
 #include <numeric>
+#include <atomic>
 
 using namespace std;
 
@@ -37,8 +41,36 @@ static double frequencyForCentsAbove440(double cents)
 }
 
 static float defaultMaxDuration = 0.f;
+static float defaultDeadline = 0.f;
+static float defaultStableDuration = 0.f;
+static float defaultSampleWindow = 0.f;
+static float defaultSampleSpacing = 60.f;
+static float defaultSilenceGate = 0.f;
 static int defaultMaxSemis = 5;
 static bool defaultFineTuning = true;
+static bool defaultBackground = false;
+static bool defaultParallelOctaves = false;
+static int defaultReferenceCount = 1;
+static int queuedBlocksPerChannel = 32;
+// With a deadline we keep less input queued, so that little is left
+// to analyse once the input is stopped
+static int queuedBlocksForDeadline = 4;
+static double cacheChunkDuration = 30.0;
+
+// Proportion of a deadline that we plan to use, leaving the rest for
+// the host and for anything we estimate wrongly
+static double deadlineMargin = 0.9;
+
+// With a stable duration, how often (in seconds of input) we look at
+// the estimate so far, and how far short of the best rotation every
+// other rotation more than a bin away from it must fall, relative to
+// its own distance, for the estimate to count as settled
+static double stableCheckInterval = 5.0;
+static double stableMargin = 0.05;
+
+// Once the silence gate has closed on a channel, the level must rise
+// this far above the threshold (in dB) to open it again
+static double gateHysteresis = 6.0;
 
 TuningDifference::TuningDifference(float inputSampleRate) :
     Plugin(inputSampleRate),
@@ -48,12 +80,42 @@ TuningDifference::TuningDifference(float inputSampleRate) :
     m_frameCount(0),
     m_maxDuration(defaultMaxDuration),
     m_maxSemis(defaultMaxSemis),
-    m_fineTuning(defaultFineTuning)
+    m_fineTuning(defaultFineTuning),
+    m_background(defaultBackground),
+    m_parallelOctaves(defaultParallelOctaves),
+    m_referenceCount(defaultReferenceCount),
+    m_deadline(defaultDeadline),
+    m_stableDuration(defaultStableDuration),
+    m_sampleWindow(defaultSampleWindow),
+    m_sampleSpacing(defaultSampleSpacing),
+    m_silenceGate(defaultSilenceGate),
+    m_clockPaused(false),
+    m_inputTruncated(false),
+    m_stableSince(0),
+    m_windowIndex(0),
+    m_windowFeedStart(0),
+    m_windowFeedEnd(0),
+    m_windowFed(0),
+    m_windowFill(0),
+    m_gateCloseLevel(0.0),
+    m_gateOpenLevel(0.0),
+    m_gateCapacity(0),
+    m_segmented(false),
+    m_segmentStart(INT64_MIN),
+    m_segmentEnd(INT64_MAX),
+    m_referenceFrom(INT64_MIN),
+    m_feedStart(0),
+    m_cacheChunkBlocks(0),
+    m_referenceStart(0),
+    m_referenceRate(0),
+    m_scheduler(0),
+    m_drainGroup(&m_client)
 {
 }
 
 TuningDifference::~TuningDifference()
 {
+    finishBackground();
 }
 
 string
@@ -85,7 +147,7 @@ TuningDifference::getPluginVersion() const
 {
     // Increment this each time you release a version that behaves
     // differently from the previous one
-    return 3;
+    return 4;
 }
 
 string
@@ -144,6 +206,56 @@ TuningDifference::getParameterDescriptors() const
     desc.isQuantized = false;
     desc.unit = "s";
     list.push_back(desc);
+
+    desc.identifier = "deadline";
+    desc.name = "Deadline";
+    desc.description = "The time (in seconds) within which to return results, counted from when the plugin receives its first input. Input is analysed only for as long as leaves time to finish, and the fine tuning stage is skipped or cut short if there is no time for it. The stages output says which stages were completed. Zero means there is no deadline.";
+    desc.minValue = 0;
+    desc.maxValue = 3600;
+    desc.defaultValue = defaultDeadline;
+    desc.isQuantized = false;
+    desc.unit = "s";
+    list.push_back(desc);
+
+    desc.identifier = "stable";
+    desc.name = "Stop once stable for";
+    desc.description = "Stop analysing the input once the estimate has stayed the same, and clearly better than the alternatives, for this duration (in seconds) of input. The stages output then says that not all of the input was analysed. Zero means the whole input is always analysed.";
+    desc.minValue = 0;
+    desc.maxValue = 3600;
+    desc.defaultValue = defaultStableDuration;
+    desc.isQuantized = false;
+    desc.unit = "s";
+    list.push_back(desc);
+
+    desc.identifier = "samplewindow";
+    desc.name = "Sample window duration";
+    desc.description = "Analyse only a window of this duration (in seconds) from each stretch of input of the sample window spacing, centred within it, and skip the input in between. Zero means the input is analysed continuously.";
+    desc.minValue = 0;
+    desc.maxValue = 600;
+    desc.defaultValue = defaultSampleWindow;
+    desc.isQuantized = false;
+    desc.unit = "s";
+    list.push_back(desc);
+
+    desc.identifier = "samplespacing";
+    desc.name = "Sample window spacing";
+    desc.description = "The spacing (in seconds) between the starts of successive sample windows. Only used if a sample window duration is set, and shorter than this.";
+    desc.minValue = 1;
+    desc.maxValue = 3600;
+    desc.defaultValue = defaultSampleSpacing;
+    desc.isQuantized = false;
+    desc.unit = "s";
+    list.push_back(desc);
+    
+    desc.identifier = "silencegate";
+    desc.name = "Silence gate threshold";
+    desc.description = "Skip the analysis of a channel wherever its level stays below this threshold (in dB relative to full scale) for longer than the analysis needs to take in what came before, until it rises clearly above it again. The gated output says how much of each channel was skipped. Zero means nothing is skipped.";
+    desc.minValue = -120;
+    desc.maxValue = 0;
+    desc.defaultValue = defaultSilenceGate;
+    desc.isQuantized = false;
+    desc.unit = "dB";
+    list.push_back(desc);
     
     desc.identifier = "maxrange";
     desc.name = "Maximum range in semitones";
@@ -167,6 +279,39 @@ TuningDifference::getParameterDescriptors() const
     desc.unit = "";
     list.push_back(desc);
 
+    desc.identifier = "references";
+    desc.name = "Number of reference channels";
+    desc.description = "The number of channels, counting from the first, to be taken as references. Every other channel is compared against each reference in turn, so that several references can be used while analysing the other channels only once.";
+    desc.minValue = 1;
+    desc.maxValue = 100;
+    desc.defaultValue = float(defaultReferenceCount);
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    desc.unit = "";
+    list.push_back(desc);
+
+    desc.identifier = "background";
+    desc.name = "Analyse in background";
+    desc.description = "Carry out the analysis in background threads, so that it overlaps with the host reading and decoding the input. This does not affect the results.";
+    desc.minValue = 0;
+    desc.maxValue = 1;
+    desc.defaultValue = (defaultBackground ? 1.f : 0.f);
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    desc.unit = "";
+    list.push_back(desc);
+
+    desc.identifier = "parallel";
+    desc.name = "Parallel Octaves";
+    desc.description = "Also process the octaves of each chromagram as parallel tasks in the thread pool, rather than one after another within the channel's own task. This does not affect the results.";
+    desc.minValue = 0;
+    desc.maxValue = 1;
+    desc.defaultValue = (defaultParallelOctaves ? 1.f : 0.f);
+    desc.isQuantized = true;
+    desc.quantizeStep = 1;
+    desc.unit = "";
+    list.push_back(desc);
+
     return list;
 }
 
@@ -175,10 +320,26 @@ TuningDifference::getParameter(string id) const
 {
     if (id == "maxduration") {
         return m_maxDuration;
+    } else if (id == "deadline") {
+        return m_deadline;
+    } else if (id == "stable") {
+        return m_stableDuration;
+    } else if (id == "samplewindow") {
+        return m_sampleWindow;
+    } else if (id == "samplespacing") {
+        return m_sampleSpacing;
+    } else if (id == "silencegate") {
+        return m_silenceGate;
     } else if (id == "maxrange") {
         return float(m_maxSemis);
     } else if (id == "finetuning") {
         return m_fineTuning ? 1.f : 0.f;
+    } else if (id == "background") {
+        return m_background ? 1.f : 0.f;
+    } else if (id == "parallel") {
+        return m_parallelOctaves ? 1.f : 0.f;
+    } else if (id == "references") {
+        return float(m_referenceCount);
     }
     return 0;
 }
@@ -188,10 +349,26 @@ TuningDifference::setParameter(string id, float value)
 {
     if (id == "maxduration") {
         m_maxDuration = value;
+    } else if (id == "deadline") {
+        m_deadline = max(0.f, value);
+    } else if (id == "stable") {
+        m_stableDuration = max(0.f, value);
+    } else if (id == "samplewindow") {
+        m_sampleWindow = max(0.f, value);
+    } else if (id == "samplespacing") {
+        m_sampleSpacing = max(1.f, value);
+    } else if (id == "silencegate") {
+        m_silenceGate = min(0.f, max(-120.f, value));
     } else if (id == "maxrange") {
         m_maxSemis = int(roundf(value));
     } else if (id == "finetuning") {
         m_fineTuning = (value > 0.5f);
+    } else if (id == "background") {
+        m_background = (value > 0.5f);
+    } else if (id == "parallel") {
+        m_parallelOctaves = (value > 0.5f);
+    } else if (id == "references") {
+        m_referenceCount = max(1, int(roundf(value)));
     }
 }
 
@@ -221,11 +398,11 @@ TuningDifference::getOutputDescriptors() const
     OutputDescriptor d;
     d.identifier = "cents";
     d.name = "Tuning Differences";
-    d.description = "A single feature vector containing a value for each input channel after the first (reference) channel, containing the difference in averaged frequency profile between that channel and the reference channel, in cents. A positive value means the corresponding channel is higher than the reference.";
+    d.description = "A single feature vector containing a value for each input channel after the reference channels, containing the difference in averaged frequency profile between that channel and a reference channel, in cents. A positive value means the corresponding channel is higher than the reference. With more than one reference, the values for every channel against the first reference come first, then those against the second, and so on.";
     d.unit = "cents";
     d.hasFixedBinCount = true;
-    if (m_channelCount > 1) {
-        d.binCount = m_channelCount - 1;
+    if (m_channelCount > m_referenceCount) {
+        d.binCount = (m_channelCount - m_referenceCount) * m_referenceCount;
     } else {
         d.binCount = 1;
     }
@@ -238,11 +415,11 @@ TuningDifference::getOutputDescriptors() const
 
     d.identifier = "tuningfreq";
     d.name = "Relative Tuning Frequencies";
-    d.description = "A single feature vector containing a value for each input channel after the first (reference) channel, containing the tuning frequency of that channel, if the reference channel is assumed to contain the same music as it at a tuning frequency of A=440Hz.";
+    d.description = "A single feature vector containing a value for each input channel after the reference channels, containing the tuning frequency of that channel, if a reference channel is assumed to contain the same music as it at a tuning frequency of A=440Hz. With more than one reference, the values are ordered as for the tuning differences.";
     d.unit = "hz";
     d.hasFixedBinCount = true;
-    if (m_channelCount > 1) {
-        d.binCount = m_channelCount - 1;
+    if (m_channelCount > m_referenceCount) {
+        d.binCount = (m_channelCount - m_referenceCount) * m_referenceCount;
     } else {
         d.binCount = 1;
     }
@@ -255,7 +432,7 @@ TuningDifference::getOutputDescriptors() const
 
     d.identifier = "reffeature";
     d.name = "Reference Feature";
-    d.description = "Chroma feature from reference channel.";
+    d.description = "Chroma feature from reference channel, repeated for each comparison, in the same order as the tuning differences.";
     d.unit = "";
     d.hasFixedBinCount = true;
     d.binCount = m_bpo;
@@ -269,7 +446,7 @@ TuningDifference::getOutputDescriptors() const
 
     d.identifier = "otherfeature";
     d.name = "Other Features";
-    d.description = "Series of chroma feature vectors from the non-reference audio channels, before rotation.";
+    d.description = "Series of chroma feature vectors from the non-reference audio channels, before rotation, in the same order as the tuning differences.";
     d.unit = "";
     d.hasFixedBinCount = true;
     d.binCount = m_bpo;
@@ -283,7 +460,7 @@ TuningDifference::getOutputDescriptors() const
 
     d.identifier = "rotfeature";
     d.name = "Other Features at Rotated Frequency";
-    d.description = "Series of chroma feature vectors from the non-reference audio channels, calculated with the tuning frequency obtained from rotation matching. Note that this does not take into account any fine tuning, only the basic rotation match.";
+    d.description = "Series of chroma feature vectors from the non-reference audio channels, calculated with the tuning frequency obtained from rotation matching, in the same order as the tuning differences. Note that this does not take into account any fine tuning, only the basic rotation match.";
     d.unit = "";
     d.hasFixedBinCount = true;
     d.binCount = m_bpo;
@@ -295,6 +472,58 @@ TuningDifference::getOutputDescriptors() const
     m_outputs[d.identifier] = int(list.size());
     list.push_back(d);
 
+    d.identifier = "stages";
+    d.name = "Completed Stages";
+    d.description = "A single feature vector containing a value for each tuning difference, in the same order, saying which stages of the analysis it was obtained from. The value is the sum of 1 if all of the input was analysed (up to any maximum duration) and 2 if the fine tuning stage was completed, so that 3 means the analysis was complete. Stages are only left out when a deadline, a stable duration or sampling is set.";
+    d.unit = "";
+    d.hasFixedBinCount = true;
+    if (m_channelCount > m_referenceCount) {
+        d.binCount = (m_channelCount - m_referenceCount) * m_referenceCount;
+    } else {
+        d.binCount = 1;
+    }
+    d.hasKnownExtents = true;
+    d.minValue = 0;
+    d.maxValue = 3;
+    d.isQuantized = true;
+    d.quantizeStep = 1;
+    d.sampleType = OutputDescriptor::VariableSampleRate;
+    d.hasDuration = false;
+    m_outputs[d.identifier] = int(list.size());
+    list.push_back(d);
+
+    d.identifier = "gated";
+    d.name = "Gated Input";
+    d.description = "A single feature vector containing a value for each input channel, references first, giving the number of sample frames of that channel whose analysis was skipped by the silence gate.";
+    d.unit = "frames";
+    d.hasFixedBinCount = true;
+    d.binCount = max(1, m_channelCount);
+    d.hasKnownExtents = false;
+    d.isQuantized = true;
+    d.quantizeStep = 1;
+    d.sampleType = OutputDescriptor::VariableSampleRate;
+    d.hasDuration = false;
+    m_outputs[d.identifier] = int(list.size());
+    list.push_back(d);
+
+    d.identifier = "probes";
+    d.name = "Fine Tuning Probes";
+    d.description = "A single feature vector containing a value for each tuning difference, in the same order, giving the number of fine-tuning offsets whose distance from the reference was evaluated to obtain it. Zero if fine tuning is disabled.";
+    d.unit = "";
+    d.hasFixedBinCount = true;
+    if (m_channelCount > m_referenceCount) {
+        d.binCount = (m_channelCount - m_referenceCount) * m_referenceCount;
+    } else {
+        d.binCount = 1;
+    }
+    d.hasKnownExtents = false;
+    d.isQuantized = true;
+    d.quantizeStep = 1;
+    d.sampleType = OutputDescriptor::VariableSampleRate;
+    d.hasDuration = false;
+    m_outputs[d.identifier] = int(list.size());
+    list.push_back(d);
+
     return list;
 }
 
@@ -302,6 +531,7 @@ bool
 TuningDifference::initialise(size_t channels, size_t stepSize, size_t blockSize)
 {
     if (channels < getMinChannelCount()) return false;
+    if (int(channels) <= m_referenceCount) return false;
     if (stepSize != blockSize) return false;
     if (m_blockSize > INT_MAX) return false;
 
@@ -316,23 +546,90 @@ TuningDifference::initialise(size_t channels, size_t stepSize, size_t blockSize)
 void
 TuningDifference::reset()
 {
+    finishBackground();
+    m_workerFailure = nullptr;
+
+    if (!m_scheduler) {
+        m_scheduler = TaskScheduler::getGlobal();
+    }
+    
+    m_queues.clear();
+    m_draining = vector<atomic<bool>>(m_background ? m_channelCount : 0);
+    if (m_background) {
+        for (int c = 0; c < m_channelCount; ++c) {
+            m_queues.push_back(std::unique_ptr<SPSCQueue<Signal>>
+                               (new SPSCQueue<Signal>
+                                (m_deadline > 0 ? queuedBlocksForDeadline :
+                                 queuedBlocksPerChannel)));
+            m_draining[c] = false;
+        }
+    }
+    
     Chromagram::Parameters params(paramsForTuningFrequency(440.));
-    m_reference.clear();
+    m_referenceRate = getReferenceRate();
+    m_references = vector<RetainedReference>(m_referenceCount);
+    if (m_fineTuning && m_referenceRate < int(m_inputSampleRate)) {
+        for (auto &reference: m_references) {
+            reference.resampler.reset
+                (new Resampler(int(m_inputSampleRate), m_referenceRate));
+        }
+    }
     m_refChroma.reset(new Chromagram(params));
-    m_refTotals = TFeature(m_bpo, 0.0);
+    m_offsetsChroma.reset(m_fineTuning && (m_deadline > 0 || isSampling()) ?
+                          new Chromagram(referenceOffsetParams()) : 0);
+    m_state = TuningState(m_inputSampleRate, m_bpo, m_channelCount,
+                          m_fineTuning ? getSearchDistance() : 0,
+                          m_referenceCount);
     m_refFeatures.clear();
     m_otherChroma.clear();
     for (int i = 1; i < m_channelCount; ++i) {
         m_otherChroma.push_back(std::make_shared<Chromagram>(params));
     }
-    m_otherTotals = vector<TFeature>(m_channelCount-1, TFeature(m_bpo, 0.0));
+    m_columnCounts = vector<long>(m_channelCount, 0);
+    m_channelOrigins = vector<int64_t>(m_channelCount, 0);
+    m_channelFrom = vector<int64_t>(m_channelCount, INT64_MIN);
+    m_referenceFrom = m_segmentStart;
+    m_feedStart = 0;
+    m_referenceStart = 0;
     m_frameCount = 0;
-}
-
-template<typename T>
-void addTo(vector<T> &a, const vector<T> &b)
-{
-    transform(a.begin(), a.end(), b.begin(), a.begin(), plus<T>());
+    m_clockPaused = false;
+    m_inputTruncated = false;
+    m_stableRotations.clear();
+    m_stableSince = 0;
+    m_window.reset();
+    m_windowIndex = 0;
+    m_windowFeedStart = 0;
+    m_windowFeedEnd = 0;
+    m_windowFed = 0;
+    m_windowFill = 0;
+    m_windowBlocks = vector<Signal>(isSampling() ? m_channelCount : 0,
+                                    Signal(m_blockSize, 0.f));
+
+    // The gate needs enough recent input to restart a channel's
+    // analysis from a latency before the column a latency before the
+    // block that opened it, from an aligned position
+    m_gates = vector<ChannelGate>(m_silenceGate < 0 ? m_channelCount : 0);
+    m_gatedFrames = vector<int64_t>(m_channelCount, 0);
+    m_gateCloseLevel = pow(10.0, m_silenceGate / 10.0);
+    m_gateOpenLevel = pow(10.0, (m_silenceGate + gateHysteresis) / 10.0);
+    m_gateCapacity = m_blockSize + 2 * int64_t(m_refChroma->getLatency() +
+                                               m_refChroma->getInputAlignment());
+
+    // Profiles are only cached from the whole input, which is not
+    // analysed if we may stop once the estimate is stable, or are
+    // sampling or gating it
+    m_cache.reset();
+    m_channelCaches.clear();
+    m_firstChunkHashes.clear();
+    string cacheDirectory = ProfileCache::getDefaultDirectory();
+    if (cacheDirectory != "" && !m_segmented && m_stableDuration == 0 &&
+        !isSampling() && m_gates.empty()) {
+        m_cache.reset(new ProfileCache(cacheDirectory));
+        m_channelCaches = vector<ChannelCache>(m_channelCount);
+        m_firstChunkHashes = vector<ContentHash>(m_channelCount);
+    }
+    m_cacheChunkBlocks = max(1, int(cacheChunkDuration * m_inputSampleRate /
+                                    m_blockSize));
 }
 
 template<typename T>
@@ -342,16 +639,18 @@ T distance(const vector<T> &a, const vector<T> &b)
 			 plus<T>(), [](T x, T y) { return fabs(x - y); });
 }
 
+
 TuningDifference::TFeature
-TuningDifference::computeFeatureFromTotals(const TFeature &totals) const
+TuningDifference::computeFeatureFromTotals(const TFeature &totals,
+                                           long frameCount) const
 {
-    if (m_frameCount == 0) return totals;
+    if (frameCount == 0) return totals;
     
     TFeature feature(m_bpo);
     double sum = 0.0;
 
     for (int i = 0; i < m_bpo; ++i) {
-	double value = totals[i] / m_frameCount;
+	double value = totals[i] / frameCount;
 	feature[i] += value;
 	sum += value;
     }
@@ -368,262 +667,1741 @@ TuningDifference::computeFeatureFromTotals(const TFeature &totals) const
 Chromagram::Parameters
 TuningDifference::paramsForTuningFrequency(double hz) const
 {
-    Chromagram::Parameters params(m_inputSampleRate);
+    return paramsForTuningFrequency(hz, m_inputSampleRate);
+}
+
+Chromagram::Parameters
+TuningDifference::paramsForTuningFrequency(double hz, double sampleRate) const
+{
+    Chromagram::Parameters params(sampleRate);
     params.lowestOctave = 2;
     params.octaveCount = 4;
     params.binsPerOctave = m_bpo;
     params.tuningFrequency = hz;
     params.atomHopFactor = 0.5;
     params.window = CQParameters::Hann;
+    params.parallelOctaves = m_parallelOctaves;
+    params.scheduler = m_scheduler;
     return params;
 }
 
-TuningDifference::TFeature
-TuningDifference::computeFeatureFromSignal(const Signal &signal,
-                                           double hz) const
+int
+TuningDifference::getSearchDistance() const
+{
+    int coarseResolution = 1200 / m_bpo;
+    return coarseResolution/2 - 1;
+}
+
+vector<Chromagram::Parameters>
+TuningDifference::referenceOffsetParams() const
 {
-    Chromagram chromagram(paramsForTuningFrequency(hz));
+    // One chromagram stream per offset in the fine-tuning search
+    // range, at the rate of the retained reference. That is only
+    // decimated from a whole-number input rate: at any other rate the
+    // reference is kept as it is, and m_referenceRate, being an
+    // integer, would be slightly wrong for it
+
+    double rate = m_inputSampleRate;
+    if (m_referenceRate < int(m_inputSampleRate)) {
+        rate = m_referenceRate;
+    }
+    
+    vector<Chromagram::Parameters> params;
+    int searchDistance = getSearchDistance();
+    for (int c = -searchDistance; c <= searchDistance; ++c) {
+        params.push_back(paramsForTuningFrequency
+                         (frequencyForCentsAbove440(c), rate));
+    }
+    return params;
+}
 
-    TFeature totals(m_bpo, 0.0);
+vector<ChromaTotals>
+TuningDifference::computeReferenceTotals(int reference, bool complete,
+                                         int64_t &next) const
+{
+    // Analyse a retained reference at every offset in the
+    // fine-tuning search range, counting columns centred from
+    // m_referenceFrom to the end of the segment, and return in next
+    // the position of the first column not yet analysed. Unless
+    // complete, we analyse only whole blocks of the reference and
+    // leave the rest to be analysed later. All streams share the
+    // same resampling and FFTs.
+    
+    const Signal &signal = m_references[reference].signal;
+    vector<Chromagram::Parameters> params = referenceOffsetParams();
+    Chromagram chromagram(params);
+
+    vector<ChromaTotals> totals(params.size(), ChromaTotals(m_bpo));
+
+    int ratio = int(m_inputSampleRate) / m_referenceRate;
+    int hop = chromagram.getColumnHop();
+    int latency = chromagram.getLatency();
+    vector<long> columnCounts(params.size(), 0);
+
+    // If counting from somewhere after the start of the reference,
+    // skip to the first sample at which the chromagram is aligned as
+    // it would be had the reference started at the input's start
+    // (see getSegmentAlignment)
+
+    int64_t skip = 0;
+    if (m_referenceStart > 0 && m_referenceFrom > m_referenceStart) {
+        int64_t alignment = chromagram.getInputAlignment();
+        skip = (alignment - (m_referenceStart / ratio) % alignment) % alignment;
+        if (skip > int64_t(signal.size())) skip = signal.size();
+    }
+    int64_t origin = m_referenceStart + skip * ratio;
+    Signal::const_iterator start = signal.begin() + skip;
 
-    cerr << "computeFeatureFromSignal: hz = " << hz << ", frame count = " << m_frameCount << endl;
+    int64_t available = signal.end() - start;
+    int frameCount = int(complete ?
+                         (available + m_blockSize - 1) / m_blockSize :
+                         available / m_blockSize);
+    
+#ifdef DEBUG_TUNING_DIFFERENCE
+    cerr << "computeReferenceTotals: " << params.size()
+         << " frequencies, rate = " << m_referenceRate
+         << ", frame count = " << frameCount << endl;
+#endif
+
+    // With a deadline, give up at the end of the first block after
+    // which the rest are not expected to be done in time, returning
+    // no totals. The first block costs more than the rest, and the
+    // lower octaves are only processed every few blocks, so we time
+    // several blocks after the first before deciding
+
+    const int timedBlocks = 8;
+    double timingFrom = 0.0;
     
-    for (int i = 0; i < m_frameCount; ++i) {
-	Signal::const_iterator first = signal.begin() + i * m_blockSize;
+    for (int i = 0; i < frameCount; ++i) {
+        if (complete && m_deadline > 0) {
+            double now = getElapsedTime();
+            if (i == 1) {
+                timingFrom = now;
+            } else if (i > timedBlocks) {
+                double perBlock = (now - timingFrom) / (i - 1);
+                if (now + perBlock * (frameCount - i) >
+                    m_deadline * deadlineMargin) {
+#ifdef DEBUG_TUNING_DIFFERENCE
+                    cerr << "computeReferenceTotals: abandoned for deadline "
+                         << "after " << i << " of " << frameCount
+                         << " blocks" << endl;
+#endif
+                    return {};
+                }
+            }
+        }
+	Signal::const_iterator first = start + i * m_blockSize;
 	Signal::const_iterator last = first + m_blockSize;
 	if (last > signal.end()) last = signal.end();
 	CQBase::RealSequence input(first, last);
 	input.resize(m_blockSize);
-	CQBase::RealBlock block = chromagram.process(input);
-	for (const auto &v: block) addTo(totals, v);
+	vector<CQBase::RealBlock> blocks = chromagram.processStreams(input);
+        for (int s = 0; s < int(blocks.size()); ++s) {
+            addColumns(totals[s], blocks[s], columnCounts[s], origin,
+                       m_referenceFrom, m_segmentEnd, hop, latency, ratio);
+        }
     }
 
-    return computeFeatureFromTotals(totals);
+    // The streams share a hop, so have all produced the same number
+    // of columns
+
+    next = origin + (int64_t(columnCounts[0]) * hop - latency) * ratio;
+    return totals;
 }
 
-TuningDifference::FeatureSet
-TuningDifference::process(const float *const *inputBuffers, Vamp::RealTime)
+int
+TuningDifference::getReferenceRate() const
 {
-    if (m_maxDuration > 0) {
-        int maxFrames = int((m_maxDuration * m_inputSampleRate) /
-                            float(m_blockSize));
-        if (m_frameCount > maxFrames) return FeatureSet();
-    }
+    // The highest frequency analysed is the C just above the top
+    // octave of the chromagram, at the largest fine-tuning offset. We
+    // need a rate well above twice that: the top-octave kernels get
+    // shorter with the rate, and below about ten times the limit
+    // frequency the fine-tuning results start to drift from those
+    // obtained at typical input rates. We also want the rate to be an
+    // integer fraction of the input rate, so that the decimator is a
+    // simple one.
 
-    CQBase::RealBlock block;
-    CQBase::RealSequence input;
+    int searchDistance = getSearchDistance();
 
-    input = CQBase::RealSequence
-        (inputBuffers[0], inputBuffers[0] + m_blockSize);
-    block = m_refChroma->process(input);
-    for (const auto &v: block) addTo(m_refTotals, v);
+    Chromagram::Parameters params(paramsForTuningFrequency(440.));
+    int limitPitch = (params.lowestOctave + params.octaveCount + 1) * 12;
+    double limitFreq = pitchToFrequency(limitPitch, searchDistance, 440.);
+    double minRate = limitFreq * 10.0;
 
-    if (m_fineTuning) {
-        m_reference.insert(m_reference.end(),
-                           inputBuffers[0],
-                           inputBuffers[0] + m_blockSize);
+    int inputRate = int(m_inputSampleRate);
+    if (double(inputRate) != m_inputSampleRate) return inputRate;
+    
+    for (int factor = int(inputRate / minRate); factor > 1; --factor) {
+        if (inputRate % factor == 0) {
+            return inputRate / factor;
+        }
     }
+    return inputRate;
+}
 
-    for (int c = 1; c < m_channelCount; ++c) {
-        input = CQBase::RealSequence
-            (inputBuffers[c], inputBuffers[c] + m_blockSize);
-        block = m_otherChroma[c-1]->process(input);
-        for (const auto &v: block) addTo(m_otherTotals[c-1], v);
+void
+TuningDifference::appendToReference(int reference, const float *data, int n)
+{
+    RetainedReference &r = m_references[reference];
+    
+    if (!r.resampler) {
+        r.signal.insert(r.signal.end(), data, data + n);
+        return;
     }
+
+    vector<double> in(data, data + n);
+    vector<double> out = r.resampler->process(in.data(), n);
+
+    // Drop the decimator's latency from the start, so that the
+    // retained reference lines up with the input
+
+    int drop = r.resampler->getLatency() - r.dropped;
+    if (drop > int(out.size())) drop = int(out.size());
+    if (drop < 0) drop = 0;
+    r.dropped += drop;
     
-    ++m_frameCount;
-    return FeatureSet();
+    r.signal.insert(r.signal.end(), out.begin() + drop, out.end());
 }
 
-TuningDifference::FeatureSet
-TuningDifference::getRemainingFeatures()
+void
+TuningDifference::finishReference(int reference)
 {
-    FeatureSet fs;
-    if (m_frameCount == 0) return fs;
+    RetainedReference &r = m_references[reference];
+    
+    if (!r.resampler) return;
 
-    m_refFeatures[0] = computeFeatureFromTotals(m_refTotals);
+    // Push through enough silence to flush the decimator's latency,
+    // then trim to the duration of the input
 
-    Feature f;
-    f.hasTimestamp = true;
-    f.timestamp = Vamp::RealTime::zeroTime;
-    f.values.clear();
-    fs[m_outputs["cents"]].push_back(f);
-    fs[m_outputs["tuningfreq"]].push_back(f);
+    int ratio = int(m_inputSampleRate) / m_referenceRate;
+    int latency = r.resampler->getLatency();
+    vector<float> silence((latency + 1) * ratio, 0.f);
+    appendToReference(reference, silence.data(), int(silence.size()));
+    
+    size_t expected = size_t((m_feedStart + int64_t(m_frameCount) * m_blockSize
+                              - m_referenceStart) / ratio);
+    if (r.signal.size() > expected) {
+        r.signal.resize(expected);
+    }
+    
+    r.resampler.reset();
+}
 
-    for (int c = 1; c < m_channelCount; ++c) {
-        getRemainingFeaturesForChannel(c, fs);
+void
+TuningDifference::addColumns(ChromaTotals &totals,
+                             const CQBase::RealBlock &block,
+                             long &columnCount, int64_t origin,
+                             int64_t from, int64_t to,
+                             int hop, int latency, int ratio) const
+{
+    // Column n of a chromagram is centred at n * hop - latency
+    // samples (at its own rate) from the start of its input, which
+    // was at input frame origin. We count those centred from frame
+    // from up to but not including frame to.
+    
+    for (const auto &column: block) {
+        int64_t centre = origin +
+            (int64_t(columnCount) * hop - latency) * ratio;
+        ++columnCount;
+        if (centre >= from && centre < to) {
+            totals.add(column);
+        }
     }
+}
 
-    return fs;
+int64_t
+TuningDifference::getNextColumnFrame(int channel) const
+{
+    Chromagram *chroma =
+        (channel == 0 ? m_refChroma.get() : m_otherChroma[channel-1].get());
+    return m_channelOrigins[channel] +
+        int64_t(m_columnCounts[channel]) * chroma->getColumnHop() -
+        chroma->getLatency();
 }
 
 void
-TuningDifference::getRemainingFeaturesForChannel(int channel,
-                                                 FeatureSet &fs)
+TuningDifference::analyseInput(int channel, const CQBase::RealSequence &input)
 {
-    TFeature otherFeature =
-        computeFeatureFromTotals(m_otherTotals[channel-1]);
+    Chromagram *chroma =
+        (channel == 0 ? m_refChroma.get() : m_otherChroma[channel-1].get());
+    
+    CQBase::RealBlock block = chroma->process(input);
+    addColumns(m_state.getChannelTotals(channel), block,
+               m_columnCounts[channel], m_channelOrigins[channel],
+               max(m_segmentStart, m_channelFrom[channel]), m_segmentEnd,
+               chroma->getColumnHop(), chroma->getLatency(), 1);
+}
 
-    Feature f;
-    f.hasTimestamp = true;
-    f.timestamp = Vamp::RealTime::zeroTime;
+void
+TuningDifference::analyseBlock(int channel, const float *data)
+{
+    bool cached = (channel < int(m_channelCaches.size()));
 
-    f.values.clear();
-    for (auto v: m_refFeatures[0]) f.values.push_back(float(v));
-    fs[m_outputs["reffeature"]].push_back(f);
+    if (!m_gates.empty()) {
+        analyseGated(channel, data);
+    } else if (!cached || !m_channelCaches[channel].speculating) {
+        analyseInput(channel,
+                     CQBase::RealSequence(data, data + m_blockSize));
+    }
 
-    f.values.clear();
-    for (auto v: otherFeature) f.values.push_back(float(v));
-    fs[m_outputs["otherfeature"]].push_back(f); 
-   
-    int rotation = findBestRotation(m_refFeatures[0], otherFeature);
+    if (cached) {
+        updateChannelCache(channel, data);
+    }
+    
+    // Retained even while the channel matches a cached profile, as
+    // the cached offset totals cover its whole content (see
+    // ChannelCache)
+    
+    if (channel < m_referenceCount && m_fineTuning) {
+        appendToReference(channel, data, m_blockSize);
+    }
+}
 
-    int coarseCents = -(rotation * 1200) / m_bpo;
+void
+TuningDifference::analyseGated(int channel, const float *data)
+{
+    // Called from the channel's own analysis task, like
+    // updateChannelCache. The gate closes once the level has been
+    // below the threshold for two latencies: by then every column
+    // within a latency of the last block above it, whose kernels
+    // reach into that block, has been counted. While it is closed the
+    // input is only retained, and the first block clearly above the
+    // threshold reopens it (see reopenChannel)
 
-    cerr << "channel " << channel << ": rotation " << rotation << " -> cents " << coarseCents << endl;
+    ChannelGate &gate = m_gates[channel];
+    int64_t blockStart = gate.recentStart + int64_t(gate.recent.size());
 
-    TFeature rotatedFeature = otherFeature;
-    if (rotation != 0) {
-        rotateFeature(rotatedFeature, rotation);
+    double sum = 0.0;
+    for (int i = 0; i < m_blockSize; ++i) {
+        sum += double(data[i]) * data[i];
     }
+    double level = sum / m_blockSize;
+    bool loud = (level >= (gate.closed ? m_gateOpenLevel : m_gateCloseLevel));
 
-    f.values.clear();
-    for (auto v: rotatedFeature) f.values.push_back(float(v));
-    fs[m_outputs["rotfeature"]].push_back(f);
-
-    if (m_fineTuning) {
-    
-        pair<int, double> fine =
-            findFineFrequency(rotatedFeature, coarseCents);
+    if (gate.closed && loud) {
+        reopenChannel(channel, blockStart);
+    }
 
-        int fineCents = fine.first;
-        double fineHz = fine.second;
+    gate.recent.insert(gate.recent.end(), data, data + m_blockSize);
+    if (int64_t(gate.recent.size()) > m_gateCapacity) {
+        size_t excess = gate.recent.size() - size_t(m_gateCapacity);
+        gate.recent.erase(gate.recent.begin(), gate.recent.begin() + excess);
+        gate.recentStart += excess;
+    }
+    while (!gate.gatedBlocks.empty() &&
+           gate.gatedBlocks.front() < gate.recentStart) {
+        gate.gatedBlocks.pop_front();
+    }
 
-        fs[m_outputs["cents"]][0].values.push_back(float(fineCents));
-        fs[m_outputs["tuningfreq"]][0].values.push_back(float(fineHz));
-    
-        cerr << "channel " << channel << ": overall best Hz = " << fineHz << endl;
+    if (gate.closed) {
+        m_gatedFrames[channel] +=
+            getSegmentOverlap(blockStart, blockStart + m_blockSize);
+        gate.gatedBlocks.push_back(blockStart);
+        return;
+    }
 
-    } else {
+    analyseInput(channel, CQBase::RealSequence(data, data + m_blockSize));
 
-        fs[m_outputs["cents"]][0].values.push_back(float(coarseCents));
-        fs[m_outputs["tuningfreq"]][0].values.push_back
-            (float(frequencyForCentsAbove440(coarseCents)));
-    }        
+    Chromagram *chroma =
+        (channel == 0 ? m_refChroma.get() : m_otherChroma[channel-1].get());
+    gate.quiet = (loud ? 0 : gate.quiet + m_blockSize);
+    if (gate.quiet >= 2 * int64_t(chroma->getLatency())) {
+        gate.closed = true;
+        gate.closedFrom = getNextColumnFrame(channel);
+    }
 }
 
 void
-TuningDifference::rotateFeature(TFeature &r, int rotation) const
+TuningDifference::reopenChannel(int channel, int64_t from)
 {
-    if (rotation < 0) {
-        rotate(r.begin(), r.begin() - rotation, r.end());
-    } else {
-        rotate(r.begin(), r.end() - rotation, r.end());
-    }
-}
+    // Restart the channel's analysis so as to count columns from a
+    // latency before input frame from (or from the first not counted
+    // before the gate closed, if later), using a new chromagram
+    // started from the retained input a further latency before that,
+    // at a position aligned with the start of the input as for
+    // restartChannel. The retained input is analysed up to from
+    
+    ChannelGate &gate = m_gates[channel];
 
-double
-TuningDifference::featureDistance(const TFeature &ref,
-                                  const TFeature &other,
-                                  int rotation) const
-{
-    if (rotation == 0) {
-	return distance(ref, other);
+    Chromagram::Parameters params(paramsForTuningFrequency(440.));
+    Chromagram *chroma = new Chromagram(params);
+    if (channel == 0) {
+        m_refChroma.reset(chroma);
     } else {
-	// A positive rotation pushes the tuning frequency up for this
-	// chroma, negative one pulls it down. If a positive rotation
-	// makes this chroma match an un-rotated reference, then this
-	// chroma must have initially been lower than the reference.
-	TFeature r(other);
-        rotateFeature(r, rotation);
-	return distance(ref, r);
+        m_otherChroma[channel-1].reset(chroma);
     }
-}
 
-int
-TuningDifference::findBestRotation(const TFeature &ref,
-                                   const TFeature &other) const
-{
-    map<double, int> dists;
+    int64_t latency = chroma->getLatency();
+    int64_t alignment = chroma->getInputAlignment();
+    int64_t countFrom = max(from - latency, gate.closedFrom);
+    int64_t start = m_feedStart;
+    int64_t offset = countFrom - latency - m_feedStart;
+    if (offset > 0) {
+        start += (offset / alignment) * alignment;
+    }
+    if (start < gate.recentStart) {
+        throw logic_error("Not enough input retained to reopen gate");
+    }
 
-    int maxRotation = (m_bpo * m_maxSemis) / 12;
+    m_channelOrigins[channel] = start;
+    m_channelFrom[channel] = countFrom;
+    m_columnCounts[channel] = 0;
 
-    for (int r = -maxRotation; r <= maxRotation; ++r) {
-	double dist = featureDistance(ref, other, r);
-	dists[dist] = r;
+    auto i = gate.recent.begin() + (start - gate.recentStart);
+    auto end = gate.recent.begin() + (from - gate.recentStart);
+    while (i != end) {
+        auto j = i + min<int64_t>(m_blockSize, end - i);
+        analyseInput(channel, CQBase::RealSequence(i, j));
+        i = j;
     }
 
-    int best = dists.begin()->second;
+    gate.closed = false;
+    gate.quiet = 0;
+}
 
-    return best;
+static void
+addParams(ContentHash &hash, const Chromagram::Parameters &params)
+{
+    hash.add(params.sampleRate);
+    hash.add(int64_t(params.lowestOctave));
+    hash.add(int64_t(params.octaveCount));
+    hash.add(int64_t(params.binsPerOctave));
+    hash.add(params.tuningFrequency);
+    hash.add(params.q);
+    hash.add(params.atomHopFactor);
+    hash.add(params.threshold);
+    hash.add(int64_t(params.window));
 }
 
-pair<int, double>
-TuningDifference::findFineFrequency(const TFeature &rotatedOtherFeature,
-                                    int coarseCents)
+uint64_t
+TuningDifference::getChannelCacheKey(uint64_t firstChunkHash) const
 {
-    int coarseResolution = 1200 / m_bpo;
-    int searchDistance = coarseResolution/2 - 1;
+    // Everything a channel's totals depend on, apart from its content
+    // after the first chunk, which is checked chunk by chunk
+
+    ContentHash hash;
+    hash.add(string("channel 1"));
+    hash.add(double(m_inputSampleRate));
+    hash.add(int64_t(m_blockSize));
+    hash.add(int64_t(m_cacheChunkBlocks));
+    addParams(hash, paramsForTuningFrequency(440.));
+    hash.add(int64_t(firstChunkHash));
+    return hash.get();
+}
+
+uint64_t
+TuningDifference::getOffsetsCacheKey(int reference) const
+{
+    const ChannelCache &cache = m_channelCaches[reference];
+
+    ContentHash hash;
+    hash.add(string("offsets 1"));
+    hash.add(double(m_inputSampleRate));
+    hash.add(int64_t(m_blockSize));
+    hash.add(int64_t(m_referenceRate));
+    for (const auto &params: referenceOffsetParams()) {
+        addParams(hash, params);
+    }
+    hash.add(int64_t(cache.blocks));
+    hash.add(int64_t(cache.contentHash.get()));
+    return hash.get();
+}
 
-    int bestCents = coarseCents;
-    double bestHz = frequencyForCentsAbove440(coarseCents);
+void
+TuningDifference::lookUpChannelCaches(const float *const *inputBuffers)
+{
+    // Called from process() with each block of the first chunk,
+    // before the block is handed on for analysis. The analysis tasks
+    // only consult the candidates once they have the last of these
 
-    cerr << "findFineFrequency: coarse frequency is " << bestHz << endl;
-    cerr << "searchDistance = " << searchDistance << endl;
+    if (m_frameCount >= m_cacheChunkBlocks) {
+        return;
+    }
+    
+    for (int c = 0; c < int(m_channelCaches.size()); ++c) {
+        m_firstChunkHashes[c].add(inputBuffers[c], m_blockSize);
+    }
 
-    double bestScore = 0;
-    bool firstScore = true;
+    if (m_frameCount + 1 < m_cacheChunkBlocks) {
+        return;
+    }
     
-    for (int sign = -1; sign <= 1; sign += 2) {
-	for (int offset = (sign < 0 ? 0 : 1);
-             offset <= searchDistance;
-             ++offset) {
+    for (int c = 0; c < int(m_channelCaches.size()); ++c) {
+        m_cache->loadChannels(getChannelCacheKey(m_firstChunkHashes[c].get()),
+                              m_channelCaches[c].candidates);
+    }
+}
 
-	    int fineCents = coarseCents + sign * offset;
-	    double fineHz = frequencyForCentsAbove440(fineCents);
+void
+TuningDifference::updateChannelCache(int channel, const float *data)
+{
+    // Called from the channel's own analysis task, so we are the only
+    // one using its ChannelCache, chromagram and totals
 
-	    cerr << "trying with fineCents = " << fineCents << "..." << endl;
+    ChannelCache &cache = m_channelCaches[channel];
 
-            // compare the rotated "other" chroma with a reference
-            // chroma shifted by the offset in the opposite direction
+    // Retain enough input to restart from the end of the previous
+    // chunk, which may be up to a latency before the chunk boundary,
+    // from an aligned position a further latency before that. This
+    // also covers the whole of the first chunk, which we don't
+    // analyse until we have looked it up
 
-            int compensatingCents = -sign * offset;
-            TFeature compensatedReference;
+    Chromagram *chroma =
+        (channel == 0 ? m_refChroma.get() : m_otherChroma[channel-1].get());
+    size_t capacity = size_t(m_cacheChunkBlocks + 2) * m_blockSize +
+        2 * size_t(chroma->getLatency() + chroma->getInputAlignment());
+    
+    cache.recent.insert(cache.recent.end(), data, data + m_blockSize);
+    if (cache.recent.size() > capacity) {
+        size_t excess = cache.recent.size() - capacity;
+        cache.recent.erase(cache.recent.begin(),
+                           cache.recent.begin() + excess);
+        cache.recentStart += excess;
+    }
+    
+    cache.chunkHash.add(data, m_blockSize);
+    cache.contentHash.add(data, m_blockSize);
+    ++cache.blocks;
 
-            if (m_refFeatures.find(compensatingCents) == m_refFeatures.end()) {
-                double compensatingHz = frequencyForCentsAbove440
-                    (compensatingCents);
-            
-                compensatedReference = computeFeatureFromSignal
-                    (m_reference, compensatingHz);
+    if (cache.blocks % m_cacheChunkBlocks != 0) {
+        return;
+    }
 
-                m_refFeatures[compensatingCents] = compensatedReference;
+    size_t chunk = cache.blocks / m_cacheChunkBlocks - 1;
+    uint64_t hash = cache.chunkHash.get();
+    cache.chunkHash = ContentHash();
+
+    if (cache.speculating) {
+        auto &candidates = cache.candidates;
+        candidates.erase
+            (remove_if(candidates.begin(), candidates.end(),
+                       [&](const ProfileCache::ChannelEntry &e) {
+                           return chunk >= e.chunkHashes.size() ||
+                               e.chunkHashes[chunk] != hash;
+                       }),
+             candidates.end());
+        if (!candidates.empty()) {
+            // The candidates left have all had the same input so far
+            const auto &cached = candidates[0];
+            cache.recorded.chunkHashes.push_back(hash);
+            cache.recorded.chunkTotals.push_back(cached.chunkTotals[chunk]);
+            cache.recorded.chunkResumeFrames.push_back
+                (cached.chunkResumeFrames[chunk]);
+            return;
+        }
+        cache.speculating = false;
+        restartChannel(channel);
+    }
 
-            } else {
+    cache.recorded.chunkHashes.push_back(hash);
+    cache.recorded.chunkTotals.push_back(m_state.getChannelTotals(channel));
+    cache.recorded.chunkResumeFrames.push_back
+        (getNextColumnFrame(channel) - m_feedStart);
+}
 
-                compensatedReference = m_refFeatures[compensatingCents];
-            }
+void
+TuningDifference::restartChannel(int channel)
+{
+    // Take the totals at the end of the last recorded chunk, and
+    // analyse the retained input from there on with a new
+    // chromagram, started from a position aligned with the start of
+    // the input and far enough back to produce the same columns as
+    // one that had been running all along (see getSegmentAlignment).
+    // With no chunk recorded, start again from the beginning
+    
+    ChannelCache &cache = m_channelCaches[channel];
+    const auto &recorded = cache.recorded;
 
-	    double fineScore = featureDistance(compensatedReference,
-                                               rotatedOtherFeature,
-                                               0); // we are rotated already
+    Chromagram::Parameters params(paramsForTuningFrequency(440.));
+    Chromagram *chroma = new Chromagram(params);
+    if (channel == 0) {
+        m_refChroma.reset(chroma);
+    } else {
+        m_otherChroma[channel-1].reset(chroma);
+    }
 
-	    cerr << "fine offset = " << offset << ", cents = " << fineCents
-		 << ", Hz = " << fineHz << ", score " << fineScore
-		 << " (best score so far " << bestScore << ")" << endl;
-	    
-	    if ((fineScore < bestScore) || firstScore) {
-		cerr << "is good!" << endl;
-		bestScore = fineScore;
-		bestCents = fineCents;
-		bestHz = fineHz;
-                firstScore = false;
-	    } else {
-		break;
-	    }
-	}
+    int64_t resumeFrame = INT64_MIN;
+    int64_t start = m_feedStart;
+    
+    if (recorded.chunkHashes.empty()) {
+        m_state.getChannelTotals(channel) = ChromaTotals(m_bpo);
+    } else {
+        resumeFrame = m_feedStart + recorded.chunkResumeFrames.back();
+        m_state.getChannelTotals(channel) = recorded.chunkTotals.back();
+        int64_t alignment = chroma->getInputAlignment();
+        int64_t offset = resumeFrame - chroma->getLatency() - m_feedStart;
+        if (offset > 0) {
+            start += (offset / alignment) * alignment;
+        }
+#ifdef DEBUG_TUNING_DIFFERENCE
+        cerr << "TuningDifference: Channel " << channel
+             << " no longer matches cached profile, resuming analysis from "
+             << resumeFrame << endl;
+#endif
     }
     
-    return pair<int, double>(bestCents, bestHz);
+    if (start < cache.recentStart) {
+        throw logic_error("Not enough input retained to restart analysis");
+    }
+
+    m_channelOrigins[channel] = start;
+    m_channelFrom[channel] = resumeFrame;
+    m_columnCounts[channel] = 0;
+
+    auto i = cache.recent.begin() + (start - cache.recentStart);
+    while (i != cache.recent.end()) {
+        auto j = i + min<int64_t>(m_blockSize, cache.recent.end() - i);
+        analyseInput(channel, CQBase::RealSequence(i, j));
+        i = j;
+    }
 }
 
+void
+TuningDifference::finishChannelCache(int channel)
+{
+    ChannelCache &cache = m_channelCaches[channel];
+
+    if (cache.speculating) {
+        for (const auto &cached: cache.candidates) {
+            if (!cached.chunkHashes.empty() &&
+                cache.blocks == cached.blockCount &&
+                cache.contentHash.get() == cached.contentHash) {
+                m_state.getChannelTotals(channel) = cached.totals;
+                return;
+            }
+        }
+        cache.speculating = false;
+        restartChannel(channel);
+    }
+
+    // An input shorter than a chunk is never looked up
+    if (cache.recorded.chunkHashes.empty()) {
+        return;
+    }
+
+    cache.recorded.blockCount = cache.blocks;
+    cache.recorded.contentHash = cache.contentHash.get();
+    cache.recorded.totals = m_state.getChannelTotals(channel);
+    m_cache->storeChannel(getChannelCacheKey(cache.recorded.chunkHashes[0]),
+                          cache.recorded);
+
+    // Index new profiles by their content, so that a recording can
+    // later be matched to its reference, or recordings compared with
+    // one another, without analysing them again
+    
+    try {
+        ProfileIndex::append(m_cache->getIndexFilename(),
+                             cache.recorded.contentHash,
+                             computeFeatureFromTotals
+                             (cache.recorded.totals.getTotals(),
+                              cache.blocks));
+    } catch (const runtime_error &e) {
+        cerr << "TuningDifference: Failed to index profile: "
+             << e.what() << endl;
+    }
+}
+
+void
+TuningDifference::stopCaching()
+{
+    m_cache.reset();
+    m_channelCaches.clear();
+    m_firstChunkHashes.clear();
+}
+
+void
+TuningDifference::setSegment(int64_t startFrame, int64_t endFrame)
+{
+    if (startFrame < 0 || endFrame <= startFrame) {
+        throw invalid_argument("Invalid segment range");
+    }
+    // A segment from the start of the input counts every column, as
+    // an unsegmented analysis does, including those centred before
+    // the first frame
+    m_segmented = true;
+    m_segmentStart = (startFrame == 0 ? INT64_MIN : startFrame);
+    m_segmentEnd = endFrame;
+    m_referenceFrom = m_segmentStart;
+    stopCaching();
+}
+
+int64_t
+TuningDifference::getSegmentAlignment(int64_t &channelWarmUp,
+                                      int64_t &referenceWarmUp) const
+{
+    // Segments must be fed from a position at which every
+    // chromagram we use is aligned exactly as it would be if fed from
+    // the start of the input, and from far enough back that the
+    // first column in the segment no longer depends on what came
+    // before the feed started
+
+    int64_t alignment = m_refChroma->getInputAlignment();
+    channelWarmUp = m_refChroma->getLatency();
+    referenceWarmUp = 0;
+
+    if (m_fineTuning) {
+
+        // The fine-tuning chromagrams are fed from the retained
+        // reference, whose samples are ratio input samples apart.
+        // Their alignment is not in general commensurate with ours,
+        // so rather than find a common multiple (which may run to
+        // hours) we skip up to one alignment's worth of the reference
+        // before feeding them, and allow for that in the warm-up
+
+        int64_t ratio = int(m_inputSampleRate) / m_referenceRate;
+        Chromagram reference(referenceOffsetParams());
+        if (alignment % ratio != 0) alignment *= ratio;
+        referenceWarmUp = (int64_t(reference.getLatency()) +
+                           reference.getInputAlignment()) * ratio;
+    }
+
+    return alignment;
+}
+
+int64_t
+TuningDifference::getSegmentFeedStart() const
+{
+    if (!m_segmented || m_segmentStart <= 0) return 0;
+    int64_t channelWarmUp = 0, referenceWarmUp = 0;
+    int64_t alignment = getSegmentAlignment(channelWarmUp, referenceWarmUp);
+    int64_t start = m_segmentStart - channelWarmUp;
+    if (m_fineTuning) {
+        if (m_referenceFrom <= 0) return 0;
+        start = min(start, m_referenceFrom - referenceWarmUp);
+    }
+    if (start <= 0) return 0;
+    return (start / alignment) * alignment;
+}
+
+int64_t
+TuningDifference::getSegmentOverlap(int64_t from, int64_t to) const
+{
+    // The number of input frames from from to to within the segment
+    from = max(from, m_segmentStart);
+    to = min(to, m_segmentEnd);
+    return to > from ? to - from : 0;
+}
+
+long
+TuningDifference::getCountedBlocks(int64_t to) const
+{
+    // The number of input blocks our totals stand for, which is the
+    // number fed less those fed only to warm up or down a segment.
+    // We count the blocks, on a grid from the start of the input,
+    // that start within the segment and before frame to, so that the
+    // counts for the parts of a partitioned input, or either side of
+    // a checkpoint, add up to the count for the whole
+
+    if (m_frameCount == 0) return 0;
+    int64_t from = max(m_segmentStart, m_feedStart);
+    int64_t end = min(m_feedStart + int64_t(m_frameCount) * m_blockSize,
+                      min(m_segmentEnd, to));
+    if (end <= from) return 0;
+    return long((end + m_blockSize - 1) / m_blockSize -
+                (from + m_blockSize - 1) / m_blockSize);
+}
+
+int64_t
+TuningDifference::getSegmentFeedEnd() const
+{
+    if (!m_segmented) return INT64_MAX;
+    int64_t channelWarmUp = 0, referenceWarmUp = 0;
+    int64_t alignment = getSegmentAlignment(channelWarmUp, referenceWarmUp);
+    int64_t warmUp = max(channelWarmUp + alignment, referenceWarmUp);
+    if (m_segmentEnd > INT64_MAX - warmUp) return INT64_MAX;
+    return m_segmentEnd + warmUp;
+}
+
+void
+TuningDifference::drainQueue(int channel)
+{
+    // Analyse everything in the channel's queue. We are the only
+    // drain task for this channel until we clear its draining flag;
+    // if more arrives after we find the queue empty but before we
+    // clear the flag, process() will not have spawned another task,
+    // so we must look again afterwards. After a failure we carry on
+    // draining, so as not to hold up process(), but analyse nothing.
+
+    Signal block;
+
+    while (true) {
+
+        bool popped = false;
+        
+        while (m_queues[channel]->pop(block)) {
+            popped = true;
+            bool failed;
+            {
+                lock_guard<mutex> lock(m_workMutex);
+                failed = bool(m_workerFailure);
+            }
+            if (failed) continue;
+            try {
+                analyseBlock(channel, block.data());
+            } catch (...) {
+                lock_guard<mutex> lock(m_workMutex);
+                if (!m_workerFailure) {
+                    m_workerFailure = current_exception();
+                }
+            }
+        }
+
+        if (popped) {
+            { lock_guard<mutex> lock(m_workMutex); }
+            m_spaceAvailable.notify_all();
+        }
+
+        m_draining[channel] = false;
+
+        if (m_queues[channel]->isEmpty() ||
+            m_draining[channel].exchange(true)) {
+            break;
+        }
+    }
+}
+
+void
+TuningDifference::finishBackground()
+{
+    if (m_scheduler) {
+        m_scheduler->wait(m_drainGroup);
+    }
+}
+
+double
+TuningDifference::getElapsedTime() const
+{
+    auto now = (m_clockPaused ? m_pausedAt : chrono::steady_clock::now());
+    return chrono::duration<double>(now - m_startTime).count();
+}
+
+void
+TuningDifference::pauseClock()
+{
+    if (m_clockPaused) return;
+    m_pausedAt = chrono::steady_clock::now();
+    m_clockPaused = true;
+}
+
+void
+TuningDifference::resumeClock()
+{
+    if (!m_clockPaused) return;
+    m_startTime += chrono::steady_clock::now() - m_pausedAt;
+    m_clockPaused = false;
+}
+
+bool
+TuningDifference::isPastDeadline() const
+{
+    return m_deadline > 0 && m_frameCount > 0 &&
+        getElapsedTime() >= m_deadline * deadlineMargin;
+}
+
+double
+TuningDifference::getInputBudget() const
+{
+    // The time left for the input is the share of the deadline that
+    // leaves enough for the fine stage to analyse the references at
+    // every offset. Analysing a retained reference at all the offsets
+    // at once, with the resampling and FFTs shared between them,
+    // takes about as long as analysing one channel of the input at
+    // the reference rate. We allow three times that, as it has to be
+    // done after the input has been analysed, which may itself run
+    // late
+
+    double budget = m_deadline * deadlineMargin;
+    if (!m_fineTuning) return budget;
+
+    double fineCost = (3.0 * m_referenceCount * m_referenceRate) /
+        (m_channelCount * double(m_inputSampleRate));
+    return budget / (1.0 + fineCost);
+}
+
+TuningDifference::FeatureSet
+TuningDifference::process(const float *const *inputBuffers,
+                          Vamp::RealTime timestamp)
+{
+    if (m_frameCount == 0) {
+        // Round rather than truncate as realTime2Frame does, since
+        // the timestamp of a given frame may fall just short of it
+        m_feedStart = int64_t(floor((timestamp.sec +
+                                     timestamp.nsec / 1000000000.0) *
+                                    m_inputSampleRate + 0.5));
+        m_referenceStart = m_feedStart;
+        for (auto &origin: m_channelOrigins) {
+            origin = m_feedStart;
+        }
+        for (auto &cache: m_channelCaches) {
+            cache.recentStart = m_feedStart;
+        }
+        for (auto &gate: m_gates) {
+            gate.recentStart = m_feedStart;
+        }
+        m_startTime = chrono::steady_clock::now();
+        m_clockPaused = false;
+    }
+
+    if (!isAcceptingInput()) {
+        return FeatureSet();
+    }
+
+    if (m_deadline > 0 && getElapsedTime() >= getInputBudget()) {
+#ifdef DEBUG_TUNING_DIFFERENCE
+        cerr << "deadline: stopping input after " << m_frameCount
+             << " blocks" << endl;
+#endif
+        m_inputTruncated = true;
+        return FeatureSet();
+    }
+
+    if (isSampling()) {
+        sampleInput(inputBuffers);
+        ++m_frameCount;
+        return FeatureSet();
+    }
+
+    if (!m_channelCaches.empty()) {
+        lookUpChannelCaches(inputBuffers);
+    }
+    
+    if (m_background) {
+
+        for (int c = 0; c < m_channelCount; ++c) {
+            m_pushBlock.assign(inputBuffers[c], inputBuffers[c] + m_blockSize);
+            while (!m_queues[c]->push(m_pushBlock)) {
+                unique_lock<mutex> lock(m_workMutex);
+                m_spaceAvailable.wait(lock, [&]() {
+                        return !m_queues[c]->isFull();
+                    });
+            }
+            if (!m_draining[c].exchange(true)) {
+                m_scheduler->spawn(m_drainGroup, [this, c]() {
+                        drainQueue(c);
+                    });
+            }
+        }
+
+    } else {
+
+        m_scheduler->run(m_channelCount, [&](int c) {
+                analyseBlock(c, inputBuffers[c]);
+            }, &m_client);
+    }
+    
+    ++m_frameCount;
+
+    if (m_stableDuration > 0 && !m_segmented) {
+        int interval = max(1, int(stableCheckInterval * m_inputSampleRate /
+                                  m_blockSize));
+        if (m_frameCount % interval == 0) {
+            checkStability();
+        }
+    }
+    
+    return FeatureSet();
+}
+
+bool
+TuningDifference::isSampling() const
+{
+    return m_sampleWindow > 0 && m_sampleWindow < m_sampleSpacing &&
+        !m_segmented;
+}
+
+void
+TuningDifference::sampleInput(const float *const *inputBuffers)
+{
+    // Pass on to the current window whatever part of this block lies
+    // within its feed range, starting the next window once it is
+    // done. A block may end one window and begin the next
+
+    int64_t blockStart = m_feedStart + int64_t(m_frameCount) * m_blockSize;
+    int offset = 0;
+
+    while (offset < m_blockSize) {
+
+        if (!m_window) {
+            startWindow(blockStart + offset);
+        }
+
+        int64_t here = blockStart + offset;
+        if (here < m_windowFeedStart) {
+            offset = int(min<int64_t>(m_blockSize,
+                                      m_windowFeedStart - blockStart));
+            continue;
+        }
+
+        int n = int(min<int64_t>(min(m_blockSize - offset,
+                                     m_blockSize - m_windowFill),
+                                 m_windowFeedEnd - here));
+        for (int c = 0; c < m_channelCount; ++c) {
+            copy(inputBuffers[c] + offset, inputBuffers[c] + offset + n,
+                 m_windowBlocks[c].begin() + m_windowFill);
+        }
+        m_windowFill += n;
+        offset += n;
+
+        if (m_windowFill == m_blockSize) {
+            feedWindow();
+        }
+        if (here + n >= m_windowFeedEnd) {
+            finishWindow();
+        }
+    }
+}
+
+void
+TuningDifference::startWindow(int64_t from)
+{
+    // Each window is analysed as a segment (see setSegment) by an
+    // instance of its own, which shares our kernels and so is cheap
+    // to make. If the window would need feeding from before the
+    // input we have already passed, because the spacing is shorter
+    // than the warm-up or the input started late, move it on to the
+    // next position from which it can be fed
+    
+    m_window.reset(new TuningDifference(m_inputSampleRate));
+    for (const auto &p: getParameterDescriptors()) {
+        m_window->setParameter(p.identifier, getParameter(p.identifier));
+    }
+    m_window->setParameter("deadline", 0.f);
+    m_window->setParameter("stable", 0.f);
+    m_window->setParameter("samplewindow", 0.f);
+    m_window->initialise(m_channelCount, m_blockSize, m_blockSize);
+
+    int64_t spacing = int64_t(double(m_sampleSpacing) * m_inputSampleRate);
+    int64_t duration = int64_t(double(m_sampleWindow) * m_inputSampleRate);
+    int64_t start = m_windowIndex * spacing + (spacing - duration) / 2;
+    
+    m_window->setSegment(start, start + duration);
+    int64_t feedStart = m_window->getSegmentFeedStart();
+    if (feedStart < from) {
+        int64_t channelWarmUp = 0, referenceWarmUp = 0;
+        int64_t alignment = m_window->getSegmentAlignment(channelWarmUp,
+                                                          referenceWarmUp);
+        start += ((from - feedStart + alignment - 1) / alignment) * alignment;
+        m_window->setSegment(start, start + duration);
+    }
+
+    m_windowFeedStart = m_window->getSegmentFeedStart();
+    m_windowFeedEnd = m_window->getSegmentFeedEnd();
+    m_windowFed = 0;
+    m_windowFill = 0;
+}
+
+void
+TuningDifference::feedWindow()
+{
+    vector<const float *> buffers;
+    for (const auto &block: m_windowBlocks) {
+        buffers.push_back(block.data());
+    }
+    // Not frame2RealTime, which would truncate a fractional sample
+    // rate and so misplace the window's feed range
+    int64_t ns = llround(double(m_windowFeedStart + m_windowFed) * 1.0e9 /
+                         m_inputSampleRate);
+    m_window->process(buffers.data(),
+                      Vamp::RealTime(int(ns / 1000000000),
+                                     int(ns % 1000000000)));
+    m_windowFed += m_blockSize;
+    m_windowFill = 0;
+}
+
+void
+TuningDifference::finishWindow()
+{
+    // Called at the end of the window's feed range or of the input.
+    // A last partial block is padded with silence, which is either
+    // beyond the end of the input or only warms down columns that
+    // are already in the window
+    
+    if (m_windowFill > 0) {
+        for (auto &block: m_windowBlocks) {
+            fill(block.begin() + m_windowFill, block.end(), 0.f);
+        }
+        feedWindow();
+    }
+    if (m_windowFed > 0) {
+        m_state.merge(m_window->getState());
+    }
+    m_window.reset();
+    ++m_windowIndex;
+}
+
+void
+TuningDifference::checkStability()
+{
+    // Wait for the input so far to be analysed, so as to see every
+    // channel's totals up to the same point. This holds up the host
+    // briefly at each check, but the checks are seconds of input
+    // apart. If a worker has failed, leave it to be reported at the
+    // end
+    
+    finishBackground();
+    {
+        lock_guard<mutex> lock(m_workMutex);
+        if (m_workerFailure) return;
+    }
+
+    vector<TFeature> otherFeatures;
+    for (int c = m_referenceCount; c < m_channelCount; ++c) {
+        otherFeatures.push_back(computeFeatureFromTotals
+                                (m_state.getChannelTotals(c).getTotals(),
+                                 m_frameCount));
+    }
+
+    // The estimate is settled if every channel has the same best
+    // rotation against every reference as at the last check, and
+    // that rotation is clearly better than any other that is not
+    // just a neighbour of it
+
+    vector<int> rotations;
+    bool clear = true;
+    
+    for (int r = 0; r < m_referenceCount; ++r) {
+        TFeature refFeature = computeFeatureFromTotals
+            (m_state.getChannelTotals(r).getTotals(), m_frameCount);
+        int maxRotation = (m_bpo * m_maxSemis) / 12;
+        for (const auto &result: findBestRotations(refFeature, otherFeatures)) {
+            rotations.push_back(result.rotation);
+            double best = result.distances[result.rotation + maxRotation];
+            double next = 0.0;
+            bool found = false;
+            for (int i = 0; i < int(result.distances.size()); ++i) {
+                if (abs(i - maxRotation - result.rotation) <= 1) continue;
+                if (!found || result.distances[i] < next) {
+                    next = result.distances[i];
+                    found = true;
+                }
+            }
+            if (found && !(next - best > next * stableMargin)) {
+                clear = false;
+            }
+        }
+    }
+
+    if (!clear || rotations != m_stableRotations) {
+        m_stableRotations = rotations;
+        m_stableSince = m_frameCount;
+        return;
+    }
+
+    double stableFor = double(m_frameCount - m_stableSince) * m_blockSize /
+        m_inputSampleRate;
+    if (stableFor >= m_stableDuration) {
+#ifdef DEBUG_TUNING_DIFFERENCE
+        cerr << "TuningDifference: Estimate stable for " << stableFor
+             << " seconds, stopping input after " << m_frameCount
+             << " blocks" << endl;
+#endif
+        m_inputTruncated = true;
+    }
+}
+
+bool
+TuningDifference::isAcceptingInput() const
+{
+    if (m_inputTruncated) {
+        return false;
+    }
+    if (m_maxDuration > 0) {
+        // Count blocks from the start of the input, not of the feed,
+        // so that segments and resumed analyses stop at the same point
+        int maxFrames = int((m_maxDuration * m_inputSampleRate) /
+                            float(m_blockSize));
+        if (m_feedStart / m_blockSize + m_frameCount > maxFrames) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TuningDifference::FeatureSet
+TuningDifference::getRemainingFeatures()
+{
+    return getFeaturesForState(getState());
+}
+
+void
+TuningDifference::finishWorkers()
+{
+    finishBackground();
+    if (m_workerFailure) {
+        exception_ptr failure = m_workerFailure;
+        m_workerFailure = nullptr;
+        rethrow_exception(failure);
+    }
+}
+
+TuningState
+TuningDifference::getState()
+{
+    // When sampling, the windows have been analysed separately and
+    // their states merged into ours as each was finished
+    
+    if (isSampling()) {
+        if (m_window) {
+            finishWindow();
+        }
+        return m_state;
+    }
+    
+    finishWorkers();
+
+    for (int c = 0; c < int(m_channelCaches.size()); ++c) {
+        finishChannelCache(c);
+    }
+
+    TuningState state(m_state);
+    state.setFrameCount(m_state.getFrameCount() + getCountedBlocks(INT64_MAX));
+    for (int c = 0; c < m_channelCount; ++c) {
+        state.setGatedFrames(c, m_state.getGatedFrames(c) + m_gatedFrames[c]);
+    }
+    
+    // The fine-tuning search compares the candidates against
+    // reference features computed from the retained, decimated
+    // references at every offset in its range, including zero, so
+    // that they are all computed alike
+
+    if (m_fineTuning && m_frameCount > 0) {
+
+        int searchDistance = getSearchDistance();
+
+        for (int r = 0; r < m_referenceCount; ++r) {
+        
+            vector<ChromaTotals> totals;
+            uint64_t key = 0;
+
+            if (m_cache) {
+                key = getOffsetsCacheKey(r);
+                if (m_cache->loadOffsets(key, totals) &&
+                    int(totals.size()) == searchDistance * 2 + 1 &&
+                    totals[0].getBinCount() == m_bpo) {
+                    for (int c = -searchDistance; c <= searchDistance; ++c) {
+                        state.getReferenceTotals(r, c) =
+                            totals[c + searchDistance];
+                    }
+                    continue;
+                }
+            }
+        
+            finishReference(r);
+            int64_t next = 0;
+            totals = computeReferenceTotals(r, true, next);
+
+            if (totals.empty()) {
+                // Ran out of time: without the totals at every
+                // offset, including any from a checkpoint, the
+                // fine search is skipped for this reference
+                for (int c = -searchDistance; c <= searchDistance; ++c) {
+                    state.getReferenceTotals(r, c) = ChromaTotals(m_bpo);
+                }
+                continue;
+            }
+            
+            for (int c = -searchDistance; c <= searchDistance; ++c) {
+                ChromaTotals &t = state.getReferenceTotals(r, c);
+                t.merge(totals[c + searchDistance]);
+                totals[c + searchDistance] = t;
+            }
+
+            if (m_cache) {
+                m_cache->storeOffsets(key, totals);
+            }
+        }
+    }
+
+    return state;
+}
+
+TuningState
+TuningDifference::getCheckpoint()
+{
+    if (isSampling()) {
+        throw invalid_argument("Cannot checkpoint a sampled analysis");
+    }
+    
+    finishWorkers();
+
+    // A channel whose analysis we are skipping because it matches a
+    // cached profile has to be brought up to date first
+
+    for (int c = 0; c < int(m_channelCaches.size()); ++c) {
+        if (m_channelCaches[c].speculating) {
+            m_channelCaches[c].speculating = false;
+            restartChannel(c);
+        }
+    }
+
+    // Likewise a channel whose gate is closed
+    
+    for (int c = 0; c < int(m_gates.size()); ++c) {
+        ChannelGate &gate = m_gates[c];
+        if (gate.closed) {
+            reopenChannel(c, gate.recentStart + int64_t(gate.recent.size()));
+        }
+    }
+
+    // Every channel has had the same input, so has produced columns
+    // up to the same point, and the next column of each is the first
+    // not yet in our totals. The references at the fine-tuning
+    // offsets are only analysed at the end, so we analyse as much of
+    // them as we can now and add that to our totals in place, so that
+    // we can let go of them up to the warm-up needed for what
+    // remains.
+
+    int64_t resumeFrame = m_segmentStart;
+    if (m_frameCount > 0) {
+        resumeFrame = getNextColumnFrame(0);
+        resumeFrame = min(max(resumeFrame, m_segmentStart), m_segmentEnd);
+    }
+
+    if (m_fineTuning && m_frameCount > 0) {
+
+        // The references have all had the same input, so get as far
+        // as one another
+        
+        int64_t next = 0;
+        int searchDistance = getSearchDistance();
+        for (int r = 0; r < m_referenceCount; ++r) {
+            vector<ChromaTotals> totals =
+                computeReferenceTotals(r, false, next);
+            for (int c = -searchDistance; c <= searchDistance; ++c) {
+                m_state.getReferenceTotals(r, c).merge
+                    (totals[c + searchDistance]);
+            }
+        }
+        m_referenceFrom = min(max(next, m_referenceFrom), m_segmentEnd);
+
+        int64_t channelWarmUp = 0, referenceWarmUp = 0;
+        getSegmentAlignment(channelWarmUp, referenceWarmUp);
+        int ratio = int(m_inputSampleRate) / m_referenceRate;
+        int64_t drop = (m_referenceFrom - referenceWarmUp - m_referenceStart)
+            / ratio;
+        if (drop > int64_t(m_references[0].signal.size())) {
+            drop = m_references[0].signal.size();
+        }
+        if (drop > 0) {
+            for (auto &reference: m_references) {
+                reference.signal.erase(reference.signal.begin(),
+                                       reference.signal.begin() + drop);
+            }
+            m_referenceStart += drop * ratio;
+        }
+    }
+
+    // The gated blocks from the resume frame on will be gated again
+    // (or analysed) by the resumed instance, so are left out. They
+    // are all among those still retained
+
+    TuningState state(m_state);
+    state.setFrameCount(m_state.getFrameCount() +
+                        getCountedBlocks(resumeFrame));
+    for (int c = 0; c < m_channelCount; ++c) {
+        int64_t gated = m_gatedFrames[c];
+        if (c < int(m_gates.size())) {
+            for (int64_t start: m_gates[c].gatedBlocks) {
+                gated -= getSegmentOverlap(max(start, resumeFrame),
+                                           start + m_blockSize);
+            }
+        }
+        state.setGatedFrames(c, m_state.getGatedFrames(c) + gated);
+    }
+    state.setResumeFrames(resumeFrame,
+                          m_fineTuning ? m_referenceFrom : resumeFrame);
+    return state;
+}
+
+void
+TuningDifference::resume(const TuningState &checkpoint)
+{
+    checkStateLayout(checkpoint);
+    if (m_frameCount > 0) {
+        throw invalid_argument("Cannot resume once processing has started");
+    }
+    m_state = checkpoint;
+    m_state.setResumeFrames(0, 0);
+    stopCaching();
+    m_segmented = true;
+    m_segmentStart = checkpoint.getResumeFrame();
+    m_referenceFrom = checkpoint.getReferenceResumeFrame();
+}
+
+void
+TuningDifference::checkStateLayout(const TuningState &state) const
+{
+    if (state.getSampleRate() != m_inputSampleRate ||
+        state.getBinsPerOctave() != m_bpo ||
+        state.getChannelCount() != m_channelCount ||
+        state.getReferenceCount() != m_referenceCount ||
+        state.getSearchDistance() != (m_fineTuning ? getSearchDistance() : 0)) {
+        throw invalid_argument("State does not match plugin configuration");
+    }
+}
+
+TuningDifference::FeatureSet
+TuningDifference::getFeaturesForState(const TuningState &state)
+{
+    checkStateLayout(state);
+    
+    FeatureSet fs;
+    long frameCount = state.getFrameCount();
+    if (frameCount == 0) return fs;
+
+    // A reference has no totals at the fine-tuning offsets if the
+    // deadline left no time to compute them, and is then searched
+    // only coarsely
+    
+    m_refFeatures = vector<map<int, TFeature>>(m_referenceCount);
+    if (m_fineTuning) {
+        int searchDistance = getSearchDistance();
+        for (int r = 0; r < m_referenceCount; ++r) {
+            if (state.getReferenceTotals(r, 0).getColumnCount() == 0) {
+                continue;
+            }
+            for (int c = -searchDistance; c <= searchDistance; ++c) {
+                m_refFeatures[r][c] = computeFeatureFromTotals
+                    (state.getReferenceTotals(r, c).getTotals(), frameCount);
+            }
+        }
+    }
+
+    // refFeatures are used only for the coarse search
+
+    vector<TFeature> refFeatures;
+    for (int r = 0; r < m_referenceCount; ++r) {
+        refFeatures.push_back(computeFeatureFromTotals
+                              (state.getChannelTotals(r).getTotals(),
+                               frameCount));
+    }
+    
+    vector<TFeature> otherFeatures;
+    for (int c = m_referenceCount; c < m_channelCount; ++c) {
+        otherFeatures.push_back(computeFeatureFromTotals
+                                (state.getChannelTotals(c).getTotals(),
+                                 frameCount));
+    }
+
+    // Every other channel is compared against each reference. The
+    // comparisons are finalised concurrently, but the features are
+    // returned ordered by reference and then by channel regardless
+    
+    int others = int(otherFeatures.size());
+    vector<vector<RotationSearch::Result>> rotations;
+    for (int r = 0; r < m_referenceCount; ++r) {
+        rotations.push_back(findBestRotations(refFeatures[r], otherFeatures));
+    }
+
+    vector<ChannelResult> results(m_referenceCount * others);
+
+    m_scheduler->run(int(results.size()), [&](int i) {
+            int r = i / others, o = i % others;
+            results[i] = getRemainingFeaturesForChannel
+                (r, o + m_referenceCount, otherFeatures[o], rotations[r][o]);
+        }, &m_client);
+    
+    Feature f;
+    f.hasTimestamp = true;
+    f.timestamp = Vamp::RealTime::zeroTime;
+    f.values.clear();
+    fs[m_outputs["cents"]].push_back(f);
+    fs[m_outputs["tuningfreq"]].push_back(f);
+    fs[m_outputs["stages"]].push_back(f);
+    fs[m_outputs["probes"]].push_back(f);
+
+    for (int c = 0; c < m_channelCount; ++c) {
+        f.values.push_back(float(state.getGatedFrames(c)));
+    }
+    fs[m_outputs["gated"]].push_back(f);
+    f.values.clear();
+
+    for (int i = 0; i < int(results.size()); ++i) {
+
+        int r = i / others, o = i % others;
+        
+        f.values.clear();
+        for (auto v: refFeatures[r]) f.values.push_back(float(v));
+        fs[m_outputs["reffeature"]].push_back(f);
+
+        f.values.clear();
+        for (auto v: otherFeatures[o]) f.values.push_back(float(v));
+        fs[m_outputs["otherfeature"]].push_back(f); 
+
+        f.values.clear();
+        for (auto v: results[i].rotatedFeature) f.values.push_back(float(v));
+        fs[m_outputs["rotfeature"]].push_back(f);
+
+        fs[m_outputs["cents"]][0].values.push_back(float(results[i].cents));
+        fs[m_outputs["tuningfreq"]][0].values.push_back(float(results[i].hz));
+
+        int stages = (m_inputTruncated || isSampling() ? 0 : 1) +
+            (results[i].fineTuned ? 2 : 0);
+        fs[m_outputs["stages"]][0].values.push_back(float(stages));
+        fs[m_outputs["probes"]][0].values.push_back(float(results[i].probes));
+    }
+
+    return fs;
+}
+
+TuningDifference::ChannelResult
+TuningDifference::getRemainingFeaturesForChannel(int reference,
+                                                 int channel,
+                                                 const TFeature &otherFeature,
+                                                 const RotationSearch::Result &search)
+{
+    ChannelResult result;
+
+    int rotation = search.rotation;
+    int coarseCents = -(rotation * 1200) / m_bpo;
+
+#ifdef DEBUG_TUNING_DIFFERENCE
+    cerr << "channel " << channel;
+    if (m_referenceCount > 1) cerr << " against reference " << reference;
+    cerr << ": rotation " << rotation << " -> cents " << coarseCents << endl;
+#else
+    (void)channel; // reported only in debug builds
+#endif
+
+    result.rotatedFeature = otherFeature;
+    if (rotation != 0) {
+        rotateFeature(result.rotatedFeature, rotation);
+    }
+
+    result.fineTuned = false;
+    result.probes = 0;
+
+    if (!m_refFeatures[reference].empty()) {
+    
+        // Fit a parabola through the coarse distances either side of
+        // the best rotation, to estimate where between rotations the
+        // best match lies. This costs nothing and gives the fine
+        // search a head start.
+
+        int estimate = 0;
+        int k = rotation + (int(search.distances.size()) - 1) / 2;
+        if (k > 0 && k + 1 < int(search.distances.size())) {
+            double below = search.distances[k-1];
+            double here = search.distances[k];
+            double above = search.distances[k+1];
+            double denom = below - 2.0 * here + above;
+            if (denom > 0.0) {
+                double delta = 0.5 * (below - above) / denom;
+                estimate = int(round(-delta * 1200.0 / m_bpo));
+            }
+        }
+        
+        FineResult fine = findFineFrequency
+            (reference, result.rotatedFeature, coarseCents, estimate);
+
+        result.cents = fine.cents;
+        result.hz = fine.hz;
+        result.fineTuned = fine.complete;
+        result.probes = fine.probes;
+    
+#ifdef DEBUG_TUNING_DIFFERENCE
+        cerr << "channel " << channel << ": overall best Hz = " << result.hz << endl;
+#endif
+
+    } else {
+
+        result.cents = coarseCents;
+        result.hz = frequencyForCentsAbove440(coarseCents);
+    }
+
+    return result;
+}
+
+void
+TuningDifference::rotateFeature(TFeature &r, int rotation) const
+{
+    if (rotation < 0) {
+        rotate(r.begin(), r.begin() - rotation, r.end());
+    } else {
+        rotate(r.begin(), r.end() - rotation, r.end());
+    }
+}
+
+double
+TuningDifference::featureDistance(const TFeature &ref,
+                                  const TFeature &other,
+                                  int rotation) const
+{
+    if (rotation == 0) {
+	return distance(ref, other);
+    } else {
+	// A positive rotation pushes the tuning frequency up for this
+	// chroma, negative one pulls it down. If a positive rotation
+	// makes this chroma match an un-rotated reference, then this
+	// chroma must have initially been lower than the reference.
+	TFeature r(other);
+        rotateFeature(r, rotation);
+	return distance(ref, r);
+    }
+}
+
+vector<RotationSearch::Result>
+TuningDifference::findBestRotations(const TFeature &ref,
+                                    const vector<TFeature> &others) const
+{
+    // Equivalent to calling featureDistance for every rotation of
+    // every feature in others and taking the rotation with the
+    // smallest distance, but without making any rotated copies
+
+    int maxRotation = (m_bpo * m_maxSemis) / 12;
+
+    RotationSearch search(m_bpo, maxRotation);
+    
+    return search.search(ref, others);
+}
+
+const TuningDifference::TFeature &
+TuningDifference::getReferenceFeature(int reference, int centsOffset) const
+{
+    // Return the feature of the given reference computed at the
+    // given offset from 440Hz, which must be within the fine-tuning
+    // search range
+
+    return m_refFeatures.at(reference).at(centsOffset);
+}
+
+TuningDifference::FineResult
+TuningDifference::findFineFrequency(int reference,
+                                    const TFeature &rotatedOtherFeature,
+                                    int coarseCents,
+                                    int estimatedOffset)
+{
+    int searchDistance = getSearchDistance();
+
+#ifdef DEBUG_TUNING_DIFFERENCE
+    cerr << "findFineFrequency: coarse frequency is "
+         << frequencyForCentsAbove440(coarseCents) << endl;
+    cerr << "searchDistance = " << searchDistance << endl;
+#endif
+
+    // Score an offset in cents from the coarse frequency, by
+    // comparing the rotated "other" chroma with a reference chroma
+    // shifted by the offset in the opposite direction. Each offset
+    // not yet scored for this channel is a probe. Offsets outside the
+    // search range are never probed, but score as infinitely bad so
+    // that they can act as the ends of a bracket.
+    
+    map<int, double> scores;
+
+    auto score = [&](int offset) -> double {
+        if (offset < -searchDistance || offset > searchDistance) {
+            return HUGE_VAL;
+        }
+        auto itr = scores.find(offset);
+        if (itr != scores.end()) {
+            return itr->second;
+        }
+        const TFeature &compensatedReference =
+            getReferenceFeature(reference, -offset);
+        double s = featureDistance(compensatedReference,
+                                   rotatedOtherFeature,
+                                   0); // we are rotated already
+#ifdef DEBUG_TUNING_DIFFERENCE
+        cerr << "fine offset = " << offset << ", cents = "
+             << coarseCents + offset << ", score " << s << endl;
+#endif
+        scores[offset] = s;
+        return s;
+    };
+
+    // Establish a bracket a < b < c with score(b) below score(a) and
+    // no higher than score(c). We start from the estimated offset,
+    // which is usually the answer: if neither neighbour improves on
+    // it, we're done. Otherwise walk downhill with a step that grows
+    // by the golden ratio until the score rises again or we pass the
+    // end of the search range.
+
+    const double golden = 1.618034;
+
+    // Probes are cheap, but with a deadline we stop at the best
+    // offset found so far once it has passed
+    
+    bool complete = true;
+
+    if (estimatedOffset < -searchDistance) estimatedOffset = -searchDistance;
+    if (estimatedOffset > searchDistance) estimatedOffset = searchDistance;
+    
+    int a = estimatedOffset - 1, b = estimatedOffset, c = estimatedOffset + 1;
+    
+    double sa = score(a), sb = score(b), sc = score(c);
+
+    if (sa < sb || sc < sb) {
+
+        int dir = (sa <= sc ? -1 : 1);
+        int prev = b, cur = b + dir;
+        double scur = (dir < 0 ? sa : sc);
+        int step = 1;
+
+        while (true) {
+            if (isPastDeadline()) {
+                complete = false;
+                b = cur;
+                break;
+            }
+            step = int(step * golden + 0.5);
+            int next = cur + dir * step;
+            if (next > searchDistance + 1) next = searchDistance + 1;
+            if (next < -searchDistance - 1) next = -searchDistance - 1;
+            double snext = score(next);
+            if (snext >= scur) {
+                a = min(prev, next);
+                b = cur;
+                c = max(prev, next);
+                sb = scur;
+                break;
+            }
+            prev = cur;
+            cur = next;
+            scur = snext;
+        }
+
+        // Golden-section search within the bracket, on the integer
+        // offsets, until the bracket cannot be narrowed further
+
+        while (complete && c - a > 2) {
+            if (isPastDeadline()) {
+                complete = false;
+                break;
+            }
+            int x;
+            if (c - b > b - a) {
+                x = b + int((c - b) * (2.0 - golden) + 0.5);
+                if (x >= c) x = c - 1;
+                if (x <= b) x = b + 1;
+            } else {
+                x = b - int((b - a) * (2.0 - golden) + 0.5);
+                if (x <= a) x = a + 1;
+                if (x >= b) x = b - 1;
+            }
+            double sx = score(x);
+            if (sx < sb) {
+                if (x > b) a = b;
+                else c = b;
+                b = x;
+                sb = sx;
+            } else {
+                if (x > b) c = x;
+                else a = x;
+            }
+        }
+    }
+
+    FineResult result;
+    result.cents = coarseCents + b;
+    result.hz = frequencyForCentsAbove440(result.cents);
+    result.probes = int(scores.size());
+    result.complete = complete;
+
+#ifdef DEBUG_TUNING_DIFFERENCE
+    cerr << "findFineFrequency: best offset " << b << " (cents = "
+         << result.cents << ", Hz = " << result.hz << ") after "
+         << result.probes << " probes" << endl;
+#endif
+    
+    return result;
+}
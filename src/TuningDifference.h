@@ -16,12 +16,28 @@
 #include <vamp-sdk/Plugin.h>
 
 #include <cq/Chromagram.h>
+#include <cq/TaskScheduler.h>
+
+#include "RotationSearch.h"
+#include "ChromaTotals.h"
+#include "TuningState.h"
+#include "ProfileCache.h"
+#include "ContentHash.h"
+#include "SPSCQueue.h"
 
 #include <memory>
+#include <deque>
+#include <cstdint>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <chrono>
 
 using std::string;
 using std::vector;
 
+class Resampler;
+
 class TuningDifference : public Vamp::Plugin
 {
 public:
@@ -59,6 +75,100 @@ public:
 
     FeatureSet getRemainingFeatures();
 
+    /**
+     * Return false if any further input passed to process() will be
+     * ignored, because the maximum duration or the share of the
+     * deadline allowed for the input has been reached, or the
+     * estimate has been stable for the stable duration, so that the
+     * caller can stop reading it.
+     */
+    bool isAcceptingInput() const;
+
+    /**
+     * Stop and restart the clock against which any deadline is
+     * measured, for a caller that suspends the analysis between
+     * process() calls, so that the time suspended does not count
+     * against the deadline. Call only between process() calls.
+     */
+    void pauseClock();
+    void resumeClock();
+
+    /**
+     * The following allow a long input to be analysed in segments,
+     * perhaps by separate processes, and the results combined. The
+     * totals for each segment are obtained with getState() in place
+     * of getRemainingFeatures(), and any number of them merged and
+     * passed to getFeaturesForState() on an instance initialised
+     * with the same channel count and parameters.
+     */
+    
+    /**
+     * Count only the chroma columns centred within the given range
+     * of input sample frames. Call before the first process() call
+     * following initialise() or reset(). The timestamps passed to
+     * process() must then be those of the actual input position.
+     *
+     * A partition of the input into segments gives the same totals,
+     * to within rounding, as the input analysed in one piece with a
+     * segment covering all of it, provided each segment is fed from
+     * getSegmentFeedStart() to getSegmentFeedEnd() (or the start and
+     * end of the input, if sooner). The extra input at either side
+     * allows the analysis to warm up and to flush through columns
+     * belonging to the segment.
+     */
+    void setSegment(int64_t startFrame, int64_t endFrame);
+
+    /**
+     * Return the input frame from which to start feeding the current
+     * segment. Call after initialise().
+     */
+    int64_t getSegmentFeedStart() const;
+
+    /**
+     * Return the input frame at which feeding the current segment may
+     * stop. Call after initialise().
+     */
+    int64_t getSegmentFeedEnd() const;
+
+    /**
+     * Return the totals accumulated from the input, instead of
+     * calculating features from them. Call once, after the last
+     * process() call.
+     */
+    TuningState getState();
+
+    /**
+     * Return the totals accumulated so far, as a checkpoint from which
+     * the analysis can be resumed by another instance should this one
+     * not finish. May be called between any two process() calls, and
+     * waits for the input given so far to be analysed; the analysis
+     * then carries on as before. Throw std::invalid_argument when
+     * sampling, as the windows are not checkpointed.
+     */
+    TuningState getCheckpoint();
+
+    /**
+     * Resume from a checkpoint taken by getCheckpoint() on an instance
+     * with the same channel count and parameters. Call after
+     * initialise(), and after setSegment() if the checkpointed
+     * instance was analysing a segment, but before the first
+     * process() call. Then feed from getSegmentFeedStart() onwards as
+     * for a segment, and the results will be those of the original
+     * instance had it run to the end. reset() discards the totals
+     * from the checkpoint. Throw std::invalid_argument if the
+     * checkpoint does not match this plugin's channel count and
+     * parameters.
+     */
+    void resume(const TuningState &checkpoint);
+
+    /**
+     * Calculate the features that getRemainingFeatures() would
+     * return for the given state. Throw std::invalid_argument if the
+     * state does not match this plugin's channel count and
+     * parameters.
+     */
+    FeatureSet getFeaturesForState(const TuningState &state);
+
 protected:
     typedef vector<float> Signal;
     typedef vector<double> TFeature;
@@ -70,24 +180,249 @@ protected:
     float m_maxDuration;
     int m_maxSemis;
     bool m_fineTuning;
+    bool m_background;
+    bool m_parallelOctaves;
+    int m_referenceCount;
+    float m_deadline;
+    float m_stableDuration;
+    float m_sampleWindow;
+    float m_sampleSpacing;
+    float m_silenceGate;
+
+    // With a deadline, the clock starts at the first process() call
+    // after initialise() or reset(). Input is analysed only until the
+    // share of the deadline left for it has passed, and the fine
+    // search is skipped or cut short if the rest runs out, the
+    // "stages" output saying which of these happened
+    std::chrono::steady_clock::time_point m_startTime;
+    std::chrono::steady_clock::time_point m_pausedAt;
+    bool m_clockPaused;
+    bool m_inputTruncated;
+    double getElapsedTime() const;
+    bool isPastDeadline() const;
+    double getInputBudget() const;
+
+    // With a stable duration, the coarse estimate is checked at
+    // intervals during the input, and the input is truncated once
+    // the best rotations of every channel have been the same, and
+    // clear of the alternatives, at every check since m_stableSince
+    // for that long
+    std::vector<int> m_stableRotations;
+    int m_stableSince;
+    void checkStability();
 
+    // When sampling, only a window of m_sampleWindow seconds from
+    // each m_sampleSpacing of input is analysed, each as a segment
+    // by an instance of its own, m_window, whose state is merged
+    // into m_state when the window is done. The input within the
+    // window's feed range is gathered into whole blocks for it in
+    // m_windowBlocks
+    std::unique_ptr<TuningDifference> m_window;
+    int m_windowIndex;
+    int64_t m_windowFeedStart;
+    int64_t m_windowFeedEnd;
+    int64_t m_windowFed;
+    int m_windowFill;
+    std::vector<Signal> m_windowBlocks;
+    bool isSampling() const;
+    void sampleInput(const float *const *inputBuffers);
+    void startWindow(int64_t from);
+    void feedWindow();
+    void finishWindow();
+
+    // With a silence gate, each channel has a ChannelGate, touched
+    // only by the task analysing the channel, which retains enough
+    // recent input to restart the analysis when the gate reopens.
+    // The levels are mean squares
+    struct ChannelGate {
+        ChannelGate() :
+            closed(false), quiet(0), closedFrom(0), recentStart(0) { }
+        bool closed;
+        int64_t quiet;      // frames since the last block above threshold
+        int64_t closedFrom; // first column frame not counted when closed
+        std::deque<float> recent;
+        int64_t recentStart;
+        std::deque<int64_t> gatedBlocks; // starts, while still retained
+    };
+    std::vector<ChannelGate> m_gates;
+    std::vector<int64_t> m_gatedFrames;
+    double m_gateCloseLevel;
+    double m_gateOpenLevel;
+    int64_t m_gateCapacity;
+    void analyseGated(int channel, const float *data);
+    void reopenChannel(int channel, int64_t from);
+
+    // Each channel's totals are added to only by the one task
+    // analysing that channel at a time, column by column in time
+    // order, so they come out the same for any number of threads
     std::unique_ptr<Chromagram> m_refChroma;
-    TFeature m_refTotals;
-    std::map<int, TFeature> m_refFeatures; // map from cents-offset to feature
-    Signal m_reference; // we have to retain this when fine-tuning is enabled
+    TuningState m_state;
+
+    // The segment of input to count columns from, which is all of
+    // it unless m_segmented, and the input position at which feeding
+    // started. Each channel numbers its columns from there to find
+    // their positions. The reference is counted at the fine-tuning
+    // offsets from m_referenceFrom, which differs from the segment
+    // start after a checkpoint.
+    bool m_segmented;
+    int64_t m_segmentStart;
+    int64_t m_segmentEnd;
+    int64_t m_referenceFrom;
+    int64_t m_feedStart;
+    std::vector<long> m_columnCounts;
+    int getSearchDistance() const;
+    int64_t getSegmentAlignment(int64_t &channelWarmUp,
+                                int64_t &referenceWarmUp) const;
+    void addColumns(ChromaTotals &totals, const CQBase::RealBlock &block,
+                    long &columnCount, int64_t origin, int64_t from,
+                    int64_t to, int hop, int latency, int ratio) const;
+    int64_t getSegmentOverlap(int64_t from, int64_t to) const;
+    long getCountedBlocks(int64_t to) const;
+    void checkStateLayout(const TuningState &state) const;
+    void finishWorkers();
+
+    // Each channel's analysis starts at input frame m_channelOrigins
+    // and counts columns from m_channelFrom as well as from the
+    // segment start. These are the feed start and the start of the
+    // input unless the channel has been restarted part way through
+    std::vector<int64_t> m_channelOrigins;
+    std::vector<int64_t> m_channelFrom;
+    int64_t getNextColumnFrame(int channel) const;
+    void analyseInput(int channel, const CQBase::RealSequence &input);
+
+    // Cached profiles (see ProfileCache), used when the
+    // TUNING_DIFFERENCE_CACHE environment variable names a directory
+    // and we are analysing the whole input. There is a ChannelCache
+    // for each channel, which hashes its input chunk by chunk. We
+    // skip analysing the channel for as long as its chunks match
+    // those of any of the candidate entries filed by its first chunk,
+    // retaining just enough recent input to restart the analysis from
+    // the end of the last matching chunk (or from the start) should
+    // none match. Entries are found by content alone, so a recording
+    // is recognised whichever channel it appears in. Each reference's
+    // totals at the fine-tuning offsets are cached by the hash of
+    // its whole content, so are only known to apply once the whole
+    // input has matched. A reference channel therefore goes on being
+    // decimated and retained while it matches: a mismatch in its last
+    // chunk would otherwise leave nothing to compute them from. What
+    // a hit saves is the analysis of the retained reference at every
+    // offset, by far the larger cost. The candidates are loaded by
+    // process(), which hashes the first chunk itself for the purpose,
+    // before it hands on the block that completes it, so that no file
+    // is read from the channels' analysis tasks; the entries are
+    // stored from getState().
+    struct ChannelCache {
+        ChannelCache() : blocks(0), speculating(true), recentStart(0) { }
+        ContentHash chunkHash;
+        ContentHash contentHash;
+        long blocks;
+        ProfileCache::ChannelEntry recorded;
+        std::vector<ProfileCache::ChannelEntry> candidates;
+        bool speculating;
+        std::deque<float> recent;
+        int64_t recentStart;
+    };
+    std::unique_ptr<ProfileCache> m_cache;
+    std::vector<ChannelCache> m_channelCaches;
+    std::vector<ContentHash> m_firstChunkHashes; // used by process() only
+    int m_cacheChunkBlocks;
+    uint64_t getChannelCacheKey(uint64_t firstChunkHash) const;
+    uint64_t getOffsetsCacheKey(int reference) const;
+    void lookUpChannelCaches(const float *const *inputBuffers);
+    void updateChannelCache(int channel, const float *data);
+    void restartChannel(int channel);
+    void finishChannelCache(int channel);
+    void stopCaching();
+
+    // per reference, map from cents-offset to reference feature, for
+    // the fine search, filled from the state before the channels are
+    // finished
+    std::vector<std::map<int, TFeature>> m_refFeatures;
+    
+    // We have to retain the reference channels when fine-tuning is
+    // enabled. They are kept decimated to m_referenceRate, which is
+    // just high enough for the analysed band, rather than at the
+    // input rate, and all start at input frame m_referenceStart,
+    // which is moved on at each checkpoint
+    struct RetainedReference {
+        Signal signal;
+        int dropped = 0;
+        std::unique_ptr<Resampler> resampler; // complete only in the .cpp
+    };
+    std::vector<RetainedReference> m_references;
+    int64_t m_referenceStart;
+    int m_referenceRate;
+    void appendToReference(int reference, const float *data, int n);
+    void finishReference(int reference);
+    int getReferenceRate() const;
+    std::vector<ChromaTotals> computeReferenceTotals(int reference,
+                                                     bool complete,
+                                                     int64_t &next) const;
+
+    // With a deadline, a chromagram at the fine-tuning offsets, never
+    // used, but kept so that the kernels it shares with those made to
+    // analyse the references (see CQKernel::getShared) are generated
+    // in reset(), before the clock starts, instead of at the end
+    std::unique_ptr<Chromagram> m_offsetsChroma;
+    
     std::vector<std::shared_ptr<Chromagram>> m_otherChroma;
-    std::vector<TFeature> m_otherTotals;
 
+    // All analysis runs as tasks on the process-wide scheduler: a
+    // task per channel per block, each split further by the
+    // constant-Q into tasks per octave and per hop. Tasks are queued
+    // on behalf of m_client, so that other instances sharing the
+    // scheduler get their turn however many channels we have
+    TaskScheduler *m_scheduler;
+    TaskScheduler::Client m_client;
+    
+    // Background analysis: process() hands each channel's block to
+    // that channel's queue, and a drain task, of which there is at
+    // most one per channel at a time, analyses it from there
+    std::vector<std::unique_ptr<SPSCQueue<Signal>>> m_queues;
+    std::vector<std::atomic<bool>> m_draining;
+    TaskScheduler::Group m_drainGroup;
+    std::mutex m_workMutex;
+    std::condition_variable m_spaceAvailable;
+    std::exception_ptr m_workerFailure;
+    Signal m_pushBlock;
+    void drainQueue(int channel);
+    void finishBackground();
+
+    void analyseBlock(int channel, const float *data);
+    
     Chromagram::Parameters paramsForTuningFrequency(double hz) const;
-    TFeature computeFeatureFromTotals(const TFeature &totals) const;
-    TFeature computeFeatureFromSignal(const Signal &signal, double hz) const;
+    Chromagram::Parameters paramsForTuningFrequency(double hz,
+                                                    double sampleRate) const;
+    TFeature computeFeatureFromTotals(const TFeature &totals,
+                                      long frameCount) const;
+    std::vector<Chromagram::Parameters> referenceOffsetParams() const;
     void rotateFeature(TFeature &feature, int rotation) const;
     double featureDistance(const TFeature &ref, const TFeature &other,
                            int rotation) const;
-    int findBestRotation(const TFeature &ref, const TFeature &other) const;
-    std::pair<int, double> findFineFrequency(const TFeature &rotated,
-                                             int coarseCents);
-    void getRemainingFeaturesForChannel(int channel, FeatureSet &fs);
+    std::vector<RotationSearch::Result> findBestRotations
+    (const TFeature &ref, const std::vector<TFeature> &others) const;
+    const TFeature &getReferenceFeature(int reference,
+                                        int centsOffset) const;
+
+    struct FineResult {
+        int cents;
+        double hz;
+        int probes; // number of offsets scored to obtain this result
+        bool complete; // false if the search was cut short by the deadline
+    };
+    FineResult findFineFrequency(int reference, const TFeature &rotated,
+                                 int coarseCents, int estimatedOffset);
+
+    struct ChannelResult {
+        TFeature rotatedFeature;
+        int cents;
+        double hz;
+        bool fineTuned;
+        int probes;
+    };
+    ChannelResult getRemainingFeaturesForChannel
+    (int reference, int channel, const TFeature &otherFeature,
+     const RotationSearch::Result &search);
 
     mutable std::map<string, int> m_outputs;
 };
@@ -0,0 +1,61 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#include "TuningMatrix.h"
+#include "RotationSearch.h"
+
+#include <cq/TaskScheduler.h>
+
+#include <stdexcept>
+
+using namespace std;
+
+TuningMatrix::TuningMatrix(int binsPerOctave, int maxSemis) :
+    m_bpo(binsPerOctave),
+    m_maxRotation((binsPerOctave * maxSemis) / 12)
+{
+    if (binsPerOctave < 1 || maxSemis < 0) {
+        throw invalid_argument("Invalid bins-per-octave or maximum range");
+    }
+}
+
+vector<vector<TuningMatrix::Entry>>
+TuningMatrix::compute(const vector<Feature> &profiles,
+                      TaskScheduler *scheduler) const
+{
+    if (!scheduler) {
+        scheduler = TaskScheduler::getGlobal();
+    }
+
+    // Lay the profiles out once, and search them all against each
+    // profile in turn as reference, one row of the matrix per task
+
+    RotationSearch search(m_bpo, m_maxRotation);
+    RotationSearch::Candidates candidates = search.prepare(profiles);
+
+    const int n = int(profiles.size());
+    vector<vector<Entry>> matrix(n, vector<Entry>(n));
+
+    scheduler->run(n, [&](int i) {
+            vector<RotationSearch::Result> results =
+                search.search(profiles[i], candidates);
+            for (int j = 0; j < n; ++j) {
+                const RotationSearch::Result &r = results[j];
+                Entry &e = matrix[i][j];
+                e.rotation = r.rotation;
+                e.cents = -(r.rotation * 1200) / m_bpo;
+                e.distance = r.distances[r.rotation + m_maxRotation];
+            }
+        });
+
+    return matrix;
+}
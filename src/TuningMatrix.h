@@ -0,0 +1,77 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#ifndef TUNING_MATRIX_H
+#define TUNING_MATRIX_H
+
+#include <vector>
+
+class TaskScheduler;
+
+/**
+ * Compare every one of a set of chroma profiles against every other,
+ * for finding the tuning differences among several recordings when
+ * none of them is a trusted reference. The profiles are normalised
+ * chroma features as computed by the plugin, for example taken from
+ * a ProfileIndex, so no audio is analysed.
+ *
+ * Each comparison is the plugin's coarse search: the best rotation
+ * within the maximum range in semitones, by L1 distance, as found by
+ * RotationSearch. The fine search needs the reference analysed at
+ * each tuning offset, which a profile does not hold, so the results
+ * have the coarse resolution of 1200 / binsPerOctave cents.
+ */
+class TuningMatrix
+{
+public:
+    typedef std::vector<double> Feature;
+
+    TuningMatrix(int binsPerOctave, int maxSemis);
+
+    struct Entry {
+        /**
+         * Rotation of the other profile that best matches the
+         * reference, as found by RotationSearch.
+         */
+        int rotation;
+
+        /**
+         * The tuning of the other profile relative to the reference,
+         * in cents, as the plugin reports it before the fine search.
+         */
+        int cents;
+
+        /**
+         * L1 distance between the reference and the rotated profile.
+         */
+        double distance;
+    };
+
+    /**
+     * Compare every profile against every other, returning a matrix
+     * in which element [i][j] is the result for profile j compared
+     * against profile i as reference. The rows are computed in
+     * parallel on the given scheduler, or on the process-wide one
+     * if none is given. The result does not depend on the number of
+     * threads. Throw std::invalid_argument if any profile has the
+     * wrong number of bins.
+     */
+    std::vector<std::vector<Entry>>
+    compute(const std::vector<Feature> &profiles,
+            TaskScheduler *scheduler = 0) const;
+
+private:
+    int m_bpo;
+    int m_maxRotation;
+};
+
+#endif
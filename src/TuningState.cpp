@@ -0,0 +1,205 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#include "TuningState.h"
+#include "BinaryIO.h"
+
+#include <fstream>
+#include <stdexcept>
+
+using namespace std;
+using namespace BinaryIO;
+
+static const char *const magic = "TDSTATE1";
+
+TuningState::TuningState() :
+    m_sampleRate(0),
+    m_bpo(0),
+    m_searchDistance(0),
+    m_frameCount(0),
+    m_resumeFrame(0),
+    m_referenceResumeFrame(0)
+{
+}
+
+TuningState::TuningState(double sampleRate, int binsPerOctave, int channels,
+                         int searchDistance, int references) :
+    m_sampleRate(sampleRate),
+    m_bpo(binsPerOctave),
+    m_searchDistance(searchDistance),
+    m_frameCount(0),
+    m_resumeFrame(0),
+    m_referenceResumeFrame(0),
+    m_gatedFrames(channels, 0),
+    m_channels(channels, ChromaTotals(binsPerOctave))
+{
+    if (channels < 1 || searchDistance < 0 ||
+        references < 1 || references > channels) {
+        throw invalid_argument("Invalid channel count, search distance or "
+                               "reference count");
+    }
+    m_offsets.resize(references);
+    if (searchDistance > 0) {
+        for (auto &offsets: m_offsets) {
+            for (int c = -searchDistance; c <= searchDistance; ++c) {
+                offsets[c] = ChromaTotals(binsPerOctave);
+            }
+        }
+    }
+}
+
+ChromaTotals &
+TuningState::getChannelTotals(int channel)
+{
+    return m_channels.at(channel);
+}
+
+const ChromaTotals &
+TuningState::getChannelTotals(int channel) const
+{
+    return m_channels.at(channel);
+}
+
+ChromaTotals &
+TuningState::getReferenceTotals(int reference, int centsOffset)
+{
+    return m_offsets.at(reference).at(centsOffset);
+}
+
+const ChromaTotals &
+TuningState::getReferenceTotals(int reference, int centsOffset) const
+{
+    return m_offsets.at(reference).at(centsOffset);
+}
+
+void
+TuningState::merge(const TuningState &other)
+{
+    if (other.m_sampleRate != m_sampleRate ||
+        other.m_bpo != m_bpo ||
+        other.m_searchDistance != m_searchDistance ||
+        other.m_channels.size() != m_channels.size() ||
+        other.m_offsets.size() != m_offsets.size()) {
+        throw invalid_argument("Cannot merge states with different layouts");
+    }
+
+    m_frameCount += other.m_frameCount;
+    m_resumeFrame = other.m_resumeFrame;
+    m_referenceResumeFrame = other.m_referenceResumeFrame;
+    for (int c = 0; c < int(m_channels.size()); ++c) {
+        m_gatedFrames[c] += other.m_gatedFrames[c];
+        m_channels[c].merge(other.m_channels[c]);
+    }
+    for (int r = 0; r < int(m_offsets.size()); ++r) {
+        for (auto &o: m_offsets[r]) {
+            o.second.merge(other.m_offsets[r].at(o.first));
+        }
+    }
+}
+
+void
+TuningState::write(ostream &out) const
+{
+    out.write(magic, 8);
+    writeDouble(out, m_sampleRate);
+    writeInt64(out, m_bpo);
+    writeInt64(out, m_searchDistance);
+    writeInt64(out, int64_t(m_channels.size()));
+    writeInt64(out, int64_t(m_offsets.size()));
+    writeInt64(out, m_frameCount);
+    writeInt64(out, m_resumeFrame);
+    writeInt64(out, m_referenceResumeFrame);
+    for (auto frames: m_gatedFrames) {
+        writeInt64(out, frames);
+    }
+    for (const auto &c: m_channels) {
+        c.write(out);
+    }
+    for (const auto &offsets: m_offsets) {
+        for (const auto &o: offsets) {
+            o.second.write(out);
+        }
+    }
+    if (!out) {
+        throw runtime_error("Failed to write tuning state");
+    }
+}
+
+void
+TuningState::read(istream &in)
+{
+    char m[8];
+    if (!in.read(m, 8) || string(m, 8) != magic) {
+        throw runtime_error("Not a tuning state file");
+    }
+
+    double sampleRate = readDouble(in);
+    int64_t bpo = readInt64(in);
+    int64_t searchDistance = readInt64(in);
+    int64_t channels = readInt64(in);
+    int64_t references = readInt64(in);
+    int64_t frameCount = readInt64(in);
+
+    if (bpo < 1 || bpo > 100000 ||
+        searchDistance < 0 || searchDistance > 100000 ||
+        channels < 1 || channels > 100000 ||
+        references < 1 || references > channels) {
+        throw runtime_error("Invalid layout in tuning state file");
+    }
+
+    TuningState state(sampleRate, int(bpo), int(channels),
+                      int(searchDistance), int(references));
+    state.m_frameCount = long(frameCount);
+    state.m_resumeFrame = readInt64(in);
+    state.m_referenceResumeFrame = readInt64(in);
+    for (auto &frames: state.m_gatedFrames) {
+        frames = readInt64(in);
+    }
+
+    for (auto &c: state.m_channels) {
+        c.read(in);
+        if (c.getBinCount() != bpo) {
+            throw runtime_error("Inconsistent bin count in tuning state file");
+        }
+    }
+    for (auto &offsets: state.m_offsets) {
+        for (auto &o: offsets) {
+            o.second.read(in);
+            if (o.second.getBinCount() != bpo) {
+                throw runtime_error
+                    ("Inconsistent bin count in tuning state file");
+            }
+        }
+    }
+
+    *this = state;
+}
+
+void
+TuningState::save(string filename) const
+{
+    ofstream out(filename, ios::binary);
+    if (!out) {
+        throw runtime_error("Failed to open " + filename + " for writing");
+    }
+    write(out);
+}
+
+void
+TuningState::load(string filename)
+{
+    ifstream in(filename, ios::binary);
+    if (!in) {
+        throw runtime_error("Failed to open " + filename + " for reading");
+    }
+    read(in);
+}
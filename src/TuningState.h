@@ -0,0 +1,136 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+  Centre for Digital Music, Queen Mary University of London.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License as
+  published by the Free Software Foundation; either version 2 of the
+  License, or (at your option) any later version.  See the file
+  COPYING included with this distribution for more information.
+*/
+
+#ifndef TUNING_STATE_H
+#define TUNING_STATE_H
+
+#include "ChromaTotals.h"
+
+#include <vector>
+#include <map>
+#include <string>
+#include <iosfwd>
+#include <cstdint>
+
+/**
+ * Everything the tuning-difference calculation needs to know about
+ * its input once the input has been analysed: the chroma totals for
+ * every channel and, if fine tuning is enabled, for each reference
+ * channel analysed at each tuning offset in the fine search range.
+ *
+ * States obtained from separate parts of the same input can be
+ * merged, and the result is the same (to within rounding) as the
+ * state of the whole input analysed at once. A state taken part way
+ * through an analysis serves as a checkpoint from which another
+ * instance can resume. States can be saved to and loaded from a
+ * compact, portable file.
+ */
+class TuningState
+{
+public:
+    TuningState();
+
+    /**
+     * Construct an empty state for the given analysis layout, in
+     * which the first references channels are references. A
+     * searchDistance of zero means no fine-tuning offsets are kept.
+     */
+    TuningState(double sampleRate, int binsPerOctave, int channels,
+                int searchDistance, int references = 1);
+
+    double getSampleRate() const { return m_sampleRate; }
+    int getBinsPerOctave() const { return m_bpo; }
+    int getChannelCount() const { return int(m_channels.size()); }
+    int getSearchDistance() const { return m_searchDistance; }
+    int getReferenceCount() const { return int(m_offsets.size()); }
+
+    /**
+     * Number of input blocks analysed, summed over merged states.
+     */
+    long getFrameCount() const { return m_frameCount; }
+    void setFrameCount(long count) { m_frameCount = count; }
+
+    /**
+     * Number of input frames of a channel that the silence gate kept
+     * from being analysed, summed over merged states.
+     */
+    int64_t getGatedFrames(int channel) const {
+        return m_gatedFrames.at(channel);
+    }
+    void setGatedFrames(int channel, int64_t frames) {
+        m_gatedFrames.at(channel) = frames;
+    }
+
+    /**
+     * For a checkpoint of an analysis in progress, the input frames
+     * from which the remaining columns of the channels, and of the
+     * reference at the fine-tuning offsets, are still to be counted.
+     * See TuningDifference::getCheckpoint().
+     */
+    int64_t getResumeFrame() const { return m_resumeFrame; }
+    int64_t getReferenceResumeFrame() const { return m_referenceResumeFrame; }
+    void setResumeFrames(int64_t frame, int64_t referenceFrame) {
+        m_resumeFrame = frame;
+        m_referenceResumeFrame = referenceFrame;
+    }
+
+    /**
+     * Totals for a channel, with channels 0 to getReferenceCount()-1
+     * being the references.
+     */
+    ChromaTotals &getChannelTotals(int channel);
+    const ChromaTotals &getChannelTotals(int channel) const;
+
+    /**
+     * Totals for a reference channel analysed with its tuning
+     * shifted by the given number of cents, which must be within
+     * the search distance.
+     */
+    ChromaTotals &getReferenceTotals(int reference, int centsOffset);
+    const ChromaTotals &getReferenceTotals(int reference,
+                                           int centsOffset) const;
+
+    /**
+     * Merge another state, which must have the same layout, into
+     * this one. States should be merged in time order: the result
+     * takes the resume frames of the one merged in. Throw
+     * std::invalid_argument if the layouts differ.
+     */
+    void merge(const TuningState &other);
+
+    /**
+     * Write or read the state in binary form. Throw
+     * std::runtime_error on failure.
+     */
+    void write(std::ostream &out) const;
+    void read(std::istream &in);
+
+    /**
+     * Save to or load from a file. Throw std::runtime_error on
+     * failure.
+     */
+    void save(std::string filename) const;
+    void load(std::string filename);
+
+private:
+    double m_sampleRate;
+    int m_bpo;
+    int m_searchDistance;
+    long m_frameCount;
+    int64_t m_resumeFrame;
+    int64_t m_referenceResumeFrame;
+    std::vector<int64_t> m_gatedFrames;
+    std::vector<ChromaTotals> m_channels;
+    std::vector<std::map<int, ChromaTotals>> m_offsets;
+};
+
+#endif
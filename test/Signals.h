@@ -0,0 +1,41 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+#ifndef TUNING_DIFFERENCE_TEST_SIGNALS_H
+#define TUNING_DIFFERENCE_TEST_SIGNALS_H
+
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+// Test input: chords of three tones with a few harmonics each,
+// changing every half second, tuned the given number of cents from
+// A=440Hz, plus a little noise from the given seed
+
+static std::vector<float>
+synthesise(double sampleRate, double duration, double cents, unsigned seed)
+{
+    static const int notes[] = {
+        60, 64, 67, 72, 62, 65, 69, 74, 59, 62, 67, 71, 57, 60, 64, 69
+    };
+
+    int n = int(sampleRate * duration);
+    std::vector<float> out(n, 0.f);
+    srand(seed);
+
+    for (int i = 0; i < n; ++i) {
+        double t = i / sampleRate;
+        int chord = int(t / 0.5);
+        for (int v = 0; v < 3; ++v) {
+            int pitch = notes[(chord * 3 + v * 5) % 16];
+            double f = 440.0 * pow(2.0, (pitch - 69 + cents / 100.0) / 12.0);
+            for (int h = 1; h <= 4; ++h) {
+                out[i] += float(0.1 / h * sin(2 * M_PI * f * h * t));
+            }
+        }
+        out[i] += float(0.001 * (rand() / double(RAND_MAX) - 0.5));
+    }
+
+    return out;
+}
+
+#endif
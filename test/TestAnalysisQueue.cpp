@@ -0,0 +1,177 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+#include "src/AnalysisQueue.h"
+
+#include "Signals.h"
+
+#include <cmath>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <algorithm>
+#include <stdexcept>
+
+using std::vector;
+using std::string;
+using std::min;
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(TestAnalysisQueue)
+
+static const double sampleRate = 11025;
+static const double duration = 10;
+
+static const vector<vector<float>> &
+input()
+{
+    static vector<vector<float>> channels =
+        { synthesise(sampleRate, duration, 0, 1),
+          synthesise(sampleRate, duration, 37, 2) };
+    return channels;
+}
+
+// A source reading the test input from the frame it is told to start
+// at, calling the given function with the index of each block before
+// supplying it
+
+static AnalysisQueue::Request
+makeRequest(std::function<void(int)> onBlock = {})
+{
+    auto frame = std::make_shared<int64_t>(0);
+    auto blocks = std::make_shared<int>(0);
+
+    AnalysisQueue::Request request;
+    request.sampleRate = float(sampleRate);
+    request.channels = 2;
+    request.seek = [=](int64_t start, int64_t) { *frame = start; };
+    request.source = [=](vector<vector<float>> &buffers) {
+        if (onBlock) onBlock((*blocks)++);
+        const vector<vector<float>> &channels = input();
+        int64_t n = int64_t(channels[0].size());
+        int count = int(min<int64_t>(AnalysisQueue::blockSize,
+                                     std::max<int64_t>(0, n - *frame)));
+        for (int c = 0; c < 2; ++c) {
+            std::copy(channels[c].begin() + *frame,
+                      channels[c].begin() + *frame + count,
+                      buffers[c].begin());
+        }
+        *frame += count;
+        return count;
+    };
+    return request;
+}
+
+static void
+checkResultsEqual(const AnalysisQueue::Result &a,
+                  const AnalysisQueue::Result &b)
+{
+    BOOST_CHECK(a.cents == b.cents);
+    BOOST_CHECK(a.frequencies == b.frequencies);
+    BOOST_CHECK(a.stages == b.stages);
+}
+
+BOOST_AUTO_TEST_CASE(result)
+{
+    AnalysisQueue queue;
+    AnalysisQueue::Result result = queue.submit(makeRequest()).result.get();
+    BOOST_REQUIRE_EQUAL(result.cents.size(), 1);
+    BOOST_CHECK_SMALL(result.cents[0] - 37.f, 1.5f);
+    BOOST_REQUIRE_EQUAL(result.frequencies.size(), 1);
+    BOOST_CHECK_CLOSE(result.frequencies[0],
+                      440.f * pow(2.f, result.cents[0] / 1200.f), 1e-3);
+    BOOST_REQUIRE_EQUAL(result.gatedFrames.size(), 2);
+    BOOST_CHECK_EQUAL(result.state.getChannelCount(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(priority)
+{
+    // With one job running at a time, a job of higher priority
+    // submitted while another runs must finish before the other
+    // continues, and the interrupted job's results must be those it
+    // gets uninterrupted
+
+    AnalysisQueue queue(1);
+
+    std::mutex mutex;
+    vector<string> events;
+    auto log = [&](string event) {
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back(event);
+    };
+
+    AnalysisQueue::Job urgent;
+    AnalysisQueue::Job slow = queue.submit(makeRequest([&](int block) {
+                if (block == 10) {
+                    AnalysisQueue::Request request = makeRequest();
+                    AnalysisQueue::Source source = request.source;
+                    request.source = [=](vector<vector<float>> &buffers) {
+                        int n = source(buffers);
+                        if (n < AnalysisQueue::blockSize) log("urgent");
+                        return n;
+                    };
+                    urgent = queue.submit(request, 1);
+                }
+                if (block == 11) log("slow");
+            }));
+
+    AnalysisQueue::Result slowResult = slow.result.get();
+    AnalysisQueue::Result urgentResult = urgent.result.get();
+
+    BOOST_REQUIRE_EQUAL(events.size(), 2);
+    BOOST_CHECK_EQUAL(events[0], "urgent");
+    BOOST_CHECK_EQUAL(events[1], "slow");
+
+    checkResultsEqual(slowResult, urgentResult);
+}
+
+BOOST_AUTO_TEST_CASE(cancel)
+{
+    AnalysisQueue queue(1);
+
+    // The first job is cancelled from its own source while running,
+    // and the second while it is still waiting
+
+    AnalysisQueue::Job running;
+    running = queue.submit(makeRequest([&](int block) {
+                if (block == 5) queue.cancel(running.id);
+            }));
+    AnalysisQueue::Job waiting = queue.submit(makeRequest());
+    BOOST_CHECK(queue.cancel(waiting.id));
+
+    BOOST_CHECK_THROW(running.result.get(), AnalysisQueue::Cancelled);
+    BOOST_CHECK_THROW(waiting.result.get(), AnalysisQueue::Cancelled);
+
+    AnalysisQueue::Job finished = queue.submit(makeRequest());
+    finished.result.get();
+    BOOST_CHECK(!queue.cancel(finished.id));
+    BOOST_CHECK(!queue.cancel(0));
+}
+
+BOOST_AUTO_TEST_CASE(invalid)
+{
+    AnalysisQueue queue;
+
+    AnalysisQueue::Request request = makeRequest();
+    request.channels = 1;
+    BOOST_CHECK_THROW(queue.submit(request).result.get(),
+                      std::invalid_argument);
+
+    request = makeRequest();
+    request.source = AnalysisQueue::Source();
+    BOOST_CHECK_THROW(queue.submit(request).result.get(),
+                      std::invalid_argument);
+
+    request = makeRequest();
+    request.source = [](vector<vector<float>> &) { return -1; };
+    BOOST_CHECK_THROW(queue.submit(request).result.get(),
+                      std::runtime_error);
+
+    // The queue carries on after them
+    BOOST_CHECK_NO_THROW(queue.submit(makeRequest()).result.get());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,144 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+#include "src/ChromaTotals.h"
+
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+using std::vector;
+using std::string;
+using std::istringstream;
+using std::ostringstream;
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(TestChromaTotals)
+
+static const int bins = 4;
+
+static ChromaTotals::Column
+makeColumn(double base)
+{
+    ChromaTotals::Column column(bins);
+    for (int i = 0; i < bins; ++i) {
+        column[i] = base * (i + 1);
+    }
+    return column;
+}
+
+BOOST_AUTO_TEST_CASE(compensated)
+{
+    // Each small value is below half a unit in the last place of the
+    // large one, so would be lost entirely from a naive sum
+
+    ChromaTotals totals(bins);
+    totals.add(makeColumn(1e16));
+    for (int i = 0; i < 1000; ++i) {
+        totals.add(makeColumn(0.25));
+    }
+    BOOST_CHECK_EQUAL(totals.getColumnCount(), 1001);
+    vector<double> t = totals.getTotals();
+    for (int i = 0; i < bins; ++i) {
+        BOOST_CHECK_EQUAL(t[i], 1e16 * (i + 1) + 250.0 * (i + 1));
+    }
+
+    // and likewise a large value added to many small ones
+
+    ChromaTotals reversed(bins);
+    for (int i = 0; i < 1000; ++i) {
+        reversed.add(makeColumn(0.25));
+    }
+    reversed.add(makeColumn(1e16));
+    BOOST_CHECK(reversed.getTotals() == t);
+}
+
+BOOST_AUTO_TEST_CASE(merge)
+{
+    vector<ChromaTotals::Column> columns;
+    for (int i = 0; i < 300; ++i) {
+        columns.push_back(makeColumn(i % 2 ? 1e15 : 0.1 * i));
+    }
+
+    ChromaTotals whole(bins);
+    whole.add(columns);
+
+    ChromaTotals a(bins), b(bins), c(bins);
+    a.add(vector<ChromaTotals::Column>(columns.begin(), columns.begin() + 100));
+    b.add(vector<ChromaTotals::Column>(columns.begin() + 100,
+                                       columns.begin() + 250));
+    c.add(vector<ChromaTotals::Column>(columns.begin() + 250, columns.end()));
+    a.merge(b);
+    a.merge(c);
+
+    BOOST_CHECK_EQUAL(a.getColumnCount(), whole.getColumnCount());
+    vector<double> x = a.getTotals(), y = whole.getTotals();
+    for (int i = 0; i < bins; ++i) {
+        BOOST_CHECK_CLOSE(x[i], y[i], 1e-13);
+    }
+
+    // Merging the same parts in the same order gives the same result
+    // every time
+
+    ChromaTotals again(bins);
+    again.add(vector<ChromaTotals::Column>(columns.begin(),
+                                           columns.begin() + 100));
+    again.merge(b);
+    again.merge(c);
+    BOOST_CHECK(again.getTotals() == x);
+}
+
+BOOST_AUTO_TEST_CASE(roundTrip)
+{
+    // The compensation terms are written too, so totals read back
+    // continue exactly as the originals would
+
+    ChromaTotals totals(bins);
+    totals.add(makeColumn(1e16));
+    totals.add(makeColumn(0.75));
+
+    ostringstream out;
+    totals.write(out);
+    ChromaTotals loaded;
+    istringstream in(out.str());
+    loaded.read(in);
+
+    BOOST_CHECK_EQUAL(loaded.getBinCount(), bins);
+    BOOST_CHECK_EQUAL(loaded.getColumnCount(), 2);
+    BOOST_CHECK(loaded.getTotals() == totals.getTotals());
+
+    totals.add(makeColumn(0.75));
+    loaded.add(makeColumn(0.75));
+    BOOST_CHECK(loaded.getTotals() == totals.getTotals());
+}
+
+BOOST_AUTO_TEST_CASE(invalid)
+{
+    BOOST_CHECK_THROW(ChromaTotals(0), std::invalid_argument);
+
+    ChromaTotals totals(bins);
+    BOOST_CHECK_THROW(totals.add(ChromaTotals::Column(bins + 1)),
+                      std::invalid_argument);
+    BOOST_CHECK_THROW(totals.merge(ChromaTotals(bins - 1)),
+                      std::invalid_argument);
+    BOOST_CHECK_EQUAL(totals.getColumnCount(), 0);
+
+    ostringstream out;
+    totals.write(out);
+    string data = out.str();
+
+    ChromaTotals loaded;
+    istringstream truncated(data.substr(0, data.size() - 1));
+    BOOST_CHECK_THROW(loaded.read(truncated), std::runtime_error);
+
+    string none = data;
+    none.replace(0, 8, string(8, '\0'));
+    istringstream empty(none);
+    BOOST_CHECK_THROW(loaded.read(empty), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,341 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+#include "lib/tuningdifference.h"
+
+#include "Signals.h"
+
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using std::vector;
+using std::string;
+using std::min;
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(TestLibrary)
+
+// Exercise the C interface with a reference and another channel
+// tuned 37 cents sharp, whole and in segments saved to state files
+
+static const float sampleRate = 22050;
+static const double duration = 10;
+
+static const vector<vector<float>> &
+input()
+{
+    static vector<vector<float>> channels =
+        { synthesise(sampleRate, duration, 0, 1),
+          synthesise(sampleRate, duration, 37, 2) };
+    return channels;
+}
+
+static long long
+inputLength()
+{
+    return (long long)(input()[0].size());
+}
+
+// Feed the given frames in uneven pieces, as a caller might
+static void
+feed(td_analyser *analyser, long long from, long long to)
+{
+    to = min(to, inputLength());
+    while (from < to) {
+        int n = int(min(to - from, 3000LL));
+        const float *channels[] = {
+            input()[0].data() + from, input()[1].data() + from
+        };
+        BOOST_REQUIRE_EQUAL(td_process(analyser, channels, n), 0);
+        from += n;
+    }
+}
+
+static string
+statePath(int index)
+{
+    return "TestLibrary-" + std::to_string(index) + ".tds";
+}
+
+BOOST_AUTO_TEST_CASE(whole)
+{
+    td_analyser *analyser = td_create(sampleRate, 2);
+    BOOST_REQUIRE(analyser);
+    BOOST_CHECK_EQUAL(td_get_segment_feed_start(analyser), 0);
+    feed(analyser, 0, inputLength());
+    BOOST_REQUIRE_EQUAL(td_finish(analyser), 0);
+    BOOST_REQUIRE_EQUAL(td_get_result_count(analyser), 1);
+    BOOST_CHECK_EQUAL(td_get_cents(analyser, 0), 37.f);
+    BOOST_CHECK_EQUAL(td_get_stages(analyser, 0),
+                      TD_STAGE_ALL_INPUT + TD_STAGE_FINE_TUNING);
+
+    // The fine search scores at least the offsets either side of its
+    // first estimate
+    BOOST_CHECK_GE(td_get_probes(analyser, 0), 3);
+    float frequency = td_get_frequency(analyser, 0);
+    td_destroy(analyser);
+
+    // Processing octaves in parallel does not change the results
+    analyser = td_create(sampleRate, 2);
+    BOOST_REQUIRE(analyser);
+    BOOST_REQUIRE_EQUAL(td_set_parameter(analyser, "parallel", 1.f), 0);
+    feed(analyser, 0, inputLength());
+    BOOST_REQUIRE_EQUAL(td_finish(analyser), 0);
+    BOOST_CHECK_EQUAL(td_get_cents(analyser, 0), 37.f);
+    BOOST_CHECK_EQUAL(td_get_frequency(analyser, 0), frequency);
+    td_destroy(analyser);
+
+    analyser = td_create(sampleRate, 2);
+    BOOST_REQUIRE(analyser);
+    BOOST_REQUIRE_EQUAL(td_set_parameter(analyser, "finetuning", 0.f), 0);
+    feed(analyser, 0, inputLength());
+    BOOST_REQUIRE_EQUAL(td_finish(analyser), 0);
+    BOOST_CHECK_EQUAL(td_get_stages(analyser, 0), TD_STAGE_ALL_INPUT);
+    BOOST_CHECK_EQUAL(td_get_probes(analyser, 0), 0);
+    td_destroy(analyser);
+}
+
+BOOST_AUTO_TEST_CASE(segments)
+{
+    // The whole input analysed at once, and in three segments whose
+    // states are then combined, give the same results
+
+    td_analyser *whole = td_create(sampleRate, 2);
+    BOOST_REQUIRE(whole);
+    feed(whole, 0, inputLength());
+    BOOST_REQUIRE_EQUAL(td_save_state(whole, statePath(0).c_str()), 0);
+
+    const int count = 3;
+    vector<string> paths;
+    for (int s = 0; s < count; ++s) {
+        td_analyser *analyser = td_create(sampleRate, 2);
+        BOOST_REQUIRE(analyser);
+        long long start = inputLength() * s / count;
+        long long end = inputLength() * (s + 1) / count;
+        BOOST_REQUIRE_EQUAL(td_set_segment(analyser, start, end), 0);
+        long long feedStart = td_get_segment_feed_start(analyser);
+        long long feedEnd = td_get_segment_feed_end(analyser);
+        BOOST_CHECK(feedStart >= 0 && feedStart <= start);
+        BOOST_CHECK(feedEnd >= end);
+        feed(analyser, feedStart, feedEnd);
+        paths.push_back(statePath(s + 1));
+        BOOST_REQUIRE_EQUAL(td_save_state(analyser, paths[s].c_str()), 0);
+        BOOST_CHECK_EQUAL(td_get_result_count(analyser), 1);
+        td_destroy(analyser);
+    }
+
+    td_analyser *merged = td_create(sampleRate, 2);
+    BOOST_REQUIRE(merged);
+    vector<const char *> cpaths;
+    for (const auto &p: paths) cpaths.push_back(p.c_str());
+    BOOST_REQUIRE_EQUAL(td_finish_from_states
+                        (merged, cpaths.data(), count), 0);
+
+    BOOST_REQUIRE_EQUAL(td_get_result_count(merged), 1);
+    BOOST_CHECK_EQUAL(td_get_cents(merged, 0), td_get_cents(whole, 0));
+    BOOST_CHECK_CLOSE(td_get_frequency(merged, 0),
+                      td_get_frequency(whole, 0), 1e-4);
+    BOOST_CHECK_EQUAL(td_get_stages(merged, 0), td_get_stages(whole, 0));
+
+    int bins = td_get_profile_size(merged);
+    BOOST_REQUIRE(bins > 0);
+    vector<float> a(bins), b(bins);
+    for (int c = 0; c < 2; ++c) {
+        BOOST_REQUIRE_EQUAL(td_get_profile(merged, c, a.data()), 0);
+        BOOST_REQUIRE_EQUAL(td_get_profile(whole, c, b.data()), 0);
+        for (int i = 0; i < bins; ++i) {
+            BOOST_CHECK_CLOSE(a[i], b[i], 1e-3);
+        }
+    }
+
+    td_destroy(merged);
+    td_destroy(whole);
+    for (int s = 0; s <= count; ++s) {
+        remove(statePath(s).c_str());
+    }
+}
+
+static void
+checkResumed(bool fineTuning)
+{
+    float fine = (fineTuning ? 1.f : 0.f);
+    
+    td_analyser *whole = td_create(sampleRate, 2);
+    BOOST_REQUIRE(whole);
+    BOOST_REQUIRE_EQUAL(td_set_parameter(whole, "finetuning", fine), 0);
+    feed(whole, 0, inputLength());
+    BOOST_REQUIRE_EQUAL(td_finish(whole), 0);
+
+    string path = statePath(0);
+    td_analyser *interrupted = td_create(sampleRate, 2);
+    BOOST_REQUIRE(interrupted);
+    BOOST_REQUIRE_EQUAL(td_set_parameter(interrupted, "finetuning", fine), 0);
+    feed(interrupted, 0, inputLength() / 2);
+    BOOST_REQUIRE_EQUAL(td_save_checkpoint(interrupted, path.c_str()), 0);
+    td_destroy(interrupted);
+
+    td_analyser *resumed = td_create(sampleRate, 2);
+    BOOST_REQUIRE(resumed);
+    BOOST_REQUIRE_EQUAL(td_set_parameter(resumed, "finetuning", fine), 0);
+    BOOST_REQUIRE_EQUAL(td_set_segment(resumed, 0, inputLength()), 0);
+    BOOST_REQUIRE_EQUAL(td_resume(resumed, path.c_str()), 0);
+
+    // The analysis needs more warm-up than there is input before
+    // the checkpoint, so the resumed analyser is fed from the start,
+    // and must not count what it has already seen a second time
+    
+    long long feedStart = td_get_segment_feed_start(resumed);
+    BOOST_CHECK(feedStart >= 0 && feedStart <= inputLength() / 2);
+    feed(resumed, feedStart, td_get_segment_feed_end(resumed));
+    BOOST_REQUIRE_EQUAL(td_finish(resumed), 0);
+
+    BOOST_REQUIRE_EQUAL(td_get_result_count(resumed), 1);
+    BOOST_CHECK_EQUAL(td_get_cents(resumed, 0), td_get_cents(whole, 0));
+    BOOST_CHECK_CLOSE(td_get_frequency(resumed, 0),
+                      td_get_frequency(whole, 0), 1e-4);
+    BOOST_CHECK_EQUAL(td_get_stages(resumed, 0), td_get_stages(whole, 0));
+
+    td_destroy(resumed);
+    td_destroy(whole);
+    remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(checkpoint)
+{
+    // An analysis interrupted after a checkpoint and resumed from it
+    // in another analyser gives the same results as one run through
+
+    checkResumed(true);
+    checkResumed(false);
+}
+
+BOOST_AUTO_TEST_CASE(matrix)
+{
+    td_analyser *analyser = td_create(sampleRate, 2);
+    BOOST_REQUIRE(analyser);
+    float cents[4], distances[4];
+    BOOST_CHECK(td_get_tuning_matrix(analyser, cents, distances) != 0);
+    feed(analyser, 0, inputLength());
+    BOOST_REQUIRE_EQUAL(td_finish(analyser), 0);
+    BOOST_REQUIRE_EQUAL(td_get_tuning_matrix(analyser, cents, distances), 0);
+
+    // Each channel against itself, then the 37-cent difference each
+    // way, to the 10-cent resolution of the profiles
+    
+    BOOST_CHECK_EQUAL(cents[0], 0.f);
+    BOOST_CHECK_EQUAL(cents[3], 0.f);
+    BOOST_CHECK_EQUAL(distances[0], 0.f);
+    BOOST_CHECK_EQUAL(distances[3], 0.f);
+    BOOST_CHECK(fabs(cents[1] - 37.f) <= 10.f);
+    BOOST_CHECK_EQUAL(cents[2], -cents[1]);
+    BOOST_CHECK(distances[1] > 0.f);
+    BOOST_CHECK_EQUAL(td_get_tuning_matrix(analyser, 0, 0), 0);
+    td_destroy(analyser);
+}
+
+BOOST_AUTO_TEST_CASE(index)
+{
+    // Index the profiles of a reference and another channel 37 cents
+    // sharp, then look up those of a recording 137 cents sharp: both
+    // match it, once their tuning differences from it are allowed for
+
+    const char *indexPath = "TestLibrary-index.tdi";
+    remove(indexPath);
+
+    td_analyser *indexed = td_create(sampleRate, 2);
+    BOOST_REQUIRE(indexed);
+    BOOST_CHECK(td_add_to_index(indexed, 0, indexPath, 100) != 0);
+    feed(indexed, 0, inputLength());
+    BOOST_REQUIRE_EQUAL(td_finish(indexed), 0);
+    BOOST_REQUIRE_EQUAL(td_add_to_index(indexed, 0, indexPath, 100), 0);
+    BOOST_REQUIRE_EQUAL(td_add_to_index(indexed, 1, indexPath, 137), 0);
+    BOOST_CHECK(td_add_to_index(indexed, 2, indexPath, 0) != 0);
+    td_destroy(indexed);
+
+    vector<float> sharp = synthesise(sampleRate, duration, 137, 3);
+    td_analyser *query = td_create(sampleRate, 2);
+    BOOST_REQUIRE(query);
+    for (long long from = 0; from < inputLength(); from += 4096) {
+        int n = int(min(inputLength() - from, 4096LL));
+        const float *channels[] = {
+            input()[0].data() + from, sharp.data() + from
+        };
+        BOOST_REQUIRE_EQUAL(td_process(query, channels, n), 0);
+    }
+    BOOST_REQUIRE_EQUAL(td_finish(query), 0);
+
+    unsigned long long ids[3];
+    float cents[3], distances[3];
+    BOOST_REQUIRE_EQUAL(td_find_nearest(query, 1, indexPath, 3,
+                                        ids, cents, distances), 2);
+    
+    // The indexed recordings are 137 and 100 cents flat of it. The
+    // profile has bins of 10 cents, so those are found to within one
+    // bin, and the bin nearer the 37-cents recording gives the
+    // closer match
+    
+    int resolution = 1200 / td_get_profile_size(query);
+    BOOST_CHECK_EQUAL(ids[0], 137ULL);
+    BOOST_CHECK(fabs(cents[0] + 100) <= resolution);
+    BOOST_CHECK_EQUAL(ids[1], 100ULL);
+    BOOST_CHECK(fabs(cents[1] + 137) <= resolution);
+    BOOST_CHECK(distances[0] <= distances[1]);
+
+    BOOST_CHECK_EQUAL(td_find_nearest(query, 1, indexPath, 1,
+                                      ids, 0, 0), 1);
+    BOOST_CHECK_EQUAL(td_find_nearest(query, 1, "TestLibrary-missing.tdi",
+                                      1, ids, 0, 0), 0);
+    BOOST_CHECK_EQUAL(td_find_nearest(query, 5, indexPath, 1,
+                                      ids, 0, 0), -1);
+    BOOST_CHECK(string(td_get_error(query)) != "");
+    
+    td_destroy(query);
+    remove(indexPath);
+}
+
+BOOST_AUTO_TEST_CASE(errors)
+{
+    td_analyser *analyser = td_create(sampleRate, 2);
+    BOOST_REQUIRE(analyser);
+    BOOST_CHECK(td_set_segment(analyser, 100, 100) != 0);
+    BOOST_CHECK(td_set_segment(analyser, -1, 100) != 0);
+    BOOST_CHECK(string(td_get_error(analyser)) != "");
+    feed(analyser, 0, 4096);
+    BOOST_CHECK(td_set_segment(analyser, 0, 100) != 0);
+    BOOST_REQUIRE_EQUAL(td_save_state(analyser, statePath(0).c_str()), 0);
+    td_destroy(analyser);
+
+    // A missing state file, or one saved with other parameters
+
+    const char *missing[] = { "TestLibrary-missing.tds" };
+    analyser = td_create(sampleRate, 2);
+    BOOST_CHECK(td_finish_from_states(analyser, missing, 1) != 0);
+    BOOST_CHECK(string(td_get_error(analyser)) != "");
+    td_destroy(analyser);
+
+    analyser = td_create(sampleRate, 2);
+    BOOST_CHECK(td_resume(analyser, missing[0]) != 0);
+    BOOST_CHECK(string(td_get_error(analyser)) != "");
+    td_destroy(analyser);
+
+    string path = statePath(0);
+    const char *paths[] = { path.c_str() };
+    analyser = td_create(sampleRate, 2);
+    BOOST_REQUIRE_EQUAL(td_set_parameter(analyser, "finetuning", 0.f), 0);
+    BOOST_CHECK(td_finish_from_states(analyser, paths, 1) != 0);
+    td_destroy(analyser);
+
+    analyser = td_create(sampleRate * 2, 2);
+    BOOST_CHECK(td_finish_from_states(analyser, paths, 1) != 0);
+    td_destroy(analyser);
+
+    remove(path.c_str());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,171 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+#include "src/ProfileCache.h"
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using std::vector;
+using std::string;
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(TestProfileCache)
+
+// Entries are kept in the current directory, under keys unlikely to
+// be those of real entries, and removed afterwards
+
+static const int bpo = 12;
+
+static string
+pathFor(uint64_t key, string suffix)
+{
+    char name[40];
+    sprintf(name, "%016llx", (unsigned long long)key);
+    return string("./") + name + suffix;
+}
+
+static ProfileCache::ChannelEntry
+makeEntry(uint64_t contentHash, double scale, int chunks)
+{
+    ProfileCache::ChannelEntry entry;
+    ChromaTotals::Column column(bpo);
+    ChromaTotals totals(bpo);
+    for (int c = 0; c < chunks; ++c) {
+        for (int i = 0; i < bpo; ++i) {
+            column[i] = scale * (c + 1) + i;
+        }
+        totals.add(column);
+        entry.chunkHashes.push_back(contentHash * 100 + c);
+        entry.chunkTotals.push_back(totals);
+        entry.chunkResumeFrames.push_back(1024 * (c + 1));
+    }
+    entry.blockCount = chunks * 10 + 3;
+    entry.contentHash = contentHash;
+    entry.totals = totals;
+    return entry;
+}
+
+static void
+checkEntriesEqual(const ProfileCache::ChannelEntry &a,
+                  const ProfileCache::ChannelEntry &b)
+{
+    BOOST_CHECK(a.chunkHashes == b.chunkHashes);
+    BOOST_CHECK(a.chunkResumeFrames == b.chunkResumeFrames);
+    BOOST_REQUIRE_EQUAL(a.chunkTotals.size(), b.chunkTotals.size());
+    for (size_t i = 0; i < a.chunkTotals.size(); ++i) {
+        BOOST_CHECK(a.chunkTotals[i].getTotals() ==
+                    b.chunkTotals[i].getTotals());
+    }
+    BOOST_CHECK_EQUAL(a.blockCount, b.blockCount);
+    BOOST_CHECK_EQUAL(a.contentHash, b.contentHash);
+    BOOST_CHECK(a.totals.getTotals() == b.totals.getTotals());
+    BOOST_CHECK_EQUAL(a.totals.getColumnCount(), b.totals.getColumnCount());
+}
+
+BOOST_AUTO_TEST_CASE(sharedFirstChunk)
+{
+    // Inputs that begin alike are filed under the same key and must
+    // not replace one another
+
+    ProfileCache cache(".");
+    uint64_t key = 0x7d01;
+    remove(pathFor(key, ".tdc").c_str());
+
+    vector<ProfileCache::ChannelEntry> entries;
+    BOOST_CHECK(!cache.loadChannels(key, entries));
+
+    ProfileCache::ChannelEntry a = makeEntry(1, 1.0, 3);
+    ProfileCache::ChannelEntry b = makeEntry(2, 2.0, 5);
+    cache.storeChannel(key, a);
+    cache.storeChannel(key, b);
+    BOOST_REQUIRE(cache.loadChannels(key, entries));
+    BOOST_REQUIRE_EQUAL(entries.size(), 2);
+    checkEntriesEqual(entries[0], a);
+    checkEntriesEqual(entries[1], b);
+
+    // Storing the same content again replaces its entry, and makes it
+    // the newest
+
+    a.totals = makeEntry(1, 3.0, 3).totals;
+    cache.storeChannel(key, a);
+    BOOST_REQUIRE(cache.loadChannels(key, entries));
+    BOOST_REQUIRE_EQUAL(entries.size(), 2);
+    checkEntriesEqual(entries[0], b);
+    checkEntriesEqual(entries[1], a);
+
+    remove(pathFor(key, ".tdc").c_str());
+}
+
+BOOST_AUTO_TEST_CASE(entryLimit)
+{
+    ProfileCache cache(".");
+    uint64_t key = 0x7d02;
+    int n = ProfileCache::maxChannelEntries;
+    for (int i = 0; i < n + 2; ++i) {
+        cache.storeChannel(key, makeEntry(i + 1, 1.0, 2));
+    }
+    vector<ProfileCache::ChannelEntry> entries;
+    BOOST_REQUIRE(cache.loadChannels(key, entries));
+    BOOST_REQUIRE_EQUAL(int(entries.size()), n);
+    for (int i = 0; i < n; ++i) {
+        BOOST_CHECK_EQUAL(entries[i].contentHash, uint64_t(i + 3));
+    }
+    remove(pathFor(key, ".tdc").c_str());
+}
+
+BOOST_AUTO_TEST_CASE(unreadable)
+{
+    ProfileCache cache(".");
+    uint64_t key = 0x7d04;
+    cache.storeChannel(key, makeEntry(6, 1.0, 2));
+
+    // Filed under another key
+    string path = pathFor(key, ".tdc"), other = pathFor(key + 1, ".tdc");
+    BOOST_REQUIRE_EQUAL(rename(path.c_str(), other.c_str()), 0);
+    vector<ProfileCache::ChannelEntry> entries;
+    BOOST_CHECK(!cache.loadChannels(key + 1, entries));
+    BOOST_CHECK(entries.empty());
+
+    // Truncated
+    {
+        std::ofstream out(path, std::ios::binary);
+        out.write("TDCHAN01", 8);
+    }
+    BOOST_CHECK(!cache.loadChannels(key, entries));
+
+    // and replaced when stored to
+    cache.storeChannel(key, makeEntry(7, 1.0, 2));
+    BOOST_REQUIRE(cache.loadChannels(key, entries));
+    BOOST_CHECK_EQUAL(entries.size(), 1);
+
+    remove(path.c_str());
+    remove(other.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(offsets)
+{
+    ProfileCache cache(".");
+    uint64_t key = 0x7d05;
+    vector<ChromaTotals> totals;
+    for (int i = 0; i < 5; ++i) {
+        totals.push_back(makeEntry(1, i, 1).totals);
+    }
+    cache.storeOffsets(key, totals);
+    vector<ChromaTotals> loaded;
+    BOOST_REQUIRE(cache.loadOffsets(key, loaded));
+    BOOST_REQUIRE_EQUAL(loaded.size(), totals.size());
+    for (size_t i = 0; i < totals.size(); ++i) {
+        BOOST_CHECK(loaded[i].getTotals() == totals[i].getTotals());
+    }
+    vector<ProfileCache::ChannelEntry> entries;
+    BOOST_CHECK(!cache.loadChannels(key, entries));
+    remove(pathFor(key, ".tdo").c_str());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
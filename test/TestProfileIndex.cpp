@@ -0,0 +1,175 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+#include "src/ProfileIndex.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using std::vector;
+using std::string;
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(TestProfileIndex)
+
+static const int bins = 60;
+static const char *const indexPath = "TestProfileIndex.tdi";
+
+static ProfileIndex::Feature
+makeProfile(unsigned seed)
+{
+    srand(seed);
+    ProfileIndex::Feature profile(bins);
+    double sum = 0.0;
+    for (auto &v: profile) {
+        v = rand() / double(RAND_MAX);
+        sum += v;
+    }
+    for (auto &v: profile) {
+        v /= sum;
+    }
+    return profile;
+}
+
+static ProfileIndex::Feature
+rotate(const ProfileIndex::Feature &profile, int rotation)
+{
+    // As RotationSearch rotates: element i from element i - rotation
+    int n = int(profile.size());
+    ProfileIndex::Feature rotated(n);
+    for (int i = 0; i < n; ++i) {
+        rotated[i] = profile[((i - rotation) % n + n) % n];
+    }
+    return rotated;
+}
+
+static string
+readFile(string path)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream out;
+    out << in.rdbuf();
+    return out.str();
+}
+
+static void
+appendBytes(string path, string bytes)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::app);
+    out.write(bytes.data(), bytes.size());
+}
+
+BOOST_AUTO_TEST_CASE(missing)
+{
+    remove(indexPath);
+    ProfileIndex index(indexPath);
+    BOOST_CHECK_EQUAL(index.getProfileCount(), 0);
+    BOOST_CHECK(index.findNearest(makeProfile(1), 5, 3, 10).empty());
+}
+
+BOOST_AUTO_TEST_CASE(appendAndRead)
+{
+    remove(indexPath);
+    for (int i = 0; i < 20; ++i) {
+        ProfileIndex::append(indexPath, 1000 + i, makeProfile(i));
+    }
+    ProfileIndex index(indexPath);
+    BOOST_REQUIRE_EQUAL(index.getProfileCount(), 20);
+    for (int i = 0; i < 20; ++i) {
+        BOOST_CHECK_EQUAL(index.getId(i), uint64_t(1000 + i));
+        ProfileIndex::Feature p = index.getProfile(i), q = makeProfile(i);
+        BOOST_CHECK_EQUAL_COLLECTIONS(p.begin(), p.end(), q.begin(), q.end());
+    }
+    remove(indexPath);
+}
+
+BOOST_AUTO_TEST_CASE(tornRecords)
+{
+    // A record cut short, at the start of the file and between
+    // others, loses only itself
+
+    string single = "TestProfileIndex-single.tdi";
+    remove(single.c_str());
+    ProfileIndex::append(single, 1, makeProfile(1));
+    string record = readFile(single);
+    remove(single.c_str());
+
+    remove(indexPath);
+    appendBytes(indexPath, record.substr(0, record.size() / 3));
+    ProfileIndex::append(indexPath, 10, makeProfile(10));
+    ProfileIndex::append(indexPath, 11, makeProfile(11));
+    appendBytes(indexPath, record.substr(0, record.size() - 8));
+    ProfileIndex::append(indexPath, 12, makeProfile(12));
+    appendBytes(indexPath, "garbage");
+    ProfileIndex::append(indexPath, 13, makeProfile(13));
+    appendBytes(indexPath, record.substr(0, 30));
+
+    ProfileIndex index(indexPath);
+    BOOST_REQUIRE_EQUAL(index.getProfileCount(), 4);
+    for (int i = 0; i < 4; ++i) {
+        BOOST_CHECK_EQUAL(index.getId(i), uint64_t(10 + i));
+        ProfileIndex::Feature p = index.getProfile(i), q = makeProfile(10 + i);
+        BOOST_CHECK_EQUAL_COLLECTIONS(p.begin(), p.end(), q.begin(), q.end());
+    }
+    remove(indexPath);
+}
+
+BOOST_AUTO_TEST_CASE(signature)
+{
+    ProfileIndex::Feature profile = makeProfile(7);
+    vector<float> a = ProfileIndex::getSignature(profile);
+    vector<float> b = ProfileIndex::getSignature(rotate(profile, 13));
+    BOOST_REQUIRE_EQUAL(a.size(), b.size());
+    for (size_t i = 0; i < a.size(); ++i) {
+        BOOST_CHECK_SMALL(a[i] - b[i], 1e-5f);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(findNearest)
+{
+    remove(indexPath);
+    const int count = 2000;
+    for (int i = 0; i < count; ++i) {
+        ProfileIndex::append(indexPath, i, makeProfile(i + 100));
+    }
+    // The same profile under a second identifier, which should be
+    // returned separately, and again under the first
+    ProfileIndex::append(indexPath, count, makeProfile(123 + 100));
+    ProfileIndex::append(indexPath, 123, makeProfile(123 + 100));
+
+    ProfileIndex index(indexPath);
+    BOOST_REQUIRE_EQUAL(index.getProfileCount(), count + 2);
+
+    // A query rotated down by 3 bins from profile 123 must be rotated
+    // back up by 3 to match it
+
+    ProfileIndex::Feature query = rotate(makeProfile(123 + 100), -3);
+    vector<ProfileIndex::Match> matches = index.findNearest(query, 5, 3, 20);
+    BOOST_REQUIRE_EQUAL(matches.size(), 3);
+    BOOST_CHECK_EQUAL(matches[0].id, 123);
+    BOOST_CHECK_EQUAL(matches[0].rotation, 3);
+    BOOST_CHECK_SMALL(matches[0].distance, 1e-12);
+    BOOST_CHECK_EQUAL(matches[1].id, uint64_t(count));
+    BOOST_CHECK_EQUAL(matches[1].rotation, 3);
+    BOOST_CHECK(matches[2].id != 123 && matches[2].id != uint64_t(count));
+    BOOST_CHECK(matches[2].distance > 0.1);
+
+    // Out of range of the rotation, it is not found exactly
+    matches = index.findNearest(query, 2, 1, 20);
+    BOOST_REQUIRE_EQUAL(matches.size(), 1);
+    BOOST_CHECK(matches[0].distance > 0.0);
+
+    BOOST_CHECK_THROW(index.findNearest(ProfileIndex::Feature(bins + 1),
+                                        5, 3, 20),
+                      std::invalid_argument);
+    remove(indexPath);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,170 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+#include "src/RotationSearch.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+#include <stdexcept>
+
+using std::vector;
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(TestRotationSearch)
+
+static const int bins = 120;
+
+static RotationSearch::Feature
+makeFeature(unsigned seed)
+{
+    srand(seed);
+    RotationSearch::Feature f(bins);
+    for (auto &v: f) {
+        v = rand() / double(RAND_MAX);
+    }
+    return f;
+}
+
+static RotationSearch::Feature
+rotate(const RotationSearch::Feature &f, int rotation)
+{
+    // Element i from element i - rotation, as documented
+    int n = int(f.size());
+    RotationSearch::Feature r(n);
+    for (int i = 0; i < n; ++i) {
+        r[i] = f[((i - rotation) % n + n) % n];
+    }
+    return r;
+}
+
+static double
+distance(const RotationSearch::Feature &a, const RotationSearch::Feature &b)
+{
+    double d = 0.0;
+    for (int i = 0; i < int(a.size()); ++i) {
+        d += fabs(a[i] - b[i]);
+    }
+    return d;
+}
+
+static void
+checkAgainstRotated(const RotationSearch::Feature &reference,
+                    const RotationSearch::Feature &candidate,
+                    const RotationSearch::Result &result,
+                    int maxRotation)
+{
+    // Every distance must be exactly that found by rotating the
+    // candidate and comparing it, and the rotation the highest of
+    // those with the smallest distance
+
+    BOOST_REQUIRE_EQUAL(int(result.distances.size()), 2 * maxRotation + 1);
+    int best = -maxRotation;
+    double bestDistance = 0.0;
+    for (int r = -maxRotation; r <= maxRotation; ++r) {
+        double d = distance(reference, rotate(candidate, r));
+        BOOST_CHECK_EQUAL(result.distances[r + maxRotation], d);
+        if (r == -maxRotation || d <= bestDistance) {
+            best = r;
+            bestDistance = d;
+        }
+    }
+    BOOST_CHECK_EQUAL(result.rotation, best);
+}
+
+BOOST_AUTO_TEST_CASE(exact)
+{
+    RotationSearch search(bins, 30);
+    RotationSearch::Feature reference = makeFeature(1);
+    vector<RotationSearch::Feature> candidates;
+    for (int i = 0; i < 5; ++i) {
+        candidates.push_back(makeFeature(i + 2));
+    }
+    vector<RotationSearch::Result> results =
+        search.search(reference, candidates);
+    BOOST_REQUIRE_EQUAL(results.size(), candidates.size());
+    for (int i = 0; i < int(candidates.size()); ++i) {
+        checkAgainstRotated(reference, candidates[i], results[i], 30);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(wrapping)
+{
+    // A range wider than the feature wraps around it more than once
+    int maxRotation = bins + 17;
+    RotationSearch search(bins, maxRotation);
+    RotationSearch::Feature reference = makeFeature(3);
+    RotationSearch::Feature candidate = makeFeature(4);
+    checkAgainstRotated(reference, candidate,
+                        search.search(reference, candidate), maxRotation);
+}
+
+BOOST_AUTO_TEST_CASE(found)
+{
+    // A candidate rotated down from the reference must be rotated up
+    // by the same amount to match it
+    RotationSearch search(bins, 20);
+    RotationSearch::Feature reference = makeFeature(5);
+    for (int r = -20; r <= 20; r += 5) {
+        RotationSearch::Result result =
+            search.search(reference, rotate(reference, -r));
+        BOOST_CHECK_EQUAL(result.rotation, r);
+        BOOST_CHECK_EQUAL(result.distances[r + 20], 0.0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ties)
+{
+    RotationSearch search(bins, 4);
+    RotationSearch::Feature flat(bins, 0.5);
+    RotationSearch::Result result = search.search(flat, flat);
+    BOOST_CHECK_EQUAL(result.rotation, 4);
+    for (double d: result.distances) {
+        BOOST_CHECK_EQUAL(d, 0.0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(prepared)
+{
+    RotationSearch search(bins, 12);
+    vector<RotationSearch::Feature> candidates;
+    for (int i = 0; i < 4; ++i) {
+        candidates.push_back(makeFeature(i + 10));
+    }
+    RotationSearch::Candidates prepared = search.prepare(candidates);
+    BOOST_CHECK_EQUAL(prepared.getCount(), 4);
+    for (int r = 0; r < 3; ++r) {
+        RotationSearch::Feature reference = makeFeature(r + 20);
+        vector<RotationSearch::Result> a =
+            search.search(reference, prepared);
+        vector<RotationSearch::Result> b =
+            search.search(reference, candidates);
+        BOOST_REQUIRE_EQUAL(a.size(), b.size());
+        for (int i = 0; i < int(a.size()); ++i) {
+            BOOST_CHECK_EQUAL(a[i].rotation, b[i].rotation);
+            BOOST_CHECK(a[i].distances == b[i].distances);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(invalid)
+{
+    BOOST_CHECK_THROW(RotationSearch(0, 4), std::invalid_argument);
+    BOOST_CHECK_THROW(RotationSearch(bins, -1), std::invalid_argument);
+
+    RotationSearch search(bins, 4);
+    RotationSearch::Feature good = makeFeature(1);
+    RotationSearch::Feature bad(bins - 1);
+    BOOST_CHECK_THROW(search.search(bad, good), std::invalid_argument);
+    BOOST_CHECK_THROW(search.search(good, bad), std::invalid_argument);
+
+    RotationSearch other(bins, 5);
+    RotationSearch::Candidates prepared =
+        other.prepare(vector<RotationSearch::Feature>(2, good));
+    BOOST_CHECK_THROW(search.search(good, prepared), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,222 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+#include "src/TuningDifference.h"
+
+#include "Signals.h"
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+using std::vector;
+using std::min;
+using std::max;
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(TestSegments)
+
+// Analyse a reference and another channel tuned 37 cents sharp,
+// whole and in segments, and check that the segments' states merge
+// to the whole input's
+
+static const double sampleRate = 22050;
+static const int blockSize = 1024;
+static const double duration = 12;
+
+static const vector<vector<float>> &
+input()
+{
+    static vector<vector<float>> channels =
+        { synthesise(sampleRate, duration, 0, 1),
+          synthesise(sampleRate, duration, 37, 2) };
+    return channels;
+}
+
+static int64_t
+inputLength()
+{
+    return int64_t(input()[0].size());
+}
+
+static void
+feed(TuningDifference &td, int64_t from, int64_t to)
+{
+    const vector<vector<float>> &channels = input();
+    to = min(to, inputLength());
+
+    vector<vector<float>> blocks(channels.size(), vector<float>(blockSize));
+    vector<const float *> ptrs;
+    for (const auto &b: blocks) ptrs.push_back(b.data());
+
+    for (int64_t off = from; off < to; off += blockSize) {
+        for (size_t c = 0; c < channels.size(); ++c) {
+            for (int i = 0; i < blockSize; ++i) {
+                blocks[c][i] = (off + i < to ? channels[c][off + i] : 0.f);
+            }
+        }
+        td.process(ptrs.data(), Vamp::RealTime::frame2RealTime
+                   (long(off), int(sampleRate)));
+    }
+}
+
+static TuningDifference *
+makePlugin(bool fineTuning)
+{
+    TuningDifference *td = new TuningDifference(sampleRate);
+    td->setParameter("finetuning", fineTuning ? 1.f : 0.f);
+    BOOST_REQUIRE(td->initialise(int(input().size()), blockSize, blockSize));
+    return td;
+}
+
+static double
+relativeDifference(const ChromaTotals &a, const ChromaTotals &b)
+{
+    BOOST_CHECK_EQUAL(a.getColumnCount(), b.getColumnCount());
+    vector<double> x = a.getTotals(), y = b.getTotals();
+    BOOST_REQUIRE_EQUAL(x.size(), y.size());
+    double diff = 0.0;
+    for (size_t i = 0; i < x.size(); ++i) {
+        diff = max(diff, fabs(x[i] - y[i]) / max(1e-300, fabs(x[i])));
+    }
+    return diff;
+}
+
+static void
+checkStatesMatch(const TuningState &a, const TuningState &b)
+{
+    // "To within rounding": the merge adds the segments' compensated
+    // sums in a different order from the whole analysis
+
+    static const double tolerance = 1e-9;
+
+    BOOST_CHECK_EQUAL(a.getFrameCount(), b.getFrameCount());
+    BOOST_REQUIRE_EQUAL(a.getChannelCount(), b.getChannelCount());
+    BOOST_REQUIRE_EQUAL(a.getSearchDistance(), b.getSearchDistance());
+
+    for (int c = 0; c < a.getChannelCount(); ++c) {
+        BOOST_CHECK_SMALL(relativeDifference(a.getChannelTotals(c),
+                                             b.getChannelTotals(c)),
+                          tolerance);
+    }
+
+    int distance = a.getSearchDistance();
+    if (distance > 0) {
+        for (int o = -distance; o <= distance; ++o) {
+            BOOST_CHECK_SMALL(relativeDifference(a.getReferenceTotals(0, o),
+                                                 b.getReferenceTotals(0, o)),
+                              tolerance);
+        }
+    }
+}
+
+static TuningState
+analyseWhole(bool fineTuning, bool asSegment)
+{
+    TuningDifference *td = makePlugin(fineTuning);
+    if (asSegment) {
+        td->setSegment(0, inputLength());
+    }
+    feed(*td, td->getSegmentFeedStart(), td->getSegmentFeedEnd());
+    TuningState state = td->getState();
+    delete td;
+    return state;
+}
+
+static TuningState
+analyseSegments(bool fineTuning, int count)
+{
+    TuningState merged;
+    int64_t n = inputLength();
+    for (int s = 0; s < count; ++s) {
+        TuningDifference *td = makePlugin(fineTuning);
+        td->setSegment(n * s / count, n * (s + 1) / count);
+        feed(*td, td->getSegmentFeedStart(), td->getSegmentFeedEnd());
+        if (s == 0) merged = td->getState();
+        else merged.merge(td->getState());
+        delete td;
+    }
+    return merged;
+}
+
+BOOST_AUTO_TEST_CASE(wholeSegment)
+{
+    // A single segment covering the input is the same as no segment
+    checkStatesMatch(analyseWhole(false, false), analyseWhole(false, true));
+    checkStatesMatch(analyseWhole(true, false), analyseWhole(true, true));
+}
+
+BOOST_AUTO_TEST_CASE(segments)
+{
+    TuningState whole = analyseWhole(false, false);
+    checkStatesMatch(whole, analyseSegments(false, 3));
+    checkStatesMatch(whole, analyseSegments(false, 5));
+}
+
+BOOST_AUTO_TEST_CASE(segmentsFineTuning)
+{
+    TuningState whole = analyseWhole(true, false);
+    checkStatesMatch(whole, analyseSegments(true, 2));
+    checkStatesMatch(whole, analyseSegments(true, 4));
+}
+
+static TuningState
+analyseResumed(bool fineTuning, int64_t checkpointAt)
+{
+    // Interrupt an analysis at the given frame, and finish it in
+    // another instance resumed from the checkpoint taken there. The
+    // resumed instance is told where the input ends, as the command
+    // line tool does, so as to count its input exactly
+
+    TuningDifference *td = makePlugin(fineTuning);
+    feed(*td, 0, checkpointAt);
+    TuningState checkpoint = td->getCheckpoint();
+    delete td;
+
+    td = makePlugin(fineTuning);
+    td->setSegment(0, inputLength());
+    td->resume(checkpoint);
+    BOOST_CHECK(td->getSegmentFeedStart() <= checkpointAt);
+    feed(*td, td->getSegmentFeedStart(), td->getSegmentFeedEnd());
+    TuningState state = td->getState();
+    delete td;
+    return state;
+}
+
+BOOST_AUTO_TEST_CASE(checkpoints)
+{
+    TuningState whole = analyseWhole(false, false);
+    checkStatesMatch(whole, analyseResumed(false, blockSize * 100));
+    whole = analyseWhole(true, false);
+    checkStatesMatch(whole, analyseResumed(true, blockSize * 100));
+    checkStatesMatch(whole, analyseResumed(true, blockSize * 200));
+}
+
+BOOST_AUTO_TEST_CASE(mergedFeatures)
+{
+    TuningDifference *td = makePlugin(true);
+    Vamp::Plugin::OutputList outputs = td->getOutputDescriptors();
+    Vamp::Plugin::FeatureSet whole =
+        td->getFeaturesForState(analyseWhole(true, false));
+    Vamp::Plugin::FeatureSet merged =
+        td->getFeaturesForState(analyseSegments(true, 3));
+    for (int i = 0; i < int(outputs.size()); ++i) {
+        if (outputs[i].identifier != "cents" &&
+            outputs[i].identifier != "tuningfreq") {
+            continue;
+        }
+        BOOST_REQUIRE_EQUAL(whole[i].size(), merged[i].size());
+        BOOST_REQUIRE_EQUAL(whole[i][0].values.size(),
+                            merged[i][0].values.size());
+        for (size_t j = 0; j < whole[i][0].values.size(); ++j) {
+            BOOST_CHECK_CLOSE(whole[i][0].values[j],
+                              merged[i][0].values[j], 1e-4);
+        }
+    }
+    delete td;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
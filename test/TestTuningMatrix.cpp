@@ -0,0 +1,122 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+#include "src/TuningMatrix.h"
+
+#include <cq/TaskScheduler.h>
+
+#include <cstdlib>
+#include <vector>
+#include <stdexcept>
+
+using std::vector;
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(TestTuningMatrix)
+
+// Profiles of 60 bins (20 cents each) compared within 4 semitones,
+// or 20 bins either way
+
+static const int bpo = 60;
+static const int maxSemis = 4;
+
+static TuningMatrix::Feature
+makeProfile(unsigned seed)
+{
+    srand(seed);
+    TuningMatrix::Feature profile(bpo);
+    for (auto &v: profile) {
+        v = rand() / double(RAND_MAX);
+    }
+    return profile;
+}
+
+static TuningMatrix::Feature
+rotate(const TuningMatrix::Feature &profile, int rotation)
+{
+    // As RotationSearch rotates: element i from element i - rotation
+    TuningMatrix::Feature rotated(bpo);
+    for (int i = 0; i < bpo; ++i) {
+        rotated[i] = profile[((i - rotation) % bpo + bpo) % bpo];
+    }
+    return rotated;
+}
+
+static vector<TuningMatrix::Feature>
+makeProfiles()
+{
+    // The same recording 40 cents sharp and 100 cents flat, and an
+    // unrelated one
+    TuningMatrix::Feature p = makeProfile(1);
+    return { p, rotate(p, 2), rotate(p, -5), makeProfile(2) };
+}
+
+BOOST_AUTO_TEST_CASE(differences)
+{
+    vector<vector<TuningMatrix::Entry>> matrix =
+        TuningMatrix(bpo, maxSemis).compute(makeProfiles());
+
+    BOOST_REQUIRE_EQUAL(matrix.size(), 4);
+    for (int i = 0; i < 4; ++i) {
+        BOOST_REQUIRE_EQUAL(matrix[i].size(), 4);
+        BOOST_CHECK_EQUAL(matrix[i][i].rotation, 0);
+        BOOST_CHECK_EQUAL(matrix[i][i].cents, 0);
+        BOOST_CHECK_EQUAL(matrix[i][i].distance, 0.0);
+    }
+
+    int expected[3][3] = {
+        { 0, 40, -100 },
+        { -40, 0, -140 },
+        { 100, 140, 0 }
+    };
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            BOOST_CHECK_EQUAL(matrix[i][j].cents, expected[i][j]);
+            BOOST_CHECK_EQUAL(matrix[i][j].rotation,
+                              -expected[i][j] * bpo / 1200);
+            BOOST_CHECK_SMALL(matrix[i][j].distance, 1e-12);
+        }
+        BOOST_CHECK(matrix[i][3].distance > 1.0);
+        BOOST_CHECK(matrix[3][i].distance > 1.0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(threads)
+{
+    // The result does not depend on the number of threads
+
+    vector<TuningMatrix::Feature> profiles;
+    for (int i = 0; i < 20; ++i) {
+        profiles.push_back(makeProfile(i + 10));
+    }
+
+    TaskScheduler single(1), several(4);
+    TuningMatrix tm(bpo, maxSemis);
+    auto a = tm.compute(profiles, &single);
+    auto b = tm.compute(profiles, &several);
+    auto c = tm.compute(profiles);
+
+    for (int i = 0; i < 20; ++i) {
+        for (int j = 0; j < 20; ++j) {
+            BOOST_CHECK_EQUAL(a[i][j].rotation, b[i][j].rotation);
+            BOOST_CHECK_EQUAL(a[i][j].distance, b[i][j].distance);
+            BOOST_CHECK_EQUAL(a[i][j].rotation, c[i][j].rotation);
+            BOOST_CHECK_EQUAL(a[i][j].distance, c[i][j].distance);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(invalid)
+{
+    BOOST_CHECK_THROW(TuningMatrix(0, maxSemis), std::invalid_argument);
+    BOOST_CHECK_THROW(TuningMatrix(bpo, -1), std::invalid_argument);
+    vector<TuningMatrix::Feature> profiles = makeProfiles();
+    profiles.push_back(TuningMatrix::Feature(bpo + 1));
+    BOOST_CHECK_THROW(TuningMatrix(bpo, maxSemis).compute(profiles),
+                      std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
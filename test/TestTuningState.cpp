@@ -0,0 +1,147 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+#include "src/TuningState.h"
+
+#include <sstream>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+using std::vector;
+using std::string;
+using std::istringstream;
+using std::ostringstream;
+
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(TestTuningState)
+
+static const int bpo = 12;
+static const int channels = 3;
+static const int distance = 2;
+
+static TuningState
+makeState(double scale)
+{
+    TuningState state(22050, bpo, channels, distance);
+    ChromaTotals::Column column(bpo);
+    for (int c = 0; c < channels; ++c) {
+        for (int i = 0; i < bpo; ++i) {
+            column[i] = scale * (c + 1) + i * 0.125;
+        }
+        state.getChannelTotals(c).add(column);
+        state.getChannelTotals(c).add(column);
+        state.setGatedFrames(c, 100 * (c + 1));
+    }
+    for (int o = -distance; o <= distance; ++o) {
+        for (int i = 0; i < bpo; ++i) {
+            column[i] = scale * (o + 10) - i;
+        }
+        state.getReferenceTotals(0, o).add(column);
+    }
+    state.setFrameCount(4096);
+    state.setResumeFrames(8192, 7168);
+    return state;
+}
+
+static void
+checkTotalsEqual(const ChromaTotals &a, const ChromaTotals &b)
+{
+    BOOST_CHECK_EQUAL(a.getColumnCount(), b.getColumnCount());
+    vector<double> x = a.getTotals(), y = b.getTotals();
+    BOOST_CHECK_EQUAL_COLLECTIONS(x.begin(), x.end(), y.begin(), y.end());
+}
+
+static void
+checkStatesEqual(const TuningState &a, const TuningState &b)
+{
+    BOOST_CHECK_EQUAL(a.getSampleRate(), b.getSampleRate());
+    BOOST_CHECK_EQUAL(a.getBinsPerOctave(), b.getBinsPerOctave());
+    BOOST_CHECK_EQUAL(a.getSearchDistance(), b.getSearchDistance());
+    BOOST_CHECK_EQUAL(a.getReferenceCount(), b.getReferenceCount());
+    BOOST_CHECK_EQUAL(a.getFrameCount(), b.getFrameCount());
+    BOOST_REQUIRE_EQUAL(a.getChannelCount(), b.getChannelCount());
+    for (int c = 0; c < a.getChannelCount(); ++c) {
+        checkTotalsEqual(a.getChannelTotals(c), b.getChannelTotals(c));
+        BOOST_CHECK_EQUAL(a.getGatedFrames(c), b.getGatedFrames(c));
+    }
+    for (int o = -distance; o <= distance; ++o) {
+        checkTotalsEqual(a.getReferenceTotals(0, o),
+                         b.getReferenceTotals(0, o));
+    }
+}
+
+static string
+serialise(const TuningState &state)
+{
+    ostringstream out;
+    state.write(out);
+    return out.str();
+}
+
+static TuningState
+deserialise(const string &data)
+{
+    istringstream in(data);
+    TuningState state;
+    state.read(in);
+    return state;
+}
+
+BOOST_AUTO_TEST_CASE(roundTrip)
+{
+    TuningState state = makeState(1.0);
+    TuningState loaded = deserialise(serialise(state));
+    checkStatesEqual(state, loaded);
+    BOOST_CHECK_EQUAL(loaded.getResumeFrame(), 8192);
+    BOOST_CHECK_EQUAL(loaded.getReferenceResumeFrame(), 7168);
+}
+
+BOOST_AUTO_TEST_CASE(merge)
+{
+    TuningState a = makeState(1.0), b = makeState(2.0);
+    b.setFrameCount(1024);
+    b.setResumeFrames(9216, 8192);
+    TuningState merged = a;
+    merged.merge(b);
+
+    BOOST_CHECK_EQUAL(merged.getFrameCount(), 5120);
+    BOOST_CHECK_EQUAL(merged.getResumeFrame(), 9216);
+    BOOST_CHECK_EQUAL(merged.getReferenceResumeFrame(), 8192);
+    for (int c = 0; c < channels; ++c) {
+        BOOST_CHECK_EQUAL(merged.getGatedFrames(c), 200 * (c + 1));
+        BOOST_CHECK_EQUAL(merged.getChannelTotals(c).getColumnCount(), 4);
+        vector<double> x = a.getChannelTotals(c).getTotals();
+        vector<double> y = b.getChannelTotals(c).getTotals();
+        vector<double> m = merged.getChannelTotals(c).getTotals();
+        for (int i = 0; i < bpo; ++i) {
+            BOOST_CHECK_CLOSE(m[i], x[i] + y[i], 1e-12);
+        }
+    }
+
+    TuningState other(22050, bpo, channels, distance + 1);
+    BOOST_CHECK_THROW(merged.merge(other), std::invalid_argument);
+}
+
+BOOST_AUTO_TEST_CASE(invalid)
+{
+    string data = serialise(makeState(1.0));
+
+    string magic = data;
+    magic[7] = '9';
+    BOOST_CHECK_THROW(deserialise(magic), std::runtime_error);
+
+    BOOST_CHECK_THROW(deserialise(""), std::runtime_error);
+    BOOST_CHECK_THROW(deserialise(data.substr(0, 20)), std::runtime_error);
+    BOOST_CHECK_THROW(deserialise(data.substr(0, data.size() - 1)),
+                      std::runtime_error);
+
+    TuningState state;
+    BOOST_CHECK_THROW(state.load("TestTuningState-missing.tds"),
+                      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()